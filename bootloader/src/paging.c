@@ -34,12 +34,15 @@ static inline uint64_t pt_index(uint64_t virt) {
 }
 
 //get or create a table at an entry
+//a huge page in the way is split into a table of the next smaller size so
+//the rest of its range stays mapped, huge_size is what the entry maps
 static EFI_STATUS get_or_create_table(
     EFI_BOOT_SERVICES *bs,
     page_entry_t *entry,
+    uint64_t huge_size,
     page_entry_t **child
 ) {
-    if (*entry & PTE_PRESENT) {
+    if ((*entry & PTE_PRESENT) && !(*entry & PTE_HUGE)) {
         *child = (page_entry_t *)(*entry & PTE_ADDR_MASK);
         return EFI_SUCCESS;
     }
@@ -49,10 +52,31 @@ static EFI_STATUS get_or_create_table(
         return status;
     }
     
+    if (*entry & PTE_PRESENT) {
+        uint64_t step = huge_size / 512;
+        uint64_t base = *entry & PTE_ADDR_MASK & ~(huge_size - 1);
+        uint64_t flags = *entry & ~PTE_ADDR_MASK;
+        if (step == PAGE_SIZE_4K) flags &= ~PTE_HUGE;
+        for (int i = 0; i < 512; i++) {
+            (*child)[i] = (base + i * step) | flags;
+        }
+    }
+    
     *entry = (uint64_t)*child | PTE_PRESENT | PTE_WRITABLE;
     return EFI_SUCCESS;
 }
 
+int paging_has_1gb_pages(void) {
+    uint32_t eax, ebx, ecx, edx;
+    
+    //Page1GB is CPUID.80000001h:EDX[26]
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000000), "c"(0));
+    if (eax < 0x80000001) return 0;
+    
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001), "c"(0));
+    return (edx >> 26) & 1;
+}
+
 EFI_STATUS paging_init(EFI_BOOT_SERVICES *bs, page_tables_t *pt) {
     EFI_STATUS status;
     
@@ -82,11 +106,11 @@ EFI_STATUS paging_map_2mb(
     uint64_t pd_idx = pd_index(virt);
     
     //get or create PDPT
-    status = get_or_create_table(bs, &pt->pml4[pml4_idx], &pdpt);
+    status = get_or_create_table(bs, &pt->pml4[pml4_idx], 0, &pdpt);
     if (EFI_ERROR(status)) return status;
     
     //get or create PD
-    status = get_or_create_table(bs, &pdpt[pdpt_idx], &pd);
+    status = get_or_create_table(bs, &pdpt[pdpt_idx], PAGE_SIZE_1G, &pd);
     if (EFI_ERROR(status)) return status;
     
     //set PD entry as 2MB huge page
@@ -95,6 +119,27 @@ EFI_STATUS paging_map_2mb(
     return EFI_SUCCESS;
 }
 
+EFI_STATUS paging_map_1gb(
+    EFI_BOOT_SERVICES *bs,
+    page_tables_t *pt,
+    uint64_t virt,
+    uint64_t phys,
+    uint64_t flags
+) {
+    EFI_STATUS status;
+    page_entry_t *pdpt;
+    
+    //get or create PDPT
+    status = get_or_create_table(bs, &pt->pml4[pml4_index(virt)], 0, &pdpt);
+    if (EFI_ERROR(status)) return status;
+    
+    //a PD left over from smaller mappings is simply dropped, the 1GB page
+    //covers everything it mapped
+    pdpt[pdpt_index(virt)] = (phys & ~(PAGE_SIZE_1G - 1)) | flags | PTE_HUGE | PTE_PRESENT;
+    
+    return EFI_SUCCESS;
+}
+
 EFI_STATUS paging_map_4kb(
     EFI_BOOT_SERVICES *bs,
     page_tables_t *pt,
@@ -112,15 +157,15 @@ EFI_STATUS paging_map_4kb(
     uint64_t pt_idx = pt_index(virt);
     
     //get or create PDPT
-    status = get_or_create_table(bs, &pt->pml4[pml4_idx], &pdpt);
+    status = get_or_create_table(bs, &pt->pml4[pml4_idx], 0, &pdpt);
     if (EFI_ERROR(status)) return status;
     
     //get or create PD
-    status = get_or_create_table(bs, &pdpt[pdpt_idx], &pd);
+    status = get_or_create_table(bs, &pdpt[pdpt_idx], PAGE_SIZE_1G, &pd);
     if (EFI_ERROR(status)) return status;
 
     //get or create PT
-    status = get_or_create_table(bs, &pd[pd_idx], &pt_table);
+    status = get_or_create_table(bs, &pd[pd_idx], PAGE_SIZE_2M, &pt_table);
     if (EFI_ERROR(status)) return status;
     
     //set PT entry
@@ -164,6 +209,36 @@ EFI_STATUS paging_identity_map(
 }
 
 
+//does the HHDM cover all of [start, end)
+//descriptors are not sorted so keep jumping to the end of whichever one holds
+//the current address
+static int hhdm_covers(
+    EFI_MEMORY_DESCRIPTOR *mmap,
+    UINTN mmap_size,
+    UINTN desc_size,
+    uint64_t start,
+    uint64_t end
+) {
+    UINTN entry_count = mmap_size / desc_size;
+    
+    while (start < end) {
+        uint64_t next = start;
+        for (UINTN i = 0; i < entry_count; i++) {
+            EFI_MEMORY_DESCRIPTOR *desc = (EFI_MEMORY_DESCRIPTOR *)((uint8_t *)mmap + i * desc_size);
+            if (desc->Type == EfiUnusableMemory) continue;
+            
+            uint64_t d_start = desc->PhysicalStart & ~(PAGE_SIZE_2M - 1);
+            uint64_t d_end = (desc->PhysicalStart + desc->NumberOfPages * PAGE_SIZE_4K + PAGE_SIZE_2M - 1)
+                             & ~(PAGE_SIZE_2M - 1);
+            if (d_start <= start && d_end > next) next = d_end;
+        }
+        if (next == start) return 0;
+        start = next;
+    }
+    
+    return 1;
+}
+
 EFI_STATUS paging_map_hhdm(
     EFI_BOOT_SERVICES *bs,
     page_tables_t *pt,
@@ -174,6 +249,7 @@ EFI_STATUS paging_map_hhdm(
     EFI_STATUS status;
     UINTN entry_count = mmap_size / desc_size;
     uint8_t *ptr = (uint8_t *)mmap;
+    int use_1gb = paging_has_1gb_pages();
     
     for (UINTN i = 0; i < entry_count; i++) {
         EFI_MEMORY_DESCRIPTOR *desc = (EFI_MEMORY_DESCRIPTOR *)ptr;
@@ -191,10 +267,22 @@ EFI_STATUS paging_map_hhdm(
         uint64_t map_start = start & ~(PAGE_SIZE_2M - 1);
         uint64_t map_end = (end + PAGE_SIZE_2M - 1) & ~(PAGE_SIZE_2M - 1);
         
-        for (uint64_t addr = map_start; addr < map_end; addr += PAGE_SIZE_2M) {
-            uint64_t virt = HHDM_OFFSET + addr;
-            status = paging_map_2mb(bs, pt, virt, addr, PTE_WRITABLE);
+        //every kernel access to physical memory goes through here so use 1GB
+        //pages wherever the memory map covers the whole gigabyte, the check
+        //only depends on the gigabyte so every descriptor in it agrees
+        uint64_t addr = map_start;
+        while (addr < map_end) {
+            uint64_t gb = addr & ~(PAGE_SIZE_1G - 1);
+            if (use_1gb && hhdm_covers(mmap, mmap_size, desc_size, gb, gb + PAGE_SIZE_1G)) {
+                status = paging_map_1gb(bs, pt, HHDM_OFFSET + gb, gb, PTE_WRITABLE);
+                if (EFI_ERROR(status)) return status;
+                addr = gb + PAGE_SIZE_1G;
+                continue;
+            }
+            
+            status = paging_map_2mb(bs, pt, HHDM_OFFSET + addr, addr, PTE_WRITABLE);
             if (EFI_ERROR(status)) return status;
+            addr += PAGE_SIZE_2M;
         }
         
         ptr += desc_size;
@@ -50,6 +50,18 @@ EFI_STATUS paging_map_2mb(
     uint64_t flags
 );
 
+//map a 1GB region: virt -> phys (needs paging_has_1gb_pages())
+EFI_STATUS paging_map_1gb(
+    EFI_BOOT_SERVICES *bs,
+    page_tables_t *pt,
+    uint64_t virt,
+    uint64_t phys,
+    uint64_t flags
+);
+
+//does the CPU support 1GB pages
+int paging_has_1gb_pages(void);
+
 //map a 4KB region: virt -> phys
 EFI_STATUS paging_map_4kb(
     EFI_BOOT_SERVICES *bs,
@@ -69,6 +81,8 @@ EFI_STATUS paging_identity_map(
 );
 
 //map all physical RAM to HHDM offset
+//uses 1GB pages where the CPU has them and the memory map covers the whole
+//gigabyte, 2MB pages elsewhere
 EFI_STATUS paging_map_hhdm(
     EFI_BOOT_SERVICES *bs,
     page_tables_t *pt,
@@ -0,0 +1,69 @@
+#include <arch/amd64/acpi.h>
+#include <boot/db.h>
+#include <mm/mm.h>
+#include <lib/io.h>
+#include <lib/string.h>
+
+typedef struct acpi_rsdp {
+    char signature[8];
+    uint8 checksum;
+    char oem_id[6];
+    uint8 revision;
+    uint32 rsdt_address;
+    //revision 2+
+    uint32 length;
+    uint64 xsdt_address;
+    uint8 ext_checksum;
+    uint8 reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+static bool checksum_ok(const void *p, size len) {
+    const uint8 *b = p;
+    uint8 sum = 0;
+    for (size i = 0; i < len; i++) sum += b[i];
+    return sum == 0;
+}
+
+static bool signature_is(const acpi_sdt_t *sdt, const char *signature) {
+    for (int i = 0; i < 4; i++) {
+        if (sdt->signature[i] != signature[i]) return false;
+    }
+    return true;
+}
+
+void *acpi_find_table(const char *signature) {
+    struct db_tag_acpi_rsdp *tag = db_get_acpi_rsdp();
+    if (!tag || !tag->rsdp_address) return NULL;
+
+    acpi_rsdp_t *rsdp = P2V(tag->rsdp_address);
+    if (!checksum_ok(rsdp, 20)) {
+        printf("[acpi] ERR: bad RSDP checksum\n");
+        return NULL;
+    }
+
+    //prefer the XSDT (64 bit pointers) when the firmware has one
+    bool xsdt = rsdp->revision >= 2 && rsdp->xsdt_address;
+    acpi_sdt_t *root = P2V(xsdt ? rsdp->xsdt_address : (uint64)rsdp->rsdt_address);
+    if (!checksum_ok(root, root->length)) {
+        printf("[acpi] ERR: bad %s checksum\n", xsdt ? "XSDT" : "RSDT");
+        return NULL;
+    }
+
+    size entry_size = xsdt ? 8 : 4;
+    size count = (root->length - sizeof(acpi_sdt_t)) / entry_size;
+    uint8 *entries = (uint8 *)(root + 1);
+
+    for (size i = 0; i < count; i++) {
+        uint64 phys;
+        if (xsdt) memcpy(&phys, entries + i * 8, 8);
+        else {
+            uint32 phys32;
+            memcpy(&phys32, entries + i * 4, 4);
+            phys = phys32;
+        }
+
+        acpi_sdt_t *sdt = P2V(phys);
+        if (signature_is(sdt, signature) && checksum_ok(sdt, sdt->length)) return sdt;
+    }
+    return NULL;
+}
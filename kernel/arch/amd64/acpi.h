@@ -0,0 +1,48 @@
+#ifndef ARCH_AMD64_ACPI_H
+#define ARCH_AMD64_ACPI_H
+
+#include <arch/amd64/types.h>
+
+//common header of every ACPI system description table
+typedef struct acpi_sdt {
+    char signature[4];
+    uint32 length;
+    uint8 revision;
+    uint8 checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32 oem_revision;
+    uint32 creator_id;
+    uint32 creator_revision;
+} __attribute__((packed)) acpi_sdt_t;
+
+//multiple APIC description table ("APIC")
+typedef struct acpi_madt {
+    acpi_sdt_t header;
+    uint32 lapic_address;
+    uint32 flags;
+    uint8 entries[];
+} __attribute__((packed)) acpi_madt_t;
+
+//MADT entry header, entries are packed back to back after the table header
+typedef struct acpi_madt_entry {
+    uint8 type;
+    uint8 length;
+} __attribute__((packed)) acpi_madt_entry_t;
+
+#define MADT_TYPE_LAPIC         0
+
+typedef struct acpi_madt_lapic {
+    acpi_madt_entry_t header;
+    uint8 processor_id;
+    uint8 apic_id;
+    uint32 flags;
+} __attribute__((packed)) acpi_madt_lapic_t;
+
+#define MADT_LAPIC_ENABLED      (1 << 0)
+#define MADT_LAPIC_ONLINE_CAPABLE (1 << 1)
+
+//find a table by its 4 character signature, NULL if missing or corrupt
+void *acpi_find_table(const char *signature);
+
+#endif
@@ -22,6 +22,54 @@ static inline void arch_pause(void) {
     __asm__ volatile ("pause");
 }
 
+//SMP (see smp.h)
+void arch_smp_init(void);
+void smp_poll(void);
+uint32 arch_cpu_count(void);
+void arch_cpu_kick(uint32 cpu);
+uint64 smp_online_mask(void);
+void smp_call_many(uint64 mask, void (*func)(void *arg), void *arg);
+
+//one iteration of a lock spin, a CPU spinning with interrupts off still has to
+//answer cross-CPU calls or the caller would wait on it forever
+static inline void arch_spin_relax(void) {
+    arch_pause();
+    smp_poll();
+}
+
+//kernel preemption - an interrupt only switches away from kernel code while
+//the count is zero (spinlocks hold it), need_resched is set by the tick when
+//the current thread's time is up and the interrupt return path acts on it
+
+static inline uint32 arch_preempt_count(void) {
+    uint32 count;
+    __asm__ volatile ("movl %%gs:%c1, %0" : "=r"(count) : "i"(PERCPU_PREEMPT));
+    return count;
+}
+
+static inline bool arch_need_resched(void) {
+    uint32 resched;
+    __asm__ volatile ("movl %%gs:%c1, %0" : "=r"(resched) : "i"(PERCPU_RESCHED));
+    return resched != 0;
+}
+
+static inline void arch_set_need_resched(bool resched) {
+    __asm__ volatile ("movl %0, %%gs:%c1" :: "r"((uint32)resched), "i"(PERCPU_RESCHED) : "memory");
+}
+
+static inline void arch_preempt_disable(void) {
+    __asm__ volatile ("incl %%gs:%c0" :: "i"(PERCPU_PREEMPT) : "memory");
+}
+
+//interrupt ourselves so a preemption held off by the count happens on the
+//way out of it (as soon as interrupts are on again)
+void arch_preempt_resched(void);
+
+static inline void arch_preempt_enable(void) {
+    __asm__ volatile ("decl %%gs:%c0" :: "i"(PERCPU_PREEMPT) : "memory");
+    if (!arch_preempt_count() && arch_need_resched()) arch_preempt_resched();
+}
+
 //memory barriers
 
 static inline void arch_mb(void) {
@@ -7,10 +7,13 @@
 #include <mm/pmm.h>
 #include <mm/mm.h>
 #include <mm/vmm.h>
+#include <arch/mmu.h>
 #include <mm/kheap.h>
 #include <obj/handle.h>
 #include <proc/process.h>
+#include <ipc/channel.h>
 #include <drivers/pci.h>
+#include <arch/amd64/percpu.h>
 
 extern void kernel_main(void);
 extern void enable_sse(void);
@@ -34,11 +37,17 @@ void arch_init(struct db_boot_info *boot_info) {
         printf("[amd64] cmdline = '%s'\n", cmdline);
     }
 
+    //GS based per-CPU data is needed by everything that takes a lock
+    percpu_init();
+
     pmm_init();
+    clock_page_init();
+    mmu_init();
     vmm_init();
     kheap_init();
     handle_init();
     proc_init();
+    channel_init();
 
     enable_sse();
     puts("[amd64] SSE enabled\n");
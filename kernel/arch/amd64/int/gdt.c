@@ -1,5 +1,6 @@
 #include <arch/amd64/interrupts.h>
 #include <arch/amd64/int/tss.h>
+#include <arch/amd64/percpu.h>
 #include <lib/io.h>
 
 //GDT entry (8 bytes)
@@ -29,14 +30,18 @@ struct gdt_ptr {
     uint64 base;
 } __attribute__((packed));
 
+//every CPU has its own GDT since the TSS descriptor's busy bit and the TSS
+//itself (RSP0, IST stacks) are per CPU
 //GDT: null + kernel code/data + user data/code + TSS (2 entries)
-static struct gdt_entry gdt[7];
-static struct gdt_ptr gp;
+typedef struct {
+    struct gdt_entry gdt[7];
+    struct gdt_ptr gp;
+    tss_t tss;
+} __attribute__((aligned(64))) cpu_gdt_t;
 
-//TSS instance
-static tss_t tss;
+static cpu_gdt_t cpu_gdts[MAX_CPUS];
 
-static void gdt_set_gate(int num, uint32 base, uint32 limit, uint8 access, uint8 gran) {
+static void gdt_set_gate(struct gdt_entry *gdt, int num, uint32 base, uint32 limit, uint8 access, uint8 gran) {
     gdt[num].base_low = (base & 0xFFFF);
     gdt[num].base_mid = (base >> 16) & 0xFF;
     gdt[num].base_high = (base >> 24) & 0xFF;
@@ -48,7 +53,7 @@ static void gdt_set_gate(int num, uint32 base, uint32 limit, uint8 access, uint8
     gdt[num].access = access;
 }
 
-static void gdt_set_tss(int num, uint64 base, uint32 limit) {
+static void gdt_set_tss(struct gdt_entry *gdt, int num, uint64 base, uint32 limit) {
     struct gdt_tss_entry *tss_entry = (struct gdt_tss_entry *)&gdt[num];
     
     tss_entry->limit_low = limit & 0xFFFF;
@@ -61,44 +66,47 @@ static void gdt_set_tss(int num, uint64 base, uint32 limit) {
     tss_entry->reserved = 0;
 }
 
-void gdt_init(void) {
+void gdt_init_cpu(uint32 cpu, void *ist_top) {
+    cpu_gdt_t *g = &cpu_gdts[cpu];
+    struct gdt_entry *gdt = g->gdt;
+    
     //initialize TSS
-    for (size i = 0; i < sizeof(tss); i++) {
-        ((uint8 *)&tss)[i] = 0;
+    for (size i = 0; i < sizeof(g->tss); i++) {
+        ((uint8 *)&g->tss)[i] = 0;
     }
-    tss.iopb_offset = sizeof(tss_t);  //no I/O bitmap
+    g->tss.iopb_offset = sizeof(tss_t);  //no I/O bitmap
 
     //set up GDT pointer (7 entries but TSS takes 2 slots)
-    gp.limit = (sizeof(struct gdt_entry) * 7) - 1;
-    gp.base = (uintptr)&gdt;
+    g->gp.limit = (sizeof(struct gdt_entry) * 7) - 1;
+    g->gp.base = (uintptr)gdt;
 
     //index 0: null segment
-    gdt_set_gate(0, 0, 0, 0, 0);
+    gdt_set_gate(gdt, 0, 0, 0, 0, 0);
     
     //index 1: kernel code (selector 0x08)
-    gdt_set_gate(1, 0, 0xFFFFFFFF, 0x9A, 0xAF);
+    gdt_set_gate(gdt, 1, 0, 0xFFFFFFFF, 0x9A, 0xAF);
     
     //index 2: kernel data (selector 0x10)
-    gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF);
+    gdt_set_gate(gdt, 2, 0, 0xFFFFFFFF, 0x92, 0xCF);
     
     //index 3: user data (selector 0x18) - DPL=3
-    gdt_set_gate(3, 0, 0xFFFFFFFF, 0xF2, 0xCF);
+    gdt_set_gate(gdt, 3, 0, 0xFFFFFFFF, 0xF2, 0xCF);
     
     //index 4: user code (selector 0x20) - DPL=3, 64-bit
-    gdt_set_gate(4, 0, 0xFFFFFFFF, 0xFA, 0xAF);
+    gdt_set_gate(gdt, 4, 0, 0xFFFFFFFF, 0xFA, 0xAF);
     
     //index 5-6: TSS (selector 0x28) - spans 2 entries
-    gdt_set_tss(5, (uint64)&tss, sizeof(tss_t) - 1);
+    gdt_set_tss(gdt, 5, (uint64)&g->tss, sizeof(tss_t) - 1);
     
-    //allocate IST1 stack (used for timer/all interrupts to get consistent frame)
-    //using a static buffer for nowww
-    static uint8 ist1_stack[16384] __attribute__((aligned(16)));
-    tss.ist[0] = (uint64)&ist1_stack[sizeof(ist1_stack)];  //stack grows down
+    //IST1 stack (used for timer/all interrupts to get consistent frame)
+    g->tss.ist[0] = (uint64)ist_top;
 
     //load GDT
-    __asm__ volatile ("lgdt %0" : : "m"(gp));
+    __asm__ volatile ("lgdt %0" : : "m"(g->gp));
 
     //reload segment registers
+    //GS is left alone, its base was loaded from IA32_GS_BASE by percpu setup
+    //and writing the selector would clear it
     __asm__ volatile (
         "mov $0x10, %%ax\n\t"
         "mov %%ax, %%ds\n\t"
@@ -106,7 +114,6 @@ void gdt_init(void) {
         "mov %%ax, %%ss\n\t"
         "xor %%ax, %%ax\n\t"
         "mov %%ax, %%fs\n\t"
-        "mov %%ax, %%gs\n\t"
         "pushq $0x08\n\t"
         "lea 1f(%%rip), %%rax\n\t"
         "push %%rax\n\t"
@@ -117,19 +124,28 @@ void gdt_init(void) {
 
     //load TSS
     __asm__ volatile ("ltr %w0" : : "r"((uint16)0x28));
+}
+
+void gdt_init(void) {
+    //boot CPU's IST1 stack is a static buffer, application processors get
+    //theirs from the heap when they are started
+    static uint8 ist1_stack[16384] __attribute__((aligned(16)));
+    gdt_init_cpu(0, &ist1_stack[sizeof(ist1_stack)]);
     
     puts("[gdt] initialized with TSS and IST1\n");
 }
 
 void tss_set_rsp0(uint64 rsp) {
-    tss.rsp0 = rsp;
+    cpu_gdts[arch_cpu_id()].tss.rsp0 = rsp;
 }
 
 tss_t *tss_get(void) {
-    return &tss;
+    return &cpu_gdts[arch_cpu_id()].tss;
 }
 
 //set kernel stack for ring 3 -> ring 0 transitions
+//interrupts use the TSS and syscalls the per-CPU copy
 void arch_set_kernel_stack(void *stack_top) {
     tss_set_rsp0((uint64)stack_top);
+    percpu_get()->kernel_rsp = (uint64)stack_top;
 }
@@ -2,6 +2,7 @@
 #include <arch/amd64/interrupts.h>
 #include <arch/amd64/timer.h>
 #include <drivers/keyboard.h>
+#include <mm/vmm.h>
 #include <lib/io.h>
 
 struct idt_entry {
@@ -28,13 +29,62 @@ static struct idtr idtr;
 extern void *isr_stub_table[];
 extern void arch_timer_tick(void);
 extern void sched_tick(int from_usermode);
+extern void sched_resched_ipi(int from_usermode);
+extern void smp_poll(void);
 
 static void irq0_handler(int from_usermode) {
     arch_timer_tick();
-    sched_tick(from_usermode);  //preemptive scheduling - only preempt if from usermode
+    sched_tick(from_usermode);  //preemptive scheduling
+}
+
+//interrupts raised by the local APIC itself (its timer and IPIs)
+static void lapic_handler(uint64 vector, int from_usermode) {
+    switch (vector) {
+        case LAPIC_VECTOR_SPURIOUS:
+            return;  //spurious interrupts take no EOI
+        case LAPIC_VECTOR_TIMER:
+            lapic_eoi();
+            sched_tick(from_usermode);
+            return;
+        case IPI_VECTOR_CALL:
+            smp_poll();
+            lapic_eoi();
+            return;
+        case IPI_VECTOR_RESCHEDULE:
+            //gets an idle CPU out of hlt, a busy one checks whether what was
+            //queued outranks the current thread
+            lapic_eoi();
+            sched_resched_ipi(from_usermode);
+            return;
+        default:
+            lapic_eoi();
+            return;
+    }
+}
+
+//translate the page fault error code for the VMM
+static uint32 page_fault_reason(uint64 error_code) {
+    uint32 reason = 0;
+    if (error_code & 1) reason |= VMM_FAULT_PRESENT;
+    if (error_code & 2) reason |= VMM_FAULT_WRITE;
+    if (error_code & 4) reason |= VMM_FAULT_USER;
+    if (error_code & 16) reason |= VMM_FAULT_EXEC;
+    return reason;
 }
 
 void interrupt_handler(uint64 vector, uint64 error_code, uint64 rip) {
+    //page faults on demand paged memory are resolved and the access retried
+    if (vector == 0xe) {
+        uint64 cr2;
+        __asm__ volatile ("mov %%cr2, %0" : "=r"(cr2));
+        if (vmm_page_fault(cr2, page_fault_reason(error_code)) == 0) return;
+    }
+
+    if (vector >= LAPIC_VECTOR_TIMER) {
+        lapic_handler(vector, rip < 0xFFFF800000000000ULL);
+        return;
+    }
+    
     if (vector < 32) {
         uint64 rsp;
         __asm__ volatile ("mov %%rsp, %0" : "=r"(rsp));
@@ -119,6 +169,11 @@ void arch_interrupts_init(void) {
     //remap PIC IRQ0-7 -> vectors 32-39, IRQ8-15 -> vectors 40-47
     pic_remap(0x20, 0x28);
 
+    idt_load();
+}
+
+//every CPU shares the one IDT
+void idt_load(void) {
     __asm__ volatile ("lidt %0" : : "m"(idtr));
 }
 
@@ -39,6 +39,11 @@ isr_stub_%+%1:
 
 extern interrupt_handler
 extern thread_current
+extern sched_preempt_pending
+extern sched_preempt_kernel
+
+;RFLAGS.IF
+%define RFLAGS_IF   0x200
 
 common_stub:
     ;save ALL general purpose registers
@@ -160,7 +165,7 @@ common_stub:
     ;the stack's CS tells us where we ACTUALLY came from and we must return there
     mov rax, [rsp + 144] ;get original CS from stack's iret frame
     and rax, 3
-    jz .restore_from_stack  ;kernel mode - use stack-based restore
+    jz .kernel_return  ;kernel mode - use stack-based restore
     
     ;get (POSSIBLY new) current thread to restore from
     call thread_current
@@ -213,6 +218,41 @@ common_stub:
     mov rcx, [rbx + CTX_R15]
     mov [rsp + 0], rcx
 
+    jmp .restore_from_stack
+
+.kernel_return:
+    ;kernel code with interrupts on can be preempted, we can't switch away
+    ;here since this IST stack is shared by every interrupt on the CPU so the
+    ;interrupted registers go on the thread's own stack and we iretq into
+    ;preempt_trampoline which does the switch from there
+    test qword [rsp + 152], RFLAGS_IF
+    jz .restore_from_stack  ;interrupts were off - critical section
+    call sched_preempt_pending
+    test al, al
+    jz .restore_from_stack
+    
+    ;frame below the interrupted RSP, top down: RIP, RFLAGS, then the GPRs in
+    ;the same order as here (rax highest, r15 lowest)
+    mov rdx, [rsp + 160]    ;interrupted RSP
+    mov rcx, [rsp + 136]    ;RIP
+    mov [rdx - 8], rcx
+    mov rcx, [rsp + 152]    ;RFLAGS
+    mov [rdx - 16], rcx
+    sub rdx, 16
+    mov rcx, 15
+.copy_gprs:
+    sub rdx, 8
+    mov rax, [rsp + rcx*8 - 8]
+    mov [rdx], rax
+    dec rcx
+    jnz .copy_gprs
+    
+    ;return into the trampoline on that stack with interrupts still off
+    lea rcx, [rel preempt_trampoline]
+    mov [rsp + 136], rcx
+    and qword [rsp + 152], ~RFLAGS_IF
+    mov [rsp + 160], rdx
+
 .restore_from_stack:
     ;restore all GPRs
     pop r15
@@ -244,6 +284,33 @@ common_stub:
     
     iretq
 
+;kernel code preempted by an interrupt continues here on its own stack (see
+;.kernel_return), switches away and once scheduled again picks up where it
+;was interrupted
+preempt_trampoline:
+    mov rbx, rsp            ;the interrupted RSP was never aligned for a call
+    and rsp, -16
+    call sched_preempt_kernel
+    mov rsp, rbx
+    
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rbp
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rbx
+    pop rax
+    popfq                   ;interrupts back on as they were
+    ret
+
 ;CPU exceptions (0-31)
 isr_no_err_stub 0
 isr_no_err_stub 1
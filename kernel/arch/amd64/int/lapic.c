@@ -0,0 +1,196 @@
+#include <arch/amd64/types.h>
+#include <arch/amd64/io.h>
+#include <arch/amd64/interrupts.h>
+#include <arch/amd64/percpu.h>
+#include <arch/amd64/cpu.h>
+#include <arch/timer.h>
+#include <arch/mmu.h>
+#include <mm/kheap.h>
+#include <mm/vmm.h>
+#include <lib/io.h>
+
+#define IA32_APIC_BASE      0x1B
+#define IA32_TSC_DEADLINE   0x6E0
+#define APIC_BASE_ENABLE    (1ULL << 11)
+
+//register offsets
+#define LAPIC_ID            0x020
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_TIMER_INIT    0x380
+#define LAPIC_TIMER_CUR     0x390
+#define LAPIC_TIMER_DIV     0x3E0
+
+#define LAPIC_SVR_ENABLE    (1 << 8)
+#define LVT_MASKED          (1 << 16)
+#define LVT_TIMER_DEADLINE  (2 << 17)
+#define LVT_EXTINT          (7 << 8)
+#define LVT_NMI             (4 << 8)
+#define ICR_INIT            (5 << 8)
+#define ICR_STARTUP         (6 << 8)
+#define ICR_ASSERT          (1 << 14)
+#define ICR_PENDING         (1 << 12)
+#define ICR_SELF            (1 << 18)
+#define TIMER_DIV_16        0x3
+
+//PIT ticks the timer calibration runs over
+#define CALIBRATE_TICKS     5
+
+static volatile uint32 *lapic = NULL;
+static uint64 lapic_timer_hz = 0;   //timer counts per second at TIMER_DIV_16
+static bool tsc_deadline = false;   //timer armed with an absolute TSC value
+
+//longest a single arm reaches, later deadlines just take an extra interrupt
+//(keeps the ns to counts conversion well inside 64 bits)
+#define MAX_ARM_NS          NS_PER_SEC
+
+static inline uint32 lapic_read(uint32 reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32 reg, uint32 value) {
+    lapic[reg / 4] = value;
+}
+
+void lapic_init(void) {
+    uint64 base = rdmsr(IA32_APIC_BASE);
+    wrmsr(IA32_APIC_BASE, base | APIC_BASE_ENABLE);
+
+    //the registers are MMIO outside of RAM so the HHDM may not cover them
+    void *virt = kvalloc(1);
+    if (!virt) {
+        printf("[lapic] ERR: no address space for registers\n");
+        return;
+    }
+    vmm_kernel_map((uintptr)virt, base & AMD64_PTE_ADDR_MASK, 1,
+                   MMU_FLAG_PRESENT | MMU_FLAG_WRITE | MMU_FLAG_NOCACHE);
+    lapic = (volatile uint32 *)virt;
+
+    //keep legacy PIC interrupts flowing to the boot CPU through LINT0
+    if (lapic_read(LAPIC_LVT_LINT0) & LVT_MASKED) {
+        lapic_write(LAPIC_LVT_LINT0, LVT_EXTINT);
+        lapic_write(LAPIC_LVT_LINT1, LVT_NMI);
+    }
+
+    lapic_enable();
+    percpu_get()->apic_id = lapic_id();
+
+    printf("[lapic] base 0x%llX, boot CPU APIC ID %u\n", base & AMD64_PTE_ADDR_MASK, lapic_id());
+}
+
+//software enable the calling CPU's local APIC
+void lapic_enable(void) {
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_VECTOR_SPURIOUS);
+}
+
+uint32 lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+//the two ICR writes must not be split by an interrupt that sends its own IPI
+static void lapic_send(uint32 apic_id, uint32 command) {
+    irq_state_t flags = arch_irq_save();
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) __asm__ volatile ("pause");
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    arch_irq_restore(flags);
+}
+
+void lapic_send_ipi(uint32 apic_id, uint8 vector) {
+    lapic_send(apic_id, ICR_ASSERT | vector);
+}
+
+void lapic_send_self(uint8 vector) {
+    if (!lapic) return;
+    lapic_send(0, ICR_SELF | ICR_ASSERT | vector);
+}
+
+void lapic_send_init(uint32 apic_id) {
+    lapic_send(apic_id, ICR_INIT | ICR_ASSERT);
+}
+
+//start an application processor at physical address page << 12
+void lapic_send_startup(uint32 apic_id, uint8 page) {
+    lapic_send(apic_id, ICR_STARTUP | ICR_ASSERT | page);
+}
+
+//measure the timer (and the TSC) against the PIT, every CPU's runs at the
+//same rate so the boot CPU does it once (needs the PIT running and interrupts on)
+void lapic_timer_calibrate(void) {
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED | LAPIC_VECTOR_TIMER);
+
+    //start on a tick edge
+    uint64 start = arch_timer_get_ticks();
+    while (arch_timer_get_ticks() == start) __asm__ volatile ("pause");
+
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    uint64 tsc_start = arch_rdtsc();
+    start = arch_timer_get_ticks();
+    while (arch_timer_get_ticks() - start < CALIBRATE_TICKS) __asm__ volatile ("pause");
+    uint32 elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+    uint64 tsc_elapsed = arch_rdtsc() - tsc_start;
+    lapic_write(LAPIC_TIMER_INIT, 0);
+
+    lapic_timer_hz = (uint64)elapsed * arch_timer_getfreq() / CALIBRATE_TICKS;
+    printf("[lapic] timer runs at %llu Hz\n", lapic_timer_hz);
+
+    if (tsc_present()) {
+        tsc_init(tsc_elapsed * arch_timer_getfreq() / CALIBRATE_TICKS);
+        tsc_deadline = tsc_deadline_supported();
+        if (tsc_deadline) puts("[lapic] using TSC-deadline mode\n");
+    }
+}
+
+//put the calling CPU's timer in one-shot mode, it stays quiet until armed
+void lapic_timer_init_cpu(void) {
+    if (!lapic_timer_hz) return;
+    if (tsc_deadline) {
+        lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_DEADLINE | LAPIC_VECTOR_TIMER);
+        wrmsr(IA32_TSC_DEADLINE, 0);
+    } else {
+        lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_VECTOR_TIMER);
+        lapic_write(LAPIC_TIMER_INIT, 0);
+    }
+}
+
+bool lapic_timer_ready(void) {
+    return lapic_timer_hz != 0;
+}
+
+void arch_timer_oneshot(uint64 deadline) {
+    if (!lapic_timer_hz) return;  //the PIT tick drives sched_tick() instead
+
+    if (!deadline) {
+        if (tsc_deadline) wrmsr(IA32_TSC_DEADLINE, 0);
+        else lapic_write(LAPIC_TIMER_INIT, 0);
+        return;
+    }
+
+    uint64 now = arch_timer_ns();
+    uint64 delta = deadline > now ? deadline - now : 0;
+    if (delta > MAX_ARM_NS) delta = MAX_ARM_NS;
+
+    if (tsc_deadline) {
+        //a deadline already passed fires right away
+        wrmsr(IA32_TSC_DEADLINE, arch_rdtsc() + tsc_from_ns(delta));
+        return;
+    }
+
+    uint64 count = delta * lapic_timer_hz / NS_PER_SEC;
+    if (count == 0) count = 1;
+    if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+    lapic_write(LAPIC_TIMER_INIT, (uint32)count);
+}
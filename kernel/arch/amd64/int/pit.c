@@ -1,6 +1,7 @@
 #include <arch/amd64/types.h>
 #include <arch/amd64/io.h>
 #include <arch/amd64/interrupts.h>
+#include <arch/timer.h>
 
 #define PIT_CMD   0x43
 #define PIT_CH0   0x40
@@ -14,9 +15,16 @@ void arch_timer_tick(void) {
 }
 
 uint64 arch_timer_get_ticks(void) {
+    //the PIT stops once the TSC keeps time so derive ticks from the clock
+    if (tsc_get_hz()) return arch_timer_ns() / (NS_PER_SEC / timer_freq);
     return timer_ticks;
 }
 
+uint64 pit_ns(void) {
+    if (!timer_freq) return 0;
+    return timer_ticks * (NS_PER_SEC / timer_freq);
+}
+
 void arch_timer_setfreq(uint32 hz) {
     if (hz == 0) return;
     timer_freq = hz;
@@ -33,4 +41,10 @@ uint32 arch_timer_getfreq(void) {
 void arch_timer_init(uint32 hz) {
     arch_timer_setfreq(hz);
     pic_clear_mask(0);
-}
\ No newline at end of file
+}
+
+//the PIT is only a time base, once the TSC is calibrated it would just wake
+//the boot CPU up 100 times a second for nothing
+void pit_stop(void) {
+    pic_set_mask(0);
+}
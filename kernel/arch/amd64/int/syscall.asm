@@ -12,6 +12,13 @@ syscall_entry_simple:
     mov [gs:PERCPU_USER_RSP], rsp
     mov rsp, [gs:PERCPU_KERNEL_RSP]
     
+    ;the call can block or be preempted and another thread may syscall on this
+    ;CPU meanwhile (or we come back on another one) so keep the user RSP with us
+    push qword [gs:PERCPU_USER_RSP]
+    
+    ;syscalls run with interrupts on so they can be preempted
+    sti
+    
     push rcx
     push r11
     push rbp
@@ -33,6 +40,9 @@ syscall_entry_simple:
     
     call syscall_dispatch
     
+    ;nothing may interrupt us once we start restoring user state
+    cli
+    
     add rsp, 8
     
     pop r15
@@ -46,7 +56,7 @@ syscall_entry_simple:
     pop r11
     pop rcx
     
-    mov rsp, [gs:PERCPU_USER_RSP]
+    pop rsp
     
     swapgs
     
@@ -15,9 +15,8 @@
 
 extern void syscall_entry_simple(void);
 
+//per CPU, the MSRs are not shared
 void syscall_init(void) {
-    percpu_init();
-    
     //STAR MSR format:
     //[63:48] = SYSRET CS/SS base (SS = base+8 CS = base+16 for 64-bit)
     //[47:32] = SYSCALL CS/SS base (CS = base SS = base+8)
@@ -33,5 +32,5 @@ void syscall_init(void) {
     efer |= EFER_SCE;
     wrmsr(IA32_EFER, efer);
     
-    puts("[syscall] initialized\n");
+    if (arch_cpu_id() == 0) puts("[syscall] initialized\n");
 }
@@ -13,6 +13,8 @@ void arch_interrupts_disable(void);
 #define GDT_KERNEL_DATA 0x10
 
 void gdt_init(void);
+void gdt_init_cpu(uint32 cpu, void *ist_top);
+void idt_load(void);
 void syscall_init(void);
 void pic_send_eoi(uint8 irq);
 void pic_remap(uint8 vector1, uint8 vector2);
@@ -20,4 +22,22 @@ void pic_disable(void);
 void pic_set_mask(uint8 irqline);
 void pic_clear_mask(uint8 irqline);
 
+//local APIC vectors, above everything the PIC can raise
+#define LAPIC_VECTOR_TIMER      0xF0
+#define IPI_VECTOR_RESCHEDULE   0xF1    //wake an idle CPU to look for work (or preempt ourselves)
+#define IPI_VECTOR_CALL         0xF2    //run a cross-CPU call (see smp.h)
+#define LAPIC_VECTOR_SPURIOUS   0xFF
+
+void lapic_init(void);
+void lapic_enable(void);
+uint32 lapic_id(void);
+void lapic_eoi(void);
+void lapic_send_ipi(uint32 apic_id, uint8 vector);
+void lapic_send_self(uint8 vector);
+void lapic_send_init(uint32 apic_id);
+void lapic_send_startup(uint32 apic_id, uint8 page);
+void lapic_timer_calibrate(void);
+void lapic_timer_init_cpu(void);
+bool lapic_timer_ready(void);
+
 #endif
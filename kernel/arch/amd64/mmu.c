@@ -3,21 +3,44 @@
 #include <mm/mm.h>
 #include <lib/string.h>
 #include <lib/io.h>
+#include <arch/amd64/cpu.h>
+#include <arch/amd64/smp.h>
 
 static pagemap_t kernel_pagemap;
 
+//process address spaces are tagged with a PCID so switching between them
+//keeps TLB entries alive, PCIDs are handed out per CPU from a small set of
+//slots and the least recently assigned slot is recycled when they run out
+//PCID 0 is the kernel pagemap, slot i uses PCID i + 1
+#define PCID_SLOTS 16
+
+typedef struct {
+    uint64 map_id[PCID_SLOTS];   //pagemap owning each slot (0 = free)
+    uint64 tlb_gen[PCID_SLOTS];  //tlb_gen of that pagemap when last flushed here
+    uint32 victim;               //next slot to recycle
+} __attribute__((aligned(64))) pcid_cpu_t;
+
+static pcid_cpu_t pcid_cpus[MAX_CPUS];
+static bool pcid_enabled = false;
+static bool pge_enabled = false;
+static uint64 next_pagemap_id = 1;
+
+//kernel half translations are the same in every address space
+#define KERNEL_HALF_START 0xFFFF800000000000ULL
+
 pagemap_t *mmu_get_kernel_pagemap(void) {
     if (kernel_pagemap.top_level == 0) {
         //retrieve current PML4 from CR3 on first call
         uintptr cr3;
         __asm__ volatile ("mov %%cr3, %0" : "=r"(cr3));
-        kernel_pagemap.top_level = cr3;
+        kernel_pagemap.top_level = cr3 & AMD64_PTE_ADDR_MASK;
     }
     return &kernel_pagemap;
 }
 
 static uint64 *get_next_level(uint64 *current_table, uint32 index, bool allocate, bool user) {
     uint64 entry = current_table[index];
+    if (entry & AMD64_PTE_HUGE) return NULL;  //a page, not a table
     if (entry & AMD64_PTE_PRESENT) {
         //if we need user access and entry doesn't have it, add it
         if (user && !(entry & AMD64_PTE_USER)) {
@@ -29,11 +52,10 @@ static uint64 *get_next_level(uint64 *current_table, uint32 index, bool allocate
     if (!allocate) return NULL;
     
     //allocate a new page for the next level table
-    void *next_table_phys = pmm_alloc(1);
+    void *next_table_phys = pmm_alloc_zeroed(1);
     if (!next_table_phys) return NULL;
     
     uint64 *next_table_virt = (uint64 *)P2V(next_table_phys);
-    memset(next_table_virt, 0, PAGE_SIZE);
     
     //set entry in current table to point to new table
     //we set all permissions here as actual permissions are enforced in the leaf PTE
@@ -44,10 +66,197 @@ static uint64 *get_next_level(uint64 *current_table, uint32 index, bool allocate
     return next_table_virt;
 }
 
+//replace a huge page entry with a table mapping the same range in pages one
+//size smaller so part of it can be remapped (1GB HHDM pages into 2MB ones,
+//2MB ones into 4KB ones)
+static bool split_huge(uint64 *entry, uint64 huge_size) {
+    void *phys = pmm_alloc(1);
+    if (!phys) return false;
+    uint64 *table = (uint64 *)P2V(phys);
+
+    uint64 step = huge_size / 512;
+    uint64 base = *entry & AMD64_PTE_ADDR_MASK & ~(huge_size - 1);
+    uint64 flags = *entry & ~AMD64_PTE_ADDR_MASK;
+    if (step == PAGE_SIZE) flags &= ~AMD64_PTE_HUGE;
+    for (int i = 0; i < 512; i++) table[i] = (base + i * step) | flags;
+
+    *entry = (uintptr)phys | AMD64_PTE_PRESENT | AMD64_PTE_WRITE | (*entry & AMD64_PTE_USER);
+    return true;
+}
+
+//bytes covered by one entry of a table at the given level (1 = PT)
+#define LEVEL_SHIFT(level) (12 + 9 * ((level) - 1))
+
+//page runs waiting in a gather are linked through their first bytes
+typedef struct {
+    uintptr next;
+    size pages;
+} gather_run_t;
+
+//the kernel half is one set of tables shared by every pagemap
+static inline spinlock_t *table_lock(pagemap_t *map, uintptr virt) {
+    return virt >= KERNEL_HALF_START ? &kernel_pagemap.lock : &map->lock;
+}
+
+void mmu_gather_init(mmu_gather_t *g, pagemap_t *map) {
+    g->map = map;
+    g->count = 0;
+    g->full = false;
+    g->global = false;
+    g->freed = 0;
+}
+
+static void gather_addr(mmu_gather_t *g, uintptr virt) {
+    if (virt >= KERNEL_HALF_START) g->global = true;
+    if (g->full) return;
+    if (g->count == MMU_GATHER_MAX) {
+        g->full = true;
+        return;
+    }
+    g->addrs[g->count++] = virt;
+}
+
+void mmu_gather_free(mmu_gather_t *g, uintptr phys, size pages) {
+    gather_run_t *run = (gather_run_t *)P2V(phys);
+    run->next = g->freed;
+    run->pages = pages;
+    g->freed = phys;
+}
+
+static bool table_empty(uint64 *table) {
+    for (int i = 0; i < 512; i++) {
+        if (table[i] & AMD64_PTE_PRESENT) return false;
+    }
+    return true;
+}
+
+//clear the inclusive range [virt, last] below a table, skipping whole missing
+//subtrees and reclaiming tables left empty
+static void unmap_level(mmu_gather_t *g, uint64 *table, int level, uintptr virt, uintptr last) {
+    uint64 span = 1ULL << LEVEL_SHIFT(level);
+
+    while (virt <= last) {
+        uint64 *entry = &table[(virt >> LEVEL_SHIFT(level)) & 0x1FF];
+        uintptr next = (virt & ~(span - 1)) + span;
+        uintptr stop = (next == 0 || next - 1 > last) ? last : next - 1;
+
+        if (*entry & AMD64_PTE_PRESENT) {
+            if (level == 1 || (*entry & AMD64_PTE_HUGE)) {
+                //huge pages go as a whole, nothing maps part of one
+                *entry = 0;
+                gather_addr(g, virt & ~(span - 1));
+            } else {
+                uintptr child_phys = *entry & AMD64_PTE_ADDR_MASK;
+                uint64 *child = (uint64 *)P2V(child_phys);
+                unmap_level(g, child, level - 1, virt, stop);
+
+                //kernel half PDPTs are referenced from every PML4 copy so they stay
+                bool shared = level == 4 && virt >= KERNEL_HALF_START;
+                if (!shared && table_empty(child)) {
+                    *entry = 0;
+                    //the paging structure caches may still point at the table,
+                    //for the kernel half that is true under every PCID
+                    gather_addr(g, virt);
+                    if (virt >= KERNEL_HALF_START) g->full = true;
+                    mmu_gather_free(g, child_phys, 1);
+                }
+            }
+        }
+
+        if (next == 0) break;
+        virt = next;
+    }
+}
+
+void mmu_unmap_gather(mmu_gather_t *g, uintptr virt, size pages) {
+    if (pages == 0) return;
+
+    spinlock_t *lock = table_lock(g->map, virt);
+    irq_state_t flags = spinlock_acquire_irqsave(lock);
+    unmap_level(g, (uint64 *)P2V(g->map->top_level), 4, virt, virt + pages * PAGE_SIZE - 1);
+    spinlock_release_irqrestore(lock, flags);
+}
+
+//drop every TLB entry including global ones and those of other PCIDs
+static void flush_everything(void) {
+    uint64 cr4;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+    if (cr4 & (1ULL << 7)) {
+        __asm__ volatile ("mov %0, %%cr4" :: "r"(cr4 & ~(1ULL << 7)) : "memory");
+        __asm__ volatile ("mov %0, %%cr4" :: "r"(cr4) : "memory");
+    } else {
+        uint64 cr3;
+        __asm__ volatile ("mov %%cr3, %0" : "=r"(cr3));
+        __asm__ volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    }
+}
+
+//invalidate a gather's translations in this CPU's TLB
+static void gather_flush_local(mmu_gather_t *g, uint64 gen) {
+    uint64 cr3;
+    __asm__ volatile ("mov %%cr3, %0" : "=r"(cr3));
+    bool active = (cr3 & AMD64_PTE_ADDR_MASK) == g->map->top_level;
+
+    if (g->full) {
+        if (g->global) flush_everything();
+        else if (active) __asm__ volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    } else if (g->global || active) {
+        for (uint32 i = 0; i < g->count; i++) {
+            __asm__ volatile ("invlpg (%0)" :: "r"(g->addrs[i]) : "memory");
+        }
+    }
+
+    //our own PCID is clean now, spare the next switch a flush
+    if (active && pcid_enabled && (cr3 & AMD64_CR3_PCID_MASK)) {
+        pcid_cpus[arch_cpu_id()].tlb_gen[(cr3 & AMD64_CR3_PCID_MASK) - 1] = gen;
+    }
+}
+
+static void gather_flush_ipi(void *arg) {
+    mmu_gather_t *g = (mmu_gather_t *)arg;
+    gather_flush_local(g, __atomic_load_n(&g->map->tlb_gen, __ATOMIC_ACQUIRE));
+}
+
+void mmu_gather_flush(mmu_gather_t *g) {
+    if (g->count || g->full) {
+        //a CPU that switches to the map later sees the new generation and
+        //flushes its PCID, so only TLBs live right now need work here
+        uint64 gen = __atomic_add_fetch(&g->map->tlb_gen, 1, __ATOMIC_SEQ_CST);
+
+        irq_state_t flags = arch_irq_save();
+        gather_flush_local(g, gen);
+
+        //kernel half entries can be cached anywhere, user ones only where
+        //the map is loaded (mmu_switch publishes that before reading tlb_gen)
+        uint64 targets = 0;
+        if (arch_cpu_count() > 1) {
+            uint64 online = smp_online_mask();
+            for (uint64 m = online; m; m &= m - 1) {
+                uint32 cpu = __builtin_ctzll(m);
+                if (g->global || __atomic_load_n(&percpu_of(cpu)->pagemap, __ATOMIC_SEQ_CST) == g->map) {
+                    targets |= 1ULL << cpu;
+                }
+            }
+        }
+        smp_call_many(targets, gather_flush_ipi, g);
+        arch_irq_restore(flags);
+    }
+
+    while (g->freed) {
+        gather_run_t *run = (gather_run_t *)P2V(g->freed);
+        uintptr phys = g->freed;
+        g->freed = run->next;
+        pmm_free((void *)phys, run->pages);
+    }
+
+    mmu_gather_init(g, g->map);
+}
+
 void mmu_map_range(pagemap_t *map, uintptr virt, uintptr phys, size pages, uint64 flags) {
     uint64 *pml4 = (uint64 *)P2V(map->top_level);
     
     uint64 pte_flags = AMD64_PTE_PRESENT;
+    if (virt >= KERNEL_HALF_START && !(flags & MMU_FLAG_USER)) pte_flags |= AMD64_PTE_GLOBAL;
     if (flags & MMU_FLAG_WRITE) pte_flags |= AMD64_PTE_WRITE;
     if (flags & MMU_FLAG_USER)  pte_flags |= AMD64_PTE_USER;
     if (flags & MMU_FLAG_NOCACHE) pte_flags |= (AMD64_PTE_PCD | AMD64_PTE_PWT);
@@ -55,59 +264,68 @@ void mmu_map_range(pagemap_t *map, uintptr virt, uintptr phys, size pages, uint6
     
     bool user = (flags & MMU_FLAG_USER) != 0;
 
+    //only replaced translations need invalidating, the TLB never caches
+    //not present entries
+    mmu_gather_t g;
+    mmu_gather_init(&g, map);
+    spinlock_t *lock = table_lock(map, virt);
+    irq_state_t irq = spinlock_acquire_irqsave(lock);
+
     size i = 0;
     while (i < pages) {
         uintptr cur_virt = virt + (i * PAGE_SIZE);
         uintptr cur_phys = phys + (i * PAGE_SIZE);
 
         uint64 *pdp = get_next_level(pml4, PML4_IDX(cur_virt), true, user);
-        if (!pdp) return;
+        if (!pdp) break;
         
+        //the old large TLB entry has to go along with the split
+        if (pdp[PDP_IDX(cur_virt)] & AMD64_PTE_HUGE) {
+            if (!split_huge(&pdp[PDP_IDX(cur_virt)], 0x40000000)) break;
+            gather_addr(&g, cur_virt);
+        }
         uint64 *pd = get_next_level(pdp, PDP_IDX(cur_virt), true, user);
-        if (!pd) return;
+        if (!pd) break;
 
         //try to map a 2MB huge page
-        if (pages - i >= 512 && (cur_virt % 0x200000 == 0) && (cur_phys % 0x200000 == 0)) {
+        //a page table left from earlier 4K mappings is freed when it is empty,
+        //one that still holds translations keeps the span on 4K pages
+        uint64 old = pd[PD_IDX(cur_virt)];
+        bool huge = pages - i >= 512 && (cur_virt % 0x200000 == 0) && (cur_phys % 0x200000 == 0);
+        bool old_pt = (old & AMD64_PTE_PRESENT) && !(old & AMD64_PTE_HUGE);
+        if (huge && old_pt && !table_empty((uint64 *)P2V(old & AMD64_PTE_ADDR_MASK))) huge = false;
+        
+        if (huge) {
+            if (old_pt) {
+                mmu_gather_free(&g, old & AMD64_PTE_ADDR_MASK, 1);
+                if (cur_virt >= KERNEL_HALF_START) g.full = true;
+            }
+            if (old & AMD64_PTE_PRESENT) gather_addr(&g, cur_virt);
             pd[PD_IDX(cur_virt)] = (cur_phys & AMD64_PTE_ADDR_MASK) | pte_flags | AMD64_PTE_HUGE;
             i += 512;
         } else {
+            if (pd[PD_IDX(cur_virt)] & AMD64_PTE_HUGE) {
+                if (!split_huge(&pd[PD_IDX(cur_virt)], 0x200000)) break;
+                gather_addr(&g, cur_virt);
+            }
             uint64 *pt = get_next_level(pd, PD_IDX(cur_virt), true, user);
-            if (!pt) return;
+            if (!pt) break;
+            //replacing a live translation (e.g. a copy-on-write upgrade)
+            if (pt[PT_IDX(cur_virt)] & AMD64_PTE_PRESENT) gather_addr(&g, cur_virt);
             pt[PT_IDX(cur_virt)] = (cur_phys & AMD64_PTE_ADDR_MASK) | pte_flags;
             i++;
         }
-        
-        //invalidate TLB for this address
-        __asm__ volatile ("invlpg (%0)" :: "r"(cur_virt) : "memory");
     }
+
+    spinlock_release_irqrestore(lock, irq);
+    mmu_gather_flush(&g);
 }
 
 void mmu_unmap_range(pagemap_t *map, uintptr virt, size pages) {
-    uint64 *pml4 = (uint64 *)P2V(map->top_level);
-    
-    for (size i = 0; i < pages; ) {
-        uintptr cur_virt = virt + (i * PAGE_SIZE);
-
-        uint64 *pdp = get_next_level(pml4, PML4_IDX(cur_virt), false, false);
-        if (!pdp) { i++; continue; }
-        
-        uint64 *pd = get_next_level(pdp, PDP_IDX(cur_virt), false, false);
-        if (!pd) { i++; continue; }
-
-        uint64 pd_entry = pd[PD_IDX(cur_virt)];
-        if (pd_entry & AMD64_PTE_HUGE) {
-            pd[PD_IDX(cur_virt)] = 0;
-            i += 512;
-        } else {
-            uint64 *pt = get_next_level(pd, PD_IDX(cur_virt), false, false);
-            if (pt) {
-                pt[PT_IDX(cur_virt)] = 0;
-            }
-            i++;
-        }
-        
-        __asm__ volatile ("invlpg (%0)" :: "r"(cur_virt) : "memory");
-    }
+    mmu_gather_t g;
+    mmu_gather_init(&g, map);
+    mmu_unmap_gather(&g, virt, pages);
+    mmu_gather_flush(&g);
 }
 
 uintptr mmu_virt_to_phys(pagemap_t *map, uintptr virt) {
@@ -116,6 +334,12 @@ uintptr mmu_virt_to_phys(pagemap_t *map, uintptr virt) {
     uint64 *pdp = get_next_level(pml4, PML4_IDX(virt), false, false);
     if (!pdp) return 0;
     
+    uint64 pdp_entry = pdp[PDP_IDX(virt)];
+    if ((pdp_entry & AMD64_PTE_PRESENT) && (pdp_entry & AMD64_PTE_HUGE)) {
+        //1GB huge page (the bootloader maps the HHDM with them)
+        return (pdp_entry & AMD64_PTE_ADDR_MASK & ~0x3FFFFFFFULL) + (virt & 0x3FFFFFFF);
+    }
+    
     uint64 *pd = get_next_level(pdp, PDP_IDX(virt), false, false);
     if (!pd) return 0;
 
@@ -124,7 +348,7 @@ uintptr mmu_virt_to_phys(pagemap_t *map, uintptr virt) {
     
     if (pd_entry & AMD64_PTE_HUGE) {
         //2MB huge page
-        return (pd_entry & AMD64_PTE_ADDR_MASK) + (virt & 0x1FFFFF);
+        return (pd_entry & AMD64_PTE_ADDR_MASK & ~0x1FFFFFULL) + (virt & 0x1FFFFF);
     }
 
     uint64 *pt = get_next_level(pd, PD_IDX(virt), false, false);
@@ -137,7 +361,119 @@ uintptr mmu_virt_to_phys(pagemap_t *map, uintptr virt) {
 }
 
 void mmu_switch(pagemap_t *map) {
-    __asm__ volatile ("mov %0, %%cr3" :: "r"(map->top_level) : "memory");
+    //published before tlb_gen is read so a concurrent mmu_gather_flush()
+    //either targets this CPU or we see its new generation
+    __atomic_store_n(&percpu_get()->pagemap, map, __ATOMIC_SEQ_CST);
+
+    if (!pcid_enabled) {
+        __asm__ volatile ("mov %0, %%cr3" :: "r"(map->top_level) : "memory");
+        return;
+    }
+
+    //the kernel pagemap only holds global kernel half mappings
+    uint64 cr3 = map->top_level | AMD64_CR3_NOFLUSH;
+
+    if (map != &kernel_pagemap) {
+        irq_state_t flags = arch_irq_save();
+        pcid_cpu_t *pc = &pcid_cpus[arch_cpu_id()];
+
+        uint32 slot = PCID_SLOTS;
+        for (uint32 i = 0; i < PCID_SLOTS; i++) {
+            if (pc->map_id[i] == map->id) {
+                slot = i;
+                break;
+            }
+        }
+
+        //recycle a slot when the map has none here, either way a stale
+        //generation means the PCID may hold old translations so let the
+        //CR3 write flush it
+        uint64 gen = __atomic_load_n(&map->tlb_gen, __ATOMIC_ACQUIRE);
+        if (slot == PCID_SLOTS) {
+            slot = pc->victim;
+            pc->victim = (pc->victim + 1) % PCID_SLOTS;
+            pc->map_id[slot] = map->id;
+            cr3 &= ~AMD64_CR3_NOFLUSH;
+        } else if (pc->tlb_gen[slot] != gen) {
+            cr3 &= ~AMD64_CR3_NOFLUSH;
+        }
+        pc->tlb_gen[slot] = gen;
+        cr3 |= slot + 1;
+        arch_irq_restore(flags);
+    }
+
+    uint64 current;
+    __asm__ volatile ("mov %%cr3, %0" : "=r"(current));
+    if ((cr3 & AMD64_CR3_NOFLUSH) && current == (cr3 & ~AMD64_CR3_NOFLUSH)) return;
+    __asm__ volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory");
+}
+
+//set the global bit on every leaf of the kernel half the bootloader built
+static void mark_global(uint64 *table, int level) {
+    for (int i = 0; i < 512; i++) {
+        uint64 entry = table[i];
+        if (!(entry & AMD64_PTE_PRESENT)) continue;
+        if (level == 1 || (entry & AMD64_PTE_HUGE)) {
+            table[i] = entry | AMD64_PTE_GLOBAL;
+        } else {
+            mark_global((uint64 *)P2V(entry & AMD64_PTE_ADDR_MASK), level - 1);
+        }
+    }
+}
+
+void mmu_init(void) {
+    pagemap_t *kmap = mmu_get_kernel_pagemap();
+    uint64 *pml4 = (uint64 *)P2V(kmap->top_level);
+
+    uint32 eax, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+
+    //global pages (PGE, CPUID.1:EDX[13]) keep kernel entries across CR3 writes
+    if (edx & (1 << 13)) {
+        for (int i = 256; i < 512; i++) {
+            if (pml4[i] & AMD64_PTE_PRESENT) {
+                mark_global((uint64 *)P2V(pml4[i] & AMD64_PTE_ADDR_MASK), 3);
+            }
+        }
+        pge_enabled = true;
+    }
+
+    //PCIDs (CPUID.1:ECX[17])
+    if (ecx & (1 << 17)) {
+        kmap->top_level &= ~AMD64_CR3_PCID_MASK;
+        pcid_enabled = true;
+    }
+
+    mmu_init_cpu();
+
+    //physical page 0 sits in the first HHDM gigabyte, see how it is mapped
+    uint64 hhdm_pdpe = 0;
+    if (pml4[PML4_IDX(HHDM_OFFSET)] & AMD64_PTE_PRESENT) {
+        uint64 *pdp = (uint64 *)P2V(pml4[PML4_IDX(HHDM_OFFSET)] & AMD64_PTE_ADDR_MASK);
+        hhdm_pdpe = pdp[PDP_IDX(HHDM_OFFSET)];
+    }
+
+    printf("[mmu] global pages: %s, PCID: %s, HHDM pages: %s\n", pge_enabled ? "on" : "off",
+           pcid_enabled ? "on" : "off", (hhdm_pdpe & AMD64_PTE_HUGE) ? "1G" : "2M");
+}
+
+//every CPU runs the same features, the boot CPU decided which in mmu_init()
+void mmu_init_cpu(void) {
+    pagemap_t *kmap = mmu_get_kernel_pagemap();
+
+    //CR4.PCIDE may only be set while CR3[11:0] is 0, so go through the
+    //kernel pagemap (PCID 0) first
+    __asm__ volatile ("mov %0, %%cr3" :: "r"(kmap->top_level) : "memory");
+
+    uint64 cr4;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+    if (pge_enabled) cr4 |= (1ULL << 7);
+    if (pcid_enabled) cr4 |= (1ULL << 17);
+    __asm__ volatile ("mov %0, %%cr4" :: "r"(cr4) : "memory");
+
+    //drop anything cached before the global bits were set
+    __asm__ volatile ("mov %0, %%cr3" :: "r"(kmap->top_level) : "memory");
+    __atomic_store_n(&percpu_get()->pagemap, kmap, __ATOMIC_SEQ_CST);
 }
 
 pagemap_t *mmu_pagemap_create(void) {
@@ -146,14 +482,13 @@ pagemap_t *mmu_pagemap_create(void) {
     if (!map) return NULL;
     
     //allocate PML4
-    void *pml4_phys = pmm_alloc(1);
+    void *pml4_phys = pmm_alloc_zeroed(1);
     if (!pml4_phys) {
         pmm_free((void *)V2P(map), 1);
         return NULL;
     }
     
     uint64 *pml4 = (uint64 *)P2V(pml4_phys);
-    memset(pml4, 0, PAGE_SIZE);
     
     //copy kernel upper-half entries (indices 256-511) from kernel pagemap
     pagemap_t *kernel_map = mmu_get_kernel_pagemap();
@@ -164,23 +499,27 @@ pagemap_t *mmu_pagemap_create(void) {
     }
     
     map->top_level = (uintptr)pml4_phys;
+    map->id = __atomic_add_fetch(&next_pagemap_id, 1, __ATOMIC_RELAXED);
+    map->tlb_gen = 0;
+    spinlock_init(&map->lock);
     return map;
 }
 
 static void free_page_table_level(uint64 *table, int level) {
     //level 4 = PML4, level 1 = PT
-    //only recurse for levels > 1 and free page tables not actual data pages
+    //only the tables are ours, leaf frames belong to whoever mapped them
+    //(VMOs, process owned memory) and went back with their VMAs
     for (int i = 0; i < 512; i++) {
         uint64 entry = table[i];
         if (!(entry & AMD64_PTE_PRESENT)) continue;
-        if (entry & AMD64_PTE_HUGE) continue;  //huge page so don't recurse
+        if (entry & AMD64_PTE_HUGE) continue;  //huge page so no table below
         
-        if (level > 1) {
+        if (level > 2) {
             uint64 *next = (uint64 *)P2V(entry & AMD64_PTE_ADDR_MASK);
             free_page_table_level(next, level - 1);
         }
         
-        //free this page table page (or data page at level 1)
+        //free the next level table
         pmm_free((void *)(entry & AMD64_PTE_ADDR_MASK), 1);
     }
 }
@@ -2,6 +2,7 @@
 #define ARCH_AMD64_MMU_H
 
 #include <arch/amd64/types.h>
+#include <lib/spinlock.h>
 
 //MMU flags
 #define MMU_FLAG_PRESENT    (1ULL << 0)
@@ -29,8 +30,15 @@
 #define KHEAP_VIRT_START 0xFFFF900000000000ULL
 #define KHEAP_VIRT_END   0xFFFFA00000000000ULL
 
+//CR3 bits when PCIDs are enabled
+#define AMD64_CR3_PCID_MASK 0xFFFULL
+#define AMD64_CR3_NOFLUSH   (1ULL << 63)
+
 typedef struct pagemap {
     uintptr top_level; //physical address of PML4
+    uint64 id;         //unique for the lifetime of the system, names the map in PCID slots
+    uint64 tlb_gen;    //bumped whenever a translation is removed or changed
+    spinlock_t lock;   //serializes table changes (the kernel map's covers the kernel half)
 } pagemap_t;
 
 //helpers to get indices
@@ -46,6 +54,33 @@ uintptr mmu_virt_to_phys(pagemap_t *map, uintptr virt);
 void mmu_switch(pagemap_t *map);
 pagemap_t *mmu_get_kernel_pagemap(void);
 
+//batched unmapping
+//mmu_unmap_gather() clears translations and queues their invalidation, pages
+//that must not be reused while stale TLB entries may exist (emptied page
+//tables, frames queued with mmu_gather_free()) are held until
+//mmu_gather_flush(), past MMU_GATHER_MAX addresses the whole TLB is flushed
+#define MMU_GATHER_MAX 32
+
+typedef struct mmu_gather {
+    pagemap_t *map;
+    uintptr addrs[MMU_GATHER_MAX];
+    uint32 count;
+    bool full;         //too many addresses, flush everything
+    bool global;       //kernel half entries were cleared
+    uintptr freed;     //physical list of page runs to free after the flush
+} mmu_gather_t;
+
+void mmu_gather_init(mmu_gather_t *g, pagemap_t *map);
+void mmu_unmap_gather(mmu_gather_t *g, uintptr virt, size pages);
+void mmu_gather_free(mmu_gather_t *g, uintptr phys, size pages);
+void mmu_gather_flush(mmu_gather_t *g);
+
+//enable PCIDs and global kernel pages where the CPU supports them
+void mmu_init(void);
+
+//same setup on an application processor, loads the kernel pagemap
+void mmu_init_cpu(void);
+
 //user address space management
 pagemap_t *mmu_pagemap_create(void);
 void mmu_pagemap_destroy(pagemap_t *map);
@@ -5,7 +5,8 @@
 #define IA32_GS_BASE        0xC0000101
 #define IA32_KERNEL_GS_BASE 0xC0000102
 
-static percpu_t boot_percpu;
+static percpu_t cpus[MAX_CPUS];
+static bool percpu_ready = false;
 
 percpu_t *percpu_get(void) {
     percpu_t *cpu;
@@ -13,18 +14,47 @@ percpu_t *percpu_get(void) {
     return cpu;
 }
 
-void percpu_init(void) {
-    boot_percpu.kernel_rsp = 0;
-    boot_percpu.user_rsp = 0;
-    boot_percpu.current_thread = NULL;
-    boot_percpu.self = &boot_percpu;
+uint32 arch_cpu_id(void) {
+    //early boot runs on the boot CPU before GS is loaded
+    if (!percpu_ready) return 0;
+    uint32 id;
+    __asm__ volatile ("movl %%gs:%c1, %0" : "=r"(id) : "i"(PERCPU_CPU_ID));
+    return id;
+}
+
+static void percpu_load(uint32 cpu_id, uint32 apic_id) {
+    percpu_t *cpu = &cpus[cpu_id];
+    cpu->kernel_rsp = 0;
+    cpu->user_rsp = 0;
+    cpu->current_thread = NULL;
+    cpu->self = cpu;
+    cpu->cpu_id = cpu_id;
+    cpu->apic_id = apic_id;
+    cpu->preempt_count = 0;
+    cpu->need_resched = 0;
+    cpu->current_process = NULL;
+    cpu->pagemap = NULL;
     
-    wrmsr(IA32_KERNEL_GS_BASE, (uint64)&boot_percpu);
-    wrmsr(IA32_GS_BASE, (uint64)&boot_percpu);
+    wrmsr(IA32_KERNEL_GS_BASE, (uint64)cpu);
+    wrmsr(IA32_GS_BASE, (uint64)cpu);
+}
+
+void percpu_init(void) {
+    //the boot CPU's APIC ID is filled in once the local APIC is mapped
+    percpu_load(0, 0);
+    percpu_ready = true;
     
     puts("[percpu] initialized\n");
 }
 
+void percpu_init_cpu(uint32 cpu_id, uint32 apic_id) {
+    percpu_load(cpu_id, apic_id);
+}
+
+percpu_t *percpu_of(uint32 cpu_id) {
+    return &cpus[cpu_id];
+}
+
 void percpu_set_kernel_stack(void *stack_top) {
     percpu_t *cpu = percpu_get();
     cpu->kernel_rsp = (uint64)stack_top;
@@ -18,20 +18,58 @@
 #define PERCPU_USER_RSP     8
 #define PERCPU_CURRENT      16
 #define PERCPU_SELF         24
+#define PERCPU_CPU_ID       32
+#define PERCPU_APIC_ID      36
+#define PERCPU_PREEMPT      40
+#define PERCPU_RESCHED      44
+#define PERCPU_PROCESS      48
+
+//upper bound on the number of CPUs (sizes per-CPU arrays)
+#define MAX_CPUS            64
 
 typedef struct percpu {
     uint64 kernel_rsp;      // 0: kernel stack pointer (top of kernel stack)
     uint64 user_rsp;        // 8: saved user stack pointer during syscall
     void *current_thread;   //16: current thread pointer
     struct percpu *self;    //24: pointer to self (for accessing via GS)
-} percpu_t;
+    uint32 cpu_id;          //32: logical CPU index (0 = boot CPU)
+    uint32 apic_id;         //36: local APIC ID
+    uint32 preempt_count;   //40: kernel preemption is off while non-zero
+    uint32 need_resched;    //44: current thread should give up the CPU
+    void *current_process;  //48: process of the current thread
+    void *pagemap;          //address space loaded in CR3 (targets TLB shootdowns)
+} __attribute__((aligned(64))) percpu_t;
 
 //get pointer to current CPU's per-CPU data
+//kernel code can be preempted and moved to another CPU so the pointer is only
+//stable with preemption (or interrupts) off
 percpu_t *percpu_get(void);
 
+//current thread/process in a single GS relative load, safe with preemption on
+static inline void *percpu_current_thread(void) {
+    void *thread;
+    __asm__ volatile ("mov %%gs:%c1, %0" : "=r"(thread) : "i"(PERCPU_CURRENT));
+    return thread;
+}
+
+static inline void *percpu_current_process(void) {
+    void *proc;
+    __asm__ volatile ("mov %%gs:%c1, %0" : "=r"(proc) : "i"(PERCPU_PROCESS));
+    return proc;
+}
+
+//logical index of the current CPU (0 until per-CPU data is set up)
+uint32 arch_cpu_id(void);
+
 //initialize per-CPU data for the boot CPU
 void percpu_init(void);
 
+//initialize and load per-CPU data on an application processor
+void percpu_init_cpu(uint32 cpu_id, uint32 apic_id);
+
+//per-CPU data of any CPU
+percpu_t *percpu_of(uint32 cpu_id);
+
 //set kernel stack for syscalls (called on context switch to user thread)
 void percpu_set_kernel_stack(void *stack_top);
 
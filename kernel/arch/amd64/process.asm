@@ -32,6 +32,8 @@ section .text
 ;rsi = pointer to new context (to load)
 ;saves callee-saved registers to old_ctx and loads from new_ctx
 ;and as a note this does NOT restore RFLAGS - new threads must enable interrupts explicitly
+;the saved context is a complete kernel mode one (segments and flags included)
+;so it can also be resumed with iretq when the ISR preempts into it
 global arch_context_switch
 arch_context_switch:
     ;save callee-saved registers to old context
@@ -45,6 +47,12 @@ arch_context_switch:
     ;save stack pointer
     mov [rdi + CTX_RSP], rsp
     
+    ;save flags and segments, the thread now sits in kernel mode
+    pushfq
+    pop qword [rdi + CTX_RFLAGS]
+    mov qword [rdi + CTX_CS], KERNEL_CS
+    mov qword [rdi + CTX_SS], KERNEL_DS
+    
     ;save return address
     lea rax, [rel .switch_return]
     mov [rdi + CTX_RIP], rax
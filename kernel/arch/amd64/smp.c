@@ -0,0 +1,265 @@
+#include <arch/amd64/smp.h>
+#include <arch/amd64/acpi.h>
+#include <arch/amd64/cpu.h>
+#include <arch/amd64/interrupts.h>
+#include <arch/amd64/timer.h>
+#include <arch/amd64/mmu.h>
+#include <mm/pmm.h>
+#include <mm/mm.h>
+#include <mm/kheap.h>
+#include <proc/sched.h>
+#include <lib/string.h>
+#include <lib/io.h>
+#include <lib/spinlock.h>
+
+#define AP_STACK_SIZE   16384
+#define AP_IST_SIZE     16384
+
+//real mode startup code, copied below 1MB (see trampoline.asm)
+extern uint8 trampoline_start[], trampoline_end[];
+extern uint8 ap_gdtr[], ap_jump[], ap_long_mode[], ap_cr3[];
+extern uint8 ap_stack[], ap_entry[], ap_cpu[];
+
+extern void enable_sse(void);
+extern void mmu_init_cpu(void);
+
+static uint32 cpu_count = 1;
+static uint64 online_mask = 1;
+static uint32 apic_ids[MAX_CPUS];
+
+//set by an AP once it no longer needs the trampoline
+static volatile uint32 ap_started = 0;
+
+//one cross-CPU call at a time, targets clear their bit in call_pending when done
+static spinlock_t call_lock = SPINLOCK_INIT;
+static smp_call_fn_t call_func = NULL;
+static void *call_arg = NULL;
+static uint64 call_pending = 0;
+
+uint32 arch_cpu_count(void) {
+    return __atomic_load_n(&cpu_count, __ATOMIC_RELAXED);
+}
+
+uint64 smp_online_mask(void) {
+    return __atomic_load_n(&online_mask, __ATOMIC_ACQUIRE);
+}
+
+void smp_poll(void) {
+    uint64 bit = 1ULL << arch_cpu_id();
+    if (!(__atomic_load_n(&call_pending, __ATOMIC_ACQUIRE) & bit)) return;
+
+    irq_state_t flags = arch_irq_save();
+    //the bit may have been handled by the IPI between the check and here
+    if (__atomic_load_n(&call_pending, __ATOMIC_ACQUIRE) & bit) {
+        call_func(call_arg);
+        __atomic_and_fetch(&call_pending, ~bit, __ATOMIC_RELEASE);
+    }
+    arch_irq_restore(flags);
+}
+
+void smp_call_many(uint64 mask, smp_call_fn_t func, void *arg) {
+    //we mustn't move to another CPU between picking the targets and waiting
+    irq_state_t flags = arch_irq_save();
+    mask &= smp_online_mask() & ~(1ULL << arch_cpu_id());
+    if (!mask) {
+        arch_irq_restore(flags);
+        return;
+    }
+
+    //waiting for call_lock runs other CPUs' calls through the spin loop
+    spinlock_acquire(&call_lock);
+    call_func = func;
+    call_arg = arg;
+    __atomic_store_n(&call_pending, mask, __ATOMIC_RELEASE);
+
+    for (uint64 m = mask; m; m &= m - 1) {
+        lapic_send_ipi(apic_ids[__builtin_ctzll(m)], IPI_VECTOR_CALL);
+    }
+    while (__atomic_load_n(&call_pending, __ATOMIC_ACQUIRE)) arch_pause();
+
+    spinlock_release_irqrestore(&call_lock, flags);
+}
+
+void arch_cpu_kick(uint32 cpu) {
+    if (cpu >= MAX_CPUS || !(smp_online_mask() & (1ULL << cpu))) return;
+    lapic_send_ipi(apic_ids[cpu], IPI_VECTOR_RESCHEDULE);
+}
+
+void arch_preempt_resched(void) {
+    lapic_send_self(IPI_VECTOR_RESCHEDULE);
+}
+
+//busy wait on the PIT (interrupts must be on)
+static void wait_ticks(uint64 ticks) {
+    uint64 start = arch_timer_get_ticks();
+    while (arch_timer_get_ticks() - start < ticks) arch_pause();
+}
+
+//first C code on an application processor, running on its own stack with
+//the trampoline's page tables
+static void smp_ap_entry(uint64 cpu) {
+    percpu_init_cpu(cpu, apic_ids[cpu]);
+    mmu_init_cpu();
+    enable_sse();
+
+    void *ist = kmalloc(AP_IST_SIZE);
+    if (!ist) {
+        //never marked online so the boot CPU gives up on us
+        printf("[smp] ERR: CPU %u has no interrupt stack\n", (uint32)cpu);
+        for (;;) arch_halt();
+    }
+    gdt_init_cpu(cpu, (char *)ist + AP_IST_SIZE);
+    idt_load();
+    syscall_init();
+    lapic_enable();
+
+    __atomic_or_fetch(&online_mask, 1ULL << cpu, __ATOMIC_RELEASE);
+    __atomic_store_n(&ap_started, 1, __ATOMIC_RELEASE);
+
+    lapic_timer_init_cpu();
+    sched_start();
+}
+
+//find CPUs in the MADT, the boot CPU stays index 0 and the rest are numbered
+//in table order
+static void parse_madt(void) {
+    acpi_madt_t *madt = acpi_find_table("APIC");
+    if (!madt) {
+        printf("[smp] no MADT, running on the boot CPU only\n");
+        return;
+    }
+
+    uint32 bsp = lapic_id();
+    apic_ids[0] = bsp;
+
+    uint8 *p = madt->entries;
+    uint8 *end = (uint8 *)madt + madt->header.length;
+    while (p + sizeof(acpi_madt_entry_t) <= end) {
+        acpi_madt_entry_t *entry = (acpi_madt_entry_t *)p;
+        if (entry->length < sizeof(acpi_madt_entry_t)) break;
+
+        if (entry->type == MADT_TYPE_LAPIC) {
+            acpi_madt_lapic_t *lapic = (acpi_madt_lapic_t *)entry;
+            if ((lapic->flags & MADT_LAPIC_ENABLED) && lapic->apic_id != bsp) {
+                if (cpu_count < MAX_CPUS) apic_ids[cpu_count++] = lapic->apic_id;
+            }
+        }
+        p += entry->length;
+    }
+}
+
+//patch a 32 or 64 bit field of the copied trampoline
+static void patch(uint8 *page, uint8 *field, uint64 value, size width) {
+    memcpy(page + (field - trampoline_start), &value, width);
+}
+
+//the AP turns on paging while running from the trampoline page so it needs an
+//identity mapping of low memory next to the kernel half, and CR3 is loaded in
+//16 bit mode so the whole thing lives below 4GB
+static uintptr build_ap_pagemap(uintptr *pdp_phys, uintptr *pd_phys) {
+    uintptr pml4 = (uintptr)pmm_alloc_contig(1, PAGE_SIZE, 0x100000000ULL);
+    uintptr pdp = (uintptr)pmm_alloc_contig(1, PAGE_SIZE, 0x100000000ULL);
+    uintptr pd = (uintptr)pmm_alloc_contig(1, PAGE_SIZE, 0x100000000ULL);
+    if (!pml4 || !pdp || !pd) {
+        if (pml4) pmm_free((void *)pml4, 1);
+        if (pdp) pmm_free((void *)pdp, 1);
+        if (pd) pmm_free((void *)pd, 1);
+        return 0;
+    }
+
+    uint64 *pml4_v = P2V(pml4), *pdp_v = P2V(pdp), *pd_v = P2V(pd);
+    memset(pml4_v, 0, PAGE_SIZE);
+    memset(pdp_v, 0, PAGE_SIZE);
+    memset(pd_v, 0, PAGE_SIZE);
+
+    uint64 *kernel_pml4 = P2V(mmu_get_kernel_pagemap()->top_level);
+    for (int i = 256; i < 512; i++) pml4_v[i] = kernel_pml4[i];
+
+    pml4_v[0] = pdp | AMD64_PTE_PRESENT | AMD64_PTE_WRITE;
+    pdp_v[0] = pd | AMD64_PTE_PRESENT | AMD64_PTE_WRITE;
+    pd_v[0] = AMD64_PTE_PRESENT | AMD64_PTE_WRITE | AMD64_PTE_HUGE;
+
+    *pdp_phys = pdp;
+    *pd_phys = pd;
+    return pml4;
+}
+
+static bool start_ap(uint8 *page, uint32 cpu) {
+    void *stack = kmalloc(AP_STACK_SIZE);
+    if (!stack) return false;
+
+    sched_init_cpu(cpu);
+    patch(page, ap_stack, (uint64)stack + AP_STACK_SIZE, 8);
+    patch(page, ap_cpu, cpu, 8);
+    __atomic_store_n(&ap_started, 0, __ATOMIC_RELEASE);
+
+    //INIT, then SIPI (twice if the first one didn't take)
+    uint8 vector = (uint8)(V2P(page) >> 12);
+    lapic_send_init(apic_ids[cpu]);
+    wait_ticks(2);
+    lapic_send_startup(apic_ids[cpu], vector);
+    wait_ticks(1);
+    if (!__atomic_load_n(&ap_started, __ATOMIC_ACQUIRE)) lapic_send_startup(apic_ids[cpu], vector);
+
+    for (uint32 i = 0; i < 100 && !__atomic_load_n(&ap_started, __ATOMIC_ACQUIRE); i++) wait_ticks(1);
+    return __atomic_load_n(&ap_started, __ATOMIC_ACQUIRE);
+}
+
+void arch_smp_init(void) {
+    lapic_init();
+    lapic_timer_calibrate();
+    lapic_timer_init_cpu();
+
+    //from here on the scheduler arms the local APIC timer when it needs it
+    //and the TSC keeps time, so the fixed rate PIT interrupt can go
+    if (lapic_timer_ready() && tsc_get_hz()) pit_stop();
+
+    parse_madt();
+    if (cpu_count == 1) return;
+
+    //the startup vector addresses a page below 1MB
+    void *tramp_phys = pmm_alloc_contig(1, PAGE_SIZE, 0x100000);
+    if (!tramp_phys) {
+        printf("[smp] ERR: no memory below 1MB for the AP trampoline\n");
+        cpu_count = 1;
+        return;
+    }
+    uintptr pdp, pd;
+    uintptr cr3 = build_ap_pagemap(&pdp, &pd);
+    if (!cr3) {
+        printf("[smp] ERR: no memory for AP page tables\n");
+        pmm_free(tramp_phys, 1);
+        cpu_count = 1;
+        return;
+    }
+
+    uint8 *page = P2V(tramp_phys);
+    uintptr base = (uintptr)tramp_phys;
+    memcpy(page, trampoline_start, trampoline_end - trampoline_start);
+
+    //the gdtr and far jump need physical addresses, everything else is
+    //reached relative to the page
+    patch(page, ap_gdtr + 2, base + *(uint32 *)(ap_gdtr + 2), 4);
+    patch(page, ap_jump, base + (ap_long_mode - trampoline_start), 4);
+    patch(page, ap_cr3, cr3, 4);
+    patch(page, ap_entry, (uint64)smp_ap_entry, 8);
+
+    uint32 wanted = cpu_count;
+    cpu_count = 1;
+    for (uint32 cpu = 1; cpu < wanted; cpu++) {
+        //started CPUs are numbered densely so a failed one gives its slot up
+        apic_ids[cpu_count] = apic_ids[cpu];
+        if (start_ap(page, cpu_count)) {
+            __atomic_add_fetch(&cpu_count, 1, __ATOMIC_RELEASE);
+        } else {
+            printf("[smp] WARN: CPU with APIC ID %u did not start\n", apic_ids[cpu_count]);
+        }
+    }
+
+    pmm_free((void *)cr3, 1);
+    pmm_free((void *)pdp, 1);
+    pmm_free((void *)pd, 1);
+    pmm_free(tramp_phys, 1);
+
+    printf("[smp] %u CPUs online\n", cpu_count);
+}
@@ -0,0 +1,30 @@
+#ifndef ARCH_AMD64_SMP_H
+#define ARCH_AMD64_SMP_H
+
+#include <arch/amd64/types.h>
+
+//function run on other CPUs by smp_call_many()
+typedef void (*smp_call_fn_t)(void *arg);
+
+//find the application processors in the ACPI MADT and start them
+//called once by the boot CPU after the scheduler is initialized
+void arch_smp_init(void);
+
+//number of CPUs running (1 until arch_smp_init() has started the others)
+uint32 arch_cpu_count(void);
+
+//bitmask of running CPUs by logical index
+uint64 smp_online_mask(void);
+
+//run func(arg) on every online CPU in mask except the caller and wait for all
+//of them to finish, func runs in interrupt context and must not take locks
+void smp_call_many(uint64 mask, smp_call_fn_t func, void *arg);
+
+//run a pending cross-CPU call aimed at this CPU, also called from spin loops
+//so a CPU waiting on a lock with interrupts off can't stall a caller
+void smp_poll(void);
+
+//get a CPU out of hlt so it looks at the run queue
+void arch_cpu_kick(uint32 cpu);
+
+#endif
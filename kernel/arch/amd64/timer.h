@@ -8,5 +8,37 @@ void arch_timer_init(uint32 hz);
 void arch_timer_setfreq(uint32 hz);
 uint32 arch_timer_getfreq(void);
 uint64 arch_timer_get_ticks(void);
+uint64 arch_timer_ns(void);
+void arch_timer_oneshot(uint64 deadline);
+uintptr arch_timer_clock_page(void);
+
+//PIT (the time base until the TSC is calibrated)
+uint64 pit_ns(void);
+void pit_stop(void);
+
+//clock page - shared read only with every process (at USER_CLOCK_PAGE) so it
+//can compute arch_timer_ns() itself:
+//  ns = ns_base + (((rdtsc - tsc_base) * ns_mult) >> 32)   (128-bit product)
+//seq is odd while the kernel updates it, readers retry until they see the
+//same even value before and after reading the rest
+#define CLOCK_PAGE_TSC  (1 << 0)    //the TSC fields are valid, else use the syscall
+
+typedef struct clock_page {
+    uint32 seq;
+    uint32 flags;
+    uint64 tsc_base;
+    uint64 ns_base;
+    uint64 ns_mult;
+    uint64 tsc_hz;
+} clock_page_t;
+
+void clock_page_init(void);
+
+//TSC
+bool tsc_present(void);
+bool tsc_deadline_supported(void);
+void tsc_init(uint64 hz);
+uint64 tsc_get_hz(void);
+uint64 tsc_from_ns(uint64 ns);
 
 #endif
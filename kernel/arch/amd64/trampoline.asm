@@ -0,0 +1,104 @@
+;application processor startup
+;copied to a page below 1MB by arch_smp_init(), the startup IPI starts the AP
+;here in real mode with CS = page >> 4 and IP = 0
+;it goes straight to long mode using a temporary pagemap and then calls
+;into the kernel on the stack it was given
+;fields marked (patched) are filled in by arch_smp_init() on the copy
+
+%define KERNEL_CS   0x08
+%define KERNEL_DS   0x10
+
+;offset of a label from the start of the page
+%define REL(x) ((x) - trampoline_start)
+
+section .text
+
+global trampoline_start
+global trampoline_end
+global ap_gdtr
+global ap_jump
+global ap_long_mode
+global ap_cr3
+global ap_stack
+global ap_entry
+global ap_cpu
+
+bits 16
+trampoline_start:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+
+    o32 lgdt [REL(ap_gdtr)]
+
+    ;PAE
+    mov eax, cr4
+    or eax, (1 << 5)
+    mov cr4, eax
+
+    mov eax, [REL(ap_cr3)]
+    mov cr3, eax
+
+    ;EFER.LME and EFER.NXE (kernel mappings use NX)
+    mov ecx, 0xC0000080
+    rdmsr
+    or eax, (1 << 8) | (1 << 11)
+    wrmsr
+
+    ;paging and protection on at once puts us in long mode
+    mov eax, cr0
+    or eax, 0x80000001
+    mov cr0, eax
+
+    jmp dword far [REL(ap_jump)]
+
+bits 64
+ap_long_mode:
+    mov ax, KERNEL_DS
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor ax, ax
+    mov fs, ax
+    mov gs, ax
+
+    ;RIP relative loads work from the copy since the data moved with the code
+    mov rsp, [rel ap_stack]
+    mov rdi, [rel ap_cpu]
+    mov rax, [rel ap_entry]
+    call rax
+
+.halt:
+    cli
+    hlt
+    jmp .halt
+
+align 8
+ap_gdt:
+    dq 0
+    dq 0x00AF9A000000FFFF   ;kernel code, 64-bit
+    dq 0x00CF92000000FFFF   ;kernel data
+ap_gdt_end:
+
+ap_gdtr:
+    dw ap_gdt_end - ap_gdt - 1
+    dd REL(ap_gdt)          ;(patched) physical address
+
+align 4
+ap_jump:
+    dd 0                    ;(patched) physical address of ap_long_mode
+    dw KERNEL_CS
+
+ap_cr3:
+    dd 0                    ;(patched) temporary PML4, below 4GB
+
+align 8
+ap_stack:
+    dq 0                    ;(patched) top of the AP's boot stack
+ap_entry:
+    dq 0                    ;(patched) smp_ap_entry
+ap_cpu:
+    dq 0                    ;(patched) logical CPU index
+
+trampoline_end:
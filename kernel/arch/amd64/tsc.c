@@ -0,0 +1,103 @@
+#include <arch/amd64/types.h>
+#include <arch/amd64/cpu.h>
+#include <arch/timer.h>
+#include <mm/pmm.h>
+#include <mm/mm.h>
+#include <lib/io.h>
+
+//the time stamp counter is the clock once it has been measured against the
+//PIT, before that (or without one) time comes from counting PIT ticks
+
+static uint64 tsc_hz = 0;
+static uint64 tsc_base = 0;     //TSC value at ns_base
+static uint64 ns_base = 0;      //clock value when the TSC took over
+static uint64 ns_mult = 0;      //ns = (ticks * ns_mult) >> 32
+
+static uintptr clock_page_phys = 0;
+
+//every user process maps the page and libc reads it unconditionally, so it
+//has to exist (until the TSC takes over its flags stay 0 and libc falls back
+//to the syscall)
+void clock_page_init(void) {
+    void *page = pmm_alloc_zeroed(1);
+    if (!page) {
+        printf("[tsc] ERR: no memory for the clock page\n");
+        for (;;) arch_halt();
+    }
+    clock_page_phys = (uintptr)page;
+}
+
+uintptr arch_timer_clock_page(void) {
+    return clock_page_phys;
+}
+
+//copy the conversion out to the clock page
+static void clock_page_publish(void) {
+    if (!clock_page_phys) return;
+    clock_page_t *cp = (clock_page_t *)P2V(clock_page_phys);
+
+    __atomic_store_n(&cp->seq, cp->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    cp->tsc_base = tsc_base;
+    cp->ns_base = ns_base;
+    cp->ns_mult = ns_mult;
+    cp->tsc_hz = tsc_hz;
+    cp->flags = CLOCK_PAGE_TSC;
+    __atomic_store_n(&cp->seq, cp->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void cpuid(uint32 leaf, uint32 *eax, uint32 *ebx, uint32 *ecx, uint32 *edx) {
+    __asm__ volatile ("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+bool tsc_present(void) {
+    uint32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return edx & (1 << 4);
+}
+
+bool tsc_deadline_supported(void) {
+    uint32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return ecx & (1 << 24);
+}
+
+//switch the clock over to a TSC running at hz, it carries on from the PIT
+//count so it never goes backwards
+void tsc_init(uint64 hz) {
+    if (!hz) return;
+
+    uint32 eax, ebx, ecx, edx;
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    bool invariant = false;
+    if (eax >= 0x80000007) {
+        cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        invariant = edx & (1 << 8);
+    }
+    if (!invariant) printf("[tsc] WARN: TSC is not invariant, time may drift in deep sleep\n");
+
+    irq_state_t flags = arch_irq_save();
+    ns_base = arch_timer_ns();
+    tsc_base = arch_rdtsc();
+    ns_mult = (NS_PER_SEC << 32) / hz;
+    __atomic_store_n(&tsc_hz, hz, __ATOMIC_RELEASE);
+    clock_page_publish();
+    arch_irq_restore(flags);
+
+    printf("[tsc] %llu Hz, now the clock source\n", hz);
+}
+
+uint64 tsc_get_hz(void) {
+    return __atomic_load_n(&tsc_hz, __ATOMIC_ACQUIRE);
+}
+
+//TSC ticks in ns nanoseconds, ns has to stay below a few seconds
+uint64 tsc_from_ns(uint64 ns) {
+    return ns * tsc_get_hz() / NS_PER_SEC;
+}
+
+uint64 arch_timer_ns(void) {
+    if (!tsc_get_hz()) return pit_ns();
+    uint64 ticks = arch_rdtsc() - tsc_base;
+    return ns_base + (uint64)(((unsigned __int128)ticks * ns_mult) >> 32);
+}
@@ -22,7 +22,18 @@
  * arch_halt() - halt CPU until next interrupt
  * arch_idle() - idle CPU (enable interrupts and halt)
  * arch_pause() - hint to CPU that we're in a spin loop
+ * arch_spin_relax() - one iteration of a lock spin loop (pause and service cross-CPU requests)
  * arch_set_kernel_stack(void *stack_top) - set kernel stack for ring transitions
+ * arch_cpu_id() - logical index of the executing CPU (below MAX_CPUS)
+ * arch_smp_init() - start the other CPUs (each ends up in sched_start())
+ * arch_cpu_count() - number of CPUs running
+ * arch_cpu_kick(cpu) - interrupt another CPU so it leaves its idle halt
+ *
+ * kernel preemption (per-CPU, see sched_tick()):
+ *
+ * arch_preempt_disable() / arch_preempt_enable() - nestable, no preemption in between
+ * arch_preempt_count() - current nesting depth
+ * arch_need_resched() / arch_set_need_resched(bool) - the current thread's time is up
  *
  * memory barriers:
  *
@@ -6,6 +6,10 @@
  * each architecture provides its implementation in arch/<arch>/timer.h
  */
 
+#define NS_PER_SEC  1000000000ULL
+#define NS_PER_MS   1000000ULL
+#define NS_PER_US   1000ULL
+
 #if defined(ARCH_AMD64)
     #include <arch/amd64/timer.h>
 #elif defined(ARCH_X86)
@@ -21,7 +25,14 @@
  *
  * arch_timer_init(hz) - initialize timer at given frequency
  * arch_timer_setfreq(hz) - change timer frequency
- * arch_timer_get_ticks() - get monotonic tick count since boot
+ * arch_timer_get_ticks() - get monotonic tick count since boot (at the
+ *                          arch_timer_getfreq() rate, no interrupt needed)
+ * arch_timer_ns() - monotonic nanoseconds since boot
+ * arch_timer_oneshot(deadline) - interrupt the calling CPU once (sched_tick())
+ *                                when arch_timer_ns() reaches deadline, 0 cancels
+ * arch_timer_clock_page() - physical page that lets userspace read arch_timer_ns()
+ *                           without a syscall (mapped read only at USER_CLOCK_PAGE),
+ *                           0 if there is none
  */
 
 #endif
@@ -67,7 +67,7 @@ static void kbd_push_event(uint8 keycode, uint8 pressed, uint32 codepoint) {
     }
     
     //allocate queue entry
-    channel_msg_entry_t *entry = kzalloc(sizeof(channel_msg_entry_t));
+    channel_msg_entry_t *entry = channel_msg_entry_alloc();
     if (!entry) {
         kfree(event);
         return;
@@ -75,19 +75,9 @@ static void kbd_push_event(uint8 keycode, uint8 pressed, uint32 codepoint) {
     
     entry->data = event;
     entry->data_len = sizeof(kbd_event_t);
-    entry->next = NULL;
     
-    //enqueue
-    if (ch->queue_tail[peer_id]) {
-        ch->queue_tail[peer_id]->next = entry;
-    } else {
-        ch->queue[peer_id] = entry;
-    }
-    ch->queue_tail[peer_id] = entry;
-    ch->queue_len[peer_id]++;
-    
-    //wake any thread waiting for a message
-    thread_wake_one(&ch->waiters[peer_id]);
+    //enqueue and wake any thread waiting for a message
+    if (channel_enqueue(ch, peer_id, entry) < 0) channel_msg_entry_free(entry);
 }
 
 void keyboard_irq(void) {
@@ -140,15 +130,14 @@ void keyboard_init(void) {
     if (kproc) {
         int32 client_ep, server_ep;
         if (channel_create(kproc, HANDLE_RIGHTS_DEFAULT, &client_ep, &server_ep) == 0) {
-            //server endpoint is where we push events FROM
+            //server endpoint is where we push events FROM, we keep the
+            //reference for as long as the driver lives
             kbd_channel_ep = channel_get_endpoint(kproc, server_ep);
             
             //client endpoint is what userspace opens to receive events
+            //the namespace takes over the reference we got with it
             object_t *client_obj = process_get_handle(kproc, client_ep);
-            if (client_obj) {
-                object_ref(client_obj);
-                ns_register("$devices/keyboard/channel", client_obj);
-            }
+            if (client_obj) ns_register("$devices/keyboard/channel", client_obj);
         }
     }
 }
\ No newline at end of file
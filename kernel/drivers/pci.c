@@ -4,6 +4,8 @@
 #include <drivers/pci_protocol.h>
 #include <arch/io.h>
 #include <mm/kheap.h>
+#include <mm/pmm.h>
+#include <mm/mm.h>
 #include <obj/object.h>
 #include <obj/namespace.h>
 #include <ipc/channel.h>
@@ -348,6 +350,7 @@ static void pci_register_device(pci_device_t *pdev) {
             channel_endpoint_t *server = channel_get_endpoint(kproc, server_ep);
             if (server) {
                 channel_set_handler(server, pci_channel_handler, pdev);
+                object_deref(&server->obj);  //the kernel's handle keeps it
             }
             
             //register the client endpoint in namespace
@@ -356,8 +359,7 @@ static void pci_register_device(pci_device_t *pdev) {
                 char chan_name[48];
                 snprintf(chan_name, sizeof(chan_name), "$devices/pci/%02X:%02X.%X/channel",
                          pdev->bus, pdev->dev, pdev->func);
-                object_ref(client_obj);  //ns_register doesn't add ref
-                ns_register(chan_name, client_obj);
+                ns_register(chan_name, client_obj);  //takes over our reference
             }
         }
     }
@@ -516,4 +518,26 @@ void pci_enable_io(pci_device_t *dev) {
     cmd |= PCI_CMD_IO_SPACE;
     pci_config_write(dev->bus, dev->dev, dev->func, 0x04, 2, cmd);
     dev->command = cmd;
-}
\ No newline at end of file
+}
+
+void *pci_dma_alloc(size bytes, size align, uintptr *phys) {
+    if (bytes == 0) return NULL;
+    size pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    //not every device can address above 4GiB so stay in DMA32
+    void *p = pmm_alloc_contig(pages, align, 0x100000000ULL);
+    if (!p) {
+        printf("[pci] ERR: no contiguous memory for %zu byte DMA buffer\n", bytes);
+        return NULL;
+    }
+
+    void *virt = P2V(p);
+    memset(virt, 0, pages * PAGE_SIZE);
+    if (phys) *phys = (uintptr)p;
+    return virt;
+}
+
+void pci_dma_free(void *virt, size bytes) {
+    if (!virt || bytes == 0) return;
+    pmm_free((void *)V2P(virt), (bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+}
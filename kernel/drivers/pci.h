@@ -62,4 +62,11 @@ void pci_enable_mmio(pci_device_t *dev);
 //enable I/O space access for a device
 void pci_enable_io(pci_device_t *dev);
 
+//allocate a zeroed physically contiguous buffer below 4GiB for bus-master DMA
+//(descriptor rings etc) returns the kernel virtual address and the bus address in *phys
+void *pci_dma_alloc(size bytes, size align, uintptr *phys);
+
+//free a buffer from pci_dma_alloc
+void pci_dma_free(void *virt, size bytes);
+
 #endif
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include <obj/object.h>
 #include <obj/namespace.h>
 #include <arch/cpu.h>
+#include <proc/sched.h>
 #include <string.h>
 #include <lib/io.h>
 
@@ -219,9 +220,12 @@ bool vt_poll_event(vt_t *vt, vt_event_t *event) {
 }
 
 void vt_wait_event(vt_t *vt, vt_event_t *event) {
+    if (vt_poll_event(vt, event)) return;
     while (!vt_poll_event(vt, event)) {
         arch_halt();
     }
+    //waited on the user, treat it like any other wakeup from a block
+    sched_boost(thread_current());
 }
 
 void vt_push_event(vt_t *vt, const vt_event_t *event) {
@@ -33,6 +33,7 @@ typedef struct tmpfs_node {
 
 //root directory
 static tmpfs_node_t *root = NULL;
+static kmem_cache_t *node_cache = NULL;
 
 //find child by name in directory
 static tmpfs_node_t *find_child(tmpfs_node_t *dir, const char *name) {
@@ -107,19 +108,19 @@ static tmpfs_node_t *resolve_path(const char *path, bool create_dirs, tmpfs_node
             if (!create_dirs) return NULL;
             
             //create missing directory
-            next_node = kzalloc(sizeof(tmpfs_node_t));
+            next_node = kmem_cache_zalloc(node_cache);
             if (!next_node) return NULL;
             
             strncpy(next_node->name, component, TMPFS_MAX_NAME - 1);
             next_node->type = FS_TYPE_DIR;
             next_node->dir.children = kzalloc(TMPFS_INITIAL_CHILDREN * sizeof(tmpfs_node_t *));
-            if (!next_node->dir.children) { kfree(next_node); return NULL; }
+            if (!next_node->dir.children) { kmem_cache_free(node_cache, next_node); return NULL; }
             next_node->dir.capacity = TMPFS_INITIAL_CHILDREN;
             next_node->dir.count = 0;
             
             if (add_child(current, next_node) < 0) {
                 kfree(next_node->dir.children);
-                kfree(next_node);
+                kmem_cache_free(node_cache, next_node);
                 return NULL;
             }
         }
@@ -251,7 +252,7 @@ static int tmpfs_fs_create(fs_t *fs, const char *path, uint32 type) {
     if (!parent || parent->type != FS_TYPE_DIR) return -1;
     
     //create new node
-    tmpfs_node_t *node = kzalloc(sizeof(tmpfs_node_t));
+    tmpfs_node_t *node = kmem_cache_zalloc(node_cache);
     if (!node) return -1;
     
     strncpy(node->name, basename, TMPFS_MAX_NAME - 1);
@@ -259,7 +260,7 @@ static int tmpfs_fs_create(fs_t *fs, const char *path, uint32 type) {
     
     if (type == FS_TYPE_DIR) {
         node->dir.children = kzalloc(TMPFS_INITIAL_CHILDREN * sizeof(tmpfs_node_t *));
-        if (!node->dir.children) { kfree(node); return -1; }
+        if (!node->dir.children) { kmem_cache_free(node_cache, node); return -1; }
         node->dir.capacity = TMPFS_INITIAL_CHILDREN;
         node->dir.count = 0;
     } else {
@@ -297,7 +298,7 @@ static int tmpfs_fs_remove(fs_t *fs, const char *path) {
     } else {
         kfree(node->dir.children);
     }
-    kfree(node);
+    kmem_cache_free(node_cache, node);
     
     return 0;
 }
@@ -354,8 +355,14 @@ static object_ops_t tmpfs_root_ops = {
 static object_t *tmpfs_root_obj = NULL;
 
 void tmpfs_init(void) {
+    node_cache = kmem_cache_create("tmpfs_node_t", sizeof(tmpfs_node_t), 0, NULL);
+    if (!node_cache) {
+        printf("[tmpfs] ERR: failed to create node cache\n");
+        return;
+    }
+    
     //create root directory
-    root = kzalloc(sizeof(tmpfs_node_t));
+    root = kmem_cache_zalloc(node_cache);
     if (!root) {
         printf("[tmpfs] ERR: failed to allocate root\n");
         return;
@@ -366,7 +373,7 @@ void tmpfs_init(void) {
     root->parent = NULL;
     root->dir.children = kzalloc(TMPFS_INITIAL_CHILDREN * sizeof(tmpfs_node_t *));
     if (!root->dir.children) {
-        kfree(root);
+        kmem_cache_free(node_cache, root);
         root = NULL;
         return;
     }
@@ -5,6 +5,59 @@
 #include <lib/io.h>
 #include <drivers/serial.h>
 
+//queued messages come and go on every send/recv so they get their own cache
+static kmem_cache_t *msg_cache = NULL;
+
+void channel_init(void) {
+    msg_cache = kmem_cache_create("channel_msg_entry_t", sizeof(channel_msg_entry_t), 0, NULL);
+    if (!msg_cache) printf("[channel] ERR: failed to create message cache\n");
+}
+
+channel_msg_entry_t *channel_msg_entry_alloc(void) {
+    return kmem_cache_zalloc(msg_cache);
+}
+
+//drop a queued message along with any objects it carries
+void channel_msg_entry_free(channel_msg_entry_t *msg) {
+    if (msg->data) kfree(msg->data);
+    //deref any pending objects
+    for (uint32 i = 0; i < msg->object_count; i++) {
+        if (msg->objects[i]) object_deref(msg->objects[i]);
+    }
+    if (msg->objects) kfree(msg->objects);
+    if (msg->rights) kfree(msg->rights);
+    kmem_cache_free(msg_cache, msg);
+}
+
+int channel_enqueue(channel_t *ch, int id, channel_msg_entry_t *entry) {
+    irq_state_t flags = spinlock_acquire_irqsave(&ch->lock);
+    
+    if (ch->closed[id]) {
+        spinlock_release_irqrestore(&ch->lock, flags);
+        return -2;
+    }
+    if (ch->queue_len[id] >= CHANNEL_MSG_QUEUE_SIZE) {
+        spinlock_release_irqrestore(&ch->lock, flags);
+        return -3;
+    }
+    
+    entry->next = NULL;
+    if (ch->queue_tail[id]) {
+        ch->queue_tail[id]->next = entry;
+    } else {
+        ch->queue[id] = entry;
+    }
+    ch->queue_tail[id] = entry;
+    ch->queue_len[id]++;
+    
+    //wake any thread waiting for a message on this endpoint, under the lock
+    //so a receiver can't check the queue and go to sleep in between
+    thread_wake_one(&ch->waiters[id]);
+    
+    spinlock_release_irqrestore(&ch->lock, flags);
+    return 0;
+}
+
 static int channel_endpoint_close(object_t *obj) {
     channel_endpoint_t *ep = (channel_endpoint_t *)obj;
     if (!ep || !ep->channel) return -1;
@@ -12,29 +65,32 @@ static int channel_endpoint_close(object_t *obj) {
     channel_t *ch = ep->channel;
     int id = ep->endpoint_id;
     
+    irq_state_t flags = spinlock_acquire_irqsave(&ch->lock);
+    
     //mark this endpoint as closed
     ch->closed[id] = 1;
     
-    //free any pending messages in our queue
+    //take any pending messages in our queue
     channel_msg_entry_t *msg = ch->queue[id];
+    ch->queue[id] = NULL;
+    ch->queue_tail[id] = NULL;
+    ch->queue_len[id] = 0;
+    
+    //a peer blocked in channel_recv has to find out nothing more is coming
+    bool both_closed = ch->closed[0] && ch->closed[1];
+    if (!both_closed) thread_wake_all(&ch->waiters[1 - id]);
+    
+    spinlock_release_irqrestore(&ch->lock, flags);
+    
+    //free them outside the lock, dropping objects can run close handlers
     while (msg) {
         channel_msg_entry_t *next = msg->next;
-        if (msg->data) kfree(msg->data);
-        //deref any pending objects
-        for (uint32 i = 0; i < msg->object_count; i++) {
-            if (msg->objects[i]) object_deref(msg->objects[i]);
-        }
-        if (msg->objects) kfree(msg->objects);
-        if (msg->rights) kfree(msg->rights);
-        kfree(msg);
+        channel_msg_entry_free(msg);
         msg = next;
     }
-    ch->queue[id] = NULL;
-    ch->queue_tail[id] = NULL;
-    ch->queue_len[id] = 0;
     
     //if both endpoints closed just free the channel
-    if (ch->closed[0] && ch->closed[1]) {
+    if (both_closed) {
         kfree(ch);
     }
     
@@ -73,6 +129,7 @@ int channel_create(process_t *proc, handle_rights_t rights,
         ch->closed[i] = 0;
         wait_queue_init(&ch->waiters[i]);
     }
+    spinlock_init(&ch->lock);
     
     //grant handles to process
     int h0 = process_grant_handle(proc, &ch->endpoints[0].obj, rights);
@@ -98,17 +155,17 @@ channel_endpoint_t *channel_get_endpoint(process_t *proc, int32 handle) {
     if (!proc) return NULL;
     
     object_t *obj = process_get_handle(proc, handle);
-    if (!obj || obj->type != OBJECT_CHANNEL) return NULL;
+    if (!obj) return NULL;
+    if (obj->type != OBJECT_CHANNEL) {
+        object_deref(obj);
+        return NULL;
+    }
     
     return (channel_endpoint_t *)obj;
 }
 
-int channel_send(process_t *proc, int32 endpoint_handle, channel_msg_t *msg) {
-    if (!proc || !msg) return -1;
-    
-    channel_endpoint_t *ep = channel_get_endpoint(proc, endpoint_handle);
-    if (!ep) return -1;
-    
+//send on an endpoint the caller holds a reference to
+static int endpoint_send(process_t *proc, channel_endpoint_t *ep, channel_msg_t *msg) {
     channel_t *ch = ep->channel;
     int peer_id = 1 - ep->endpoint_id;
     
@@ -132,14 +189,14 @@ int channel_send(process_t *proc, int32 endpoint_handle, channel_msg_t *msg) {
     }
     
     //allocate queue entry
-    channel_msg_entry_t *entry = kzalloc(sizeof(channel_msg_entry_t));
+    channel_msg_entry_t *entry = channel_msg_entry_alloc();
     if (!entry) return -1;
     
     //copy data
     if (msg->data_len > 0 && msg->data) {
         entry->data = kmalloc(msg->data_len);
         if (!entry->data) {
-            kfree(entry);
+            kmem_cache_free(msg_cache, entry);
             return -1;
         }
         memcpy(entry->data, msg->data, msg->data_len);
@@ -154,15 +211,15 @@ int channel_send(process_t *proc, int32 endpoint_handle, channel_msg_t *msg) {
             if (entry->data) kfree(entry->data);
             if (entry->objects) kfree(entry->objects);
             if (entry->rights) kfree(entry->rights);
-            kfree(entry);
+            kmem_cache_free(msg_cache, entry);
             return -1;
         }
         
         entry->object_count = msg->handle_count;
         
         for (uint32 i = 0; i < msg->handle_count; i++) {
-            proc_handle_t *he = process_get_handle_entry(proc, msg->handles[i]);
-            if (!he) {
+            proc_handle_t he;
+            if (process_get_handle_entry(proc, msg->handles[i], &he) < 0) {
                 //rollback: restore already-transferred handles
                 for (uint32 j = 0; j < i; j++) {
                     if (entry->objects[j]) object_deref(entry->objects[j]);
@@ -170,45 +227,40 @@ int channel_send(process_t *proc, int32 endpoint_handle, channel_msg_t *msg) {
                 if (entry->data) kfree(entry->data);
                 kfree(entry->objects);
                 kfree(entry->rights);
-                kfree(entry);
+                kmem_cache_free(msg_cache, entry);
                 return -6;  //invalid handle
             }
             
             //check TRANSFER right
-            if (!rights_has(he->rights, HANDLE_RIGHT_TRANSFER)) {
+            if (!rights_has(he.rights, HANDLE_RIGHT_TRANSFER)) {
                 //rollback
+                object_deref(he.obj);
                 for (uint32 j = 0; j < i; j++) {
                     if (entry->objects[j]) object_deref(entry->objects[j]);
                 }
                 if (entry->data) kfree(entry->data);
                 kfree(entry->objects);
                 kfree(entry->rights);
-                kfree(entry);
+                kmem_cache_free(msg_cache, entry);
                 return -7;  //no transfer right
             }
             
-            //grab object ref and rights
-            entry->objects[i] = he->obj;
-            entry->rights[i] = he->rights;
-            object_ref(he->obj);
+            //the copy's reference moves into the message
+            entry->objects[i] = he.obj;
+            entry->rights[i] = he.rights;
             
             //remove from sender (MOVE)
             process_close_handle(proc, msg->handles[i]);
         }
     }
     
-    //enqueue message to peer's queue
-    entry->next = NULL;
-    if (ch->queue_tail[peer_id]) {
-        ch->queue_tail[peer_id]->next = entry;
-    } else {
-        ch->queue[peer_id] = entry;
+    //enqueue message to peer's queue (the checks above were done unlocked
+    //so the peer may have closed or filled up since)
+    int err = channel_enqueue(ch, peer_id, entry);
+    if (err < 0) {
+        channel_msg_entry_free(entry);
+        return err;
     }
-    ch->queue_tail[peer_id] = entry;
-    ch->queue_len[peer_id]++;
-    
-    //wake any thread waiting for a message on this endpoint
-    thread_wake_one(&ch->waiters[peer_id]);
     
     //if peer has a handler registered, call it immediately (synchronous dispatch)
     channel_endpoint_t *peer_ep = &ch->endpoints[peer_id];
@@ -216,12 +268,15 @@ int channel_send(process_t *proc, int32 endpoint_handle, channel_msg_t *msg) {
         //dequeue the message we just enqueued
         channel_msg_t handler_msg;
         memset(&handler_msg, 0, sizeof(handler_msg));
+        irq_state_t flags = spinlock_acquire_irqsave(&ch->lock);
         channel_msg_entry_t *e = ch->queue[peer_id];
         if (e) {
             ch->queue[peer_id] = e->next;
             if (!ch->queue[peer_id]) ch->queue_tail[peer_id] = NULL;
             ch->queue_len[peer_id]--;
-            
+        }
+        spinlock_release_irqrestore(&ch->lock, flags);
+        if (e) {
             handler_msg.data = e->data;
             handler_msg.data_len = e->data_len;
             handler_msg.handles = NULL;  //not used for kernel handlers
@@ -235,7 +290,7 @@ int channel_send(process_t *proc, int32 endpoint_handle, channel_msg_t *msg) {
             e->data = NULL;     //handler takes ownership
             e->objects = NULL;  //don't free - handler owns them now
             e->rights = NULL;
-            kfree(e);
+            kmem_cache_free(msg_cache, e);
             
             //call handler
             peer_ep->handler(peer_ep, &handler_msg, peer_ep->handler_ctx);
@@ -245,23 +300,33 @@ int channel_send(process_t *proc, int32 endpoint_handle, channel_msg_t *msg) {
     return 0;
 }
 
-int channel_recv(process_t *proc, int32 endpoint_handle, channel_msg_t *msg) {
+int channel_send(process_t *proc, int32 endpoint_handle, channel_msg_t *msg) {
     if (!proc || !msg) return -1;
     
     channel_endpoint_t *ep = channel_get_endpoint(proc, endpoint_handle);
     if (!ep) return -1;
     
+    int ret = endpoint_send(proc, ep, msg);
+    object_deref(&ep->obj);
+    return ret;
+}
+
+//receive on an endpoint the caller holds a reference to, the reference keeps
+//the channel alive while we sleep even if the handle is closed meanwhile
+static int endpoint_recv(process_t *proc, channel_endpoint_t *ep, channel_msg_t *msg) {
     channel_t *ch = ep->channel;
     int my_id = ep->endpoint_id;
     
     //wait for a message (blocking)
+    irq_state_t flags = spinlock_acquire_irqsave(&ch->lock);
     while (!ch->queue[my_id]) {
         //check if peer closed
         if (ch->closed[1 - my_id]) {
+            spinlock_release_irqrestore(&ch->lock, flags);
             return -2;  //peer closed, no more messages
         }
-        //sleep until woken (by message arrival)
-        thread_sleep(&ch->waiters[my_id]);
+        //sleep until woken (by message arrival or the peer closing)
+        thread_sleep_locked(&ch->waiters[my_id], &ch->lock);
     }
     
     //dequeue message
@@ -271,6 +336,7 @@ int channel_recv(process_t *proc, int32 endpoint_handle, channel_msg_t *msg) {
         ch->queue_tail[my_id] = NULL;
     }
     ch->queue_len[my_id]--;
+    spinlock_release_irqrestore(&ch->lock, flags);
     
     //copy data to caller
     msg->data = entry->data;  //caller takes ownership
@@ -287,7 +353,7 @@ int channel_recv(process_t *proc, int32 endpoint_handle, channel_msg_t *msg) {
             }
             kfree(entry->objects);
             kfree(entry->rights);
-            kfree(entry);
+            kmem_cache_free(msg_cache, entry);
             return -1;
         }
         msg->handle_count = entry->object_count;
@@ -308,7 +374,7 @@ int channel_recv(process_t *proc, int32 endpoint_handle, channel_msg_t *msg) {
                 msg->handle_count = 0;
                 kfree(entry->objects);
                 kfree(entry->rights);
-                kfree(entry);
+                kmem_cache_free(msg_cache, entry);
                 return -1;
             }
             msg->handles[i] = h;
@@ -322,10 +388,21 @@ int channel_recv(process_t *proc, int32 endpoint_handle, channel_msg_t *msg) {
         msg->handle_count = 0;
     }
     
-    kfree(entry);
+    kmem_cache_free(msg_cache, entry);
     return 0;
 }
 
+int channel_recv(process_t *proc, int32 endpoint_handle, channel_msg_t *msg) {
+    if (!proc || !msg) return -1;
+    
+    channel_endpoint_t *ep = channel_get_endpoint(proc, endpoint_handle);
+    if (!ep) return -1;
+    
+    int ret = endpoint_recv(proc, ep, msg);
+    object_deref(&ep->obj);
+    return ret;
+}
+
 int channel_close(process_t *proc, int32 endpoint_handle) {
     //just close the handle - the object close handler does the work
     return process_close_handle(proc, endpoint_handle);
@@ -335,10 +412,9 @@ int channel_peer_closed(process_t *proc, int32 endpoint_handle) {
     channel_endpoint_t *ep = channel_get_endpoint(proc, endpoint_handle);
     if (!ep) return -1;
     
-    channel_t *ch = ep->channel;
-    int peer_id = 1 - ep->endpoint_id;
-    
-    return ch->closed[peer_id];
+    int closed = ep->channel->closed[1 - ep->endpoint_id];
+    object_deref(&ep->obj);
+    return closed;
 }
 
 //channel server functions (for kernel-side handlers)
@@ -368,14 +444,14 @@ int channel_reply(channel_endpoint_t *ep, channel_msg_t *msg) {
     }
     
     //allocate queue entry
-    channel_msg_entry_t *entry = kzalloc(sizeof(channel_msg_entry_t));
+    channel_msg_entry_t *entry = channel_msg_entry_alloc();
     if (!entry) return -1;
     
     //copy data
     if (msg->data_len > 0 && msg->data) {
         entry->data = kmalloc(msg->data_len);
         if (!entry->data) {
-            kfree(entry);
+            kmem_cache_free(msg_cache, entry);
             return -1;
         }
         memcpy(entry->data, msg->data, msg->data_len);
@@ -390,7 +466,7 @@ int channel_reply(channel_endpoint_t *ep, channel_msg_t *msg) {
             if (entry->objects) kfree(entry->objects);
             if (entry->rights) kfree(entry->rights);
             if (entry->data) kfree(entry->data);
-            kfree(entry);
+            kmem_cache_free(msg_cache, entry);
             return -1;
         }
         
@@ -407,14 +483,11 @@ int channel_reply(channel_endpoint_t *ep, channel_msg_t *msg) {
     }
     
     //enqueue to peer
-    entry->next = NULL;
-    if (ch->queue_tail[peer_id]) {
-        ch->queue_tail[peer_id]->next = entry;
-    } else {
-        ch->queue[peer_id] = entry;
+    int err = channel_enqueue(ch, peer_id, entry);
+    if (err < 0) {
+        channel_msg_entry_free(entry);
+        return err;
     }
-    ch->queue_tail[peer_id] = entry;
-    ch->queue_len[peer_id]++;
     
     return 0;
 }
@@ -71,6 +71,8 @@ typedef struct channel {
     
     //state
     int closed[2]; //1 if endpoint is closed
+    
+    spinlock_t lock; //protects the queues and closed flags
 } channel_t;
 
 //create a channel
@@ -98,6 +100,23 @@ int channel_close(struct process *proc, int32 endpoint_handle);
 int channel_peer_closed(struct process *proc, int32 endpoint_handle);
 
 //get the channel endpoint object from a handle (returns NULL if not a channel)
+//it comes with a reference the caller drops with object_deref
 channel_endpoint_t *channel_get_endpoint(struct process *proc, int32 handle);
 
+//set up the message cache, before any channel is used
+void channel_init(void);
+
+//allocate a zeroed queue entry for code that enqueues messages directly
+//(freed by the channel when the message is received or dropped)
+channel_msg_entry_t *channel_msg_entry_alloc(void);
+
+//free an entry that never made it into a queue, along with its data and
+//any objects it carries
+void channel_msg_entry_free(channel_msg_entry_t *msg);
+
+//queue an entry for endpoint id and wake a thread waiting on it
+//returns -2 if the endpoint is closed and -3 if its queue is full, the
+//entry stays the caller's on failure (safe from IRQ context)
+int channel_enqueue(channel_t *ch, int id, channel_msg_entry_t *entry);
+
 #endif
@@ -186,22 +186,29 @@ int elf_load_user(const void *data, size len, pagemap_t *pagemap, elf_load_info_
         size seg_pages = seg_size / PAGE_SIZE;
         
         //allocate physical pages
-        void *phys = pmm_alloc(seg_pages);
+        //single page segments can come from the pre-zeroed pool
+        void *phys = seg_pages == 1 ? pmm_alloc_zeroed(1) : pmm_alloc(seg_pages);
         if (!phys) {
             //rollback already allocated segments
             elf_unload_user(pagemap, info);
             return ELF_ERR_NO_MEMORY;
         }
         
-        //zero the pages via HHDM
         void *virt_access = P2V(phys);
-        memset(virt_access, 0, seg_size);
         
         //copy file data
         if (phdr->p_filesz > 0) {
             memcpy((uint8 *)virt_access + seg_offset, base + phdr->p_offset, phdr->p_filesz);
         }
         
+        //zero only what the file data didn't overwrite (leading slack and bss)
+        if (seg_pages > 1) {
+            uint64 data_end = seg_offset + phdr->p_filesz;
+            if (data_end > seg_size) data_end = seg_size;
+            memset(virt_access, 0, seg_offset);
+            memset((uint8 *)virt_access + data_end, 0, seg_size - data_end);
+        }
+        
         //build MMU flags from ELF flags
         uint64 mmu_flags = MMU_FLAG_PRESENT | MMU_FLAG_USER;
         if (phdr->p_flags & PF_W) mmu_flags |= MMU_FLAG_WRITE;
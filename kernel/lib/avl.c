@@ -0,0 +1,154 @@
+#include <lib/avl.h>
+
+static inline int32 height(avl_node_t *node) {
+    return node ? node->height : 0;
+}
+
+//recompute the cached height and augmented data of one node
+static inline void fix(avl_tree_t *tree, avl_node_t *node) {
+    int32 l = height(node->left), r = height(node->right);
+    node->height = (l > r ? l : r) + 1;
+    if (tree->update) tree->update(node);
+}
+
+static void replace_child(avl_tree_t *tree, avl_node_t *parent, avl_node_t *old, avl_node_t *new) {
+    if (!parent) tree->root = new;
+    else if (parent->left == old) parent->left = new;
+    else parent->right = new;
+}
+
+static avl_node_t *rotate_left(avl_tree_t *tree, avl_node_t *x) {
+    avl_node_t *y = x->right;
+    x->right = y->left;
+    if (y->left) y->left->parent = x;
+    y->parent = x->parent;
+    replace_child(tree, x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+    fix(tree, x);
+    fix(tree, y);
+    return y;
+}
+
+static avl_node_t *rotate_right(avl_tree_t *tree, avl_node_t *x) {
+    avl_node_t *y = x->left;
+    x->left = y->right;
+    if (y->right) y->right->parent = x;
+    y->parent = x->parent;
+    replace_child(tree, x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+    fix(tree, x);
+    fix(tree, y);
+    return y;
+}
+
+//walk to the root fixing heights, augmented data and balance
+//always goes all the way up so augmented values stay correct
+static void rebalance_up(avl_tree_t *tree, avl_node_t *node) {
+    while (node) {
+        fix(tree, node);
+        int32 bal = height(node->left) - height(node->right);
+
+        if (bal > 1) {
+            if (height(node->left->left) < height(node->left->right)) rotate_left(tree, node->left);
+            node = rotate_right(tree, node);
+        } else if (bal < -1) {
+            if (height(node->right->right) < height(node->right->left)) rotate_right(tree, node->right);
+            node = rotate_left(tree, node);
+        }
+        node = node->parent;
+    }
+}
+
+void avl_init(avl_tree_t *tree, avl_cmp_t cmp, avl_update_t update) {
+    tree->root = NULL;
+    tree->cmp = cmp;
+    tree->update = update;
+}
+
+void avl_insert(avl_tree_t *tree, avl_node_t *node) {
+    avl_node_t *parent = NULL;
+    avl_node_t **link = &tree->root;
+
+    while (*link) {
+        parent = *link;
+        link = tree->cmp(node, parent) < 0 ? &parent->left : &parent->right;
+    }
+
+    node->left = node->right = NULL;
+    node->parent = parent;
+    node->height = 1;
+    *link = node;
+    rebalance_up(tree, node);
+}
+
+void avl_remove(avl_tree_t *tree, avl_node_t *node) {
+    avl_node_t *start;
+
+    if (!node->left || !node->right) {
+        //at most one child, splice it into our place
+        avl_node_t *child = node->left ? node->left : node->right;
+        if (child) child->parent = node->parent;
+        replace_child(tree, node->parent, node, child);
+        start = node->parent;
+    } else {
+        //two children, the in-order successor takes our place
+        avl_node_t *succ = node->right;
+        while (succ->left) succ = succ->left;
+
+        if (succ->parent == node) {
+            start = succ;
+        } else {
+            start = succ->parent;
+            succ->parent->left = succ->right;
+            if (succ->right) succ->right->parent = succ->parent;
+            succ->right = node->right;
+            node->right->parent = succ;
+        }
+
+        succ->left = node->left;
+        node->left->parent = succ;
+        succ->parent = node->parent;
+        replace_child(tree, node->parent, node, succ);
+    }
+
+    node->left = node->right = node->parent = NULL;
+    rebalance_up(tree, start);
+}
+
+void avl_update_path(avl_tree_t *tree, avl_node_t *node) {
+    for (; node; node = node->parent) fix(tree, node);
+}
+
+avl_node_t *avl_first(avl_tree_t *tree) {
+    avl_node_t *node = tree->root;
+    if (node) while (node->left) node = node->left;
+    return node;
+}
+
+avl_node_t *avl_last(avl_tree_t *tree) {
+    avl_node_t *node = tree->root;
+    if (node) while (node->right) node = node->right;
+    return node;
+}
+
+avl_node_t *avl_next(avl_node_t *node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left) node = node->left;
+        return node;
+    }
+    while (node->parent && node->parent->right == node) node = node->parent;
+    return node->parent;
+}
+
+avl_node_t *avl_prev(avl_node_t *node) {
+    if (node->left) {
+        node = node->left;
+        while (node->right) node = node->right;
+        return node;
+    }
+    while (node->parent && node->parent->left == node) node = node->parent;
+    return node->parent;
+}
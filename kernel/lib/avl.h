@@ -0,0 +1,51 @@
+#ifndef LIB_AVL_H
+#define LIB_AVL_H
+
+#include <arch/types.h>
+
+//intrusive AVL tree
+//embed an avl_node_t in the structure and use container_of style casts to get
+//back to it, the tree never allocates so it can be used by the allocators
+
+typedef struct avl_node {
+    struct avl_node *left;
+    struct avl_node *right;
+    struct avl_node *parent;
+    int32 height;
+} avl_node_t;
+
+//ordering of two nodes, negative/zero/positive like strcmp
+typedef int (*avl_cmp_t)(const avl_node_t *a, const avl_node_t *b);
+
+//optional augmentation hook, recomputes a node's cached subtree value from its
+//own data and its children, called bottom up whenever the shape below it changes
+typedef void (*avl_update_t)(avl_node_t *node);
+
+typedef struct avl_tree {
+    avl_node_t *root;
+    avl_cmp_t cmp;
+    avl_update_t update;
+} avl_tree_t;
+
+#define avl_entry(node, type, member) \
+    ((type *)((char *)(node) - __builtin_offsetof(type, member)))
+
+void avl_init(avl_tree_t *tree, avl_cmp_t cmp, avl_update_t update);
+
+//link a node in (equal keys go to the right of existing ones)
+void avl_insert(avl_tree_t *tree, avl_node_t *node);
+
+//unlink a node that is in the tree
+void avl_remove(avl_tree_t *tree, avl_node_t *node);
+
+//rerun the update hook from node up to the root
+//for when the augmented data of a node changed without changing its order
+void avl_update_path(avl_tree_t *tree, avl_node_t *node);
+
+//in-order traversal
+avl_node_t *avl_first(avl_tree_t *tree);
+avl_node_t *avl_last(avl_tree_t *tree);
+avl_node_t *avl_next(avl_node_t *node);
+avl_node_t *avl_prev(avl_node_t *node);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef LIB_SPINLOCK_H
+#define LIB_SPINLOCK_H
+
+#include <arch/types.h>
+#include <arch/cpu.h>
+
+//simple test-and-test-and-set spinlock
+typedef struct spinlock {
+    volatile uint32 locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spinlock_init(spinlock_t *lock) {
+    lock->locked = 0;
+}
+
+//holding a spinlock keeps the holder from being preempted (waiters would spin
+//on a lock whose owner isn't running)
+static inline void spinlock_acquire(spinlock_t *lock) {
+    arch_preempt_disable();
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        //spin on a plain read so waiters don't bounce the cache line
+        while (lock->locked) arch_spin_relax();
+    }
+}
+
+static inline void spinlock_release(spinlock_t *lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+    arch_preempt_enable();
+}
+
+//acquire with interrupts disabled (for locks that are also taken from IRQ context)
+static inline irq_state_t spinlock_acquire_irqsave(spinlock_t *lock) {
+    irq_state_t flags = arch_irq_save();
+    spinlock_acquire(lock);
+    return flags;
+}
+
+static inline void spinlock_release_irqrestore(spinlock_t *lock, irq_state_t flags) {
+    spinlock_release(lock);
+    arch_irq_restore(flags);
+}
+
+#endif
@@ -4,86 +4,440 @@
 #include <mm/mm.h>
 #include <lib/io.h>
 #include <lib/string.h>
+#include <lib/avl.h>
+#include <arch/cpu.h>
 
-#define BUCKET_COUNT 8
+//kmalloc size classes
+//powers of two with the 1.5x steps in between so no request wastes more than
+//a third of its slot, up to a page so a 4KB payload doesn't need the large path
+#define BUCKET_COUNT 16
+#define BUCKET_MAX   4096
 static slab_cache_t buckets[BUCKET_COUNT];
-static size bucket_sizes[BUCKET_COUNT] = {16, 32, 64, 128, 256, 512, 1024, 2048};
+static size bucket_sizes[BUCKET_COUNT] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+
+//request size (in 16 byte steps) to bucket index
+static uint8 bucket_index[BUCKET_MAX / KHEAP_MIN_ALIGN + 1];
+
+//slabs live in their own part of the heap in fixed size aligned slots so the
+//header of any slab (whatever its page count) is found by masking an object
+//address, large allocations use the rest of the range
+#define SLAB_VIRT_START KHEAP_VIRT_START
+#define SLAB_VIRT_END   (KHEAP_VIRT_START + 0x80000000000ULL)
+#define SLAB_SLOT_SIZE  (SLAB_MAX_PAGES * PAGE_SIZE)
+
+//freed slots are kept for reuse, past this many the VA is simply not reused
+#define SLAB_FREE_SLOTS 4096
+static uintptr slab_slot_cursor = SLAB_VIRT_START;
+static uintptr free_slots[SLAB_FREE_SLOTS];
+static uint32 free_slot_count = 0;
+
+//slab size is picked per cache so the tail left after the last object is at
+//most 1/KHEAP_SLAB_WASTE_DIV of the slab
+#define KHEAP_SLAB_WASTE_DIV 8
+
+//every cache including the kmalloc buckets, for stats
+static slab_cache_t *cache_list = NULL;
+static spinlock_t cache_list_lock = SPINLOCK_INIT;
 
-static uintptr heap_virt_cursor = KHEAP_VIRT_START;
 static bool kheap_ready = false;
 
-//when pages are freed we record the virtual address range as a hole so it
-//can be reused by future allocations this prevents unbounded virtual address space
-#define VHOLE_MAX_COUNT 256
+//protects the virtual range allocator and the slab slots
+//lock order: cache->lock, then mag_lock, then backing_lock
+static spinlock_t backing_lock = SPINLOCK_INIT;
 
-typedef struct {
-    uintptr addr;
+//global pool of empty magazines
+static spinlock_t mag_lock = SPINLOCK_INIT;
+static kmag_t *free_mags = NULL;
+
+//free virtual space above the slab slots is kept as address ordered ranges in
+//an AVL tree, each node caches the largest range in its subtree so a fit is
+//found in O(log n) and freed ranges merge with their neighbours
+typedef struct vrange {
+    avl_node_t node;
+    uintptr start;
     size pages;
-    bool in_use;
-} vhole_t;
+    size max_pages;             //largest range in this subtree
+} vrange_t;
 
-static vhole_t vholes[VHOLE_MAX_COUNT];
+static avl_tree_t vrange_tree;
 
-//find and reclaim a virtual hole of the exact size needed
-static void *backing_alloc(size pages) {
-    //try to find an exact-fit hole
-    for (int i = 0; i < VHOLE_MAX_COUNT; i++) {
-        if (vholes[i].in_use && vholes[i].pages == pages) {
-            uintptr vaddr = vholes[i].addr;
-            vholes[i].in_use = false;
+//range nodes come straight from the PMM through the HHDM so the range
+//allocator never recurses into the heap
+static vrange_t *vrange_free_nodes = NULL;
 
-            void *paddr = pmm_alloc(pages);
-            if (!paddr) return NULL;
+//large allocations of at least one huge page get a 2MB aligned virtual range
+//and are backed by aligned 2MB frames where the PMM can provide them so
+//mmu_map_range installs a single PDE per chunk
+#define HUGE_SIZE  0x200000
+#define HUGE_PAGES (HUGE_SIZE / PAGE_SIZE)
 
-            vmm_kernel_map(vaddr, (uintptr)paddr, pages, MMU_FLAG_PRESENT | MMU_FLAG_WRITE);
-            return (void *)vaddr;
-        }
+static int vrange_cmp(const avl_node_t *a, const avl_node_t *b) {
+    uintptr sa = avl_entry(a, vrange_t, node)->start;
+    uintptr sb = avl_entry(b, vrange_t, node)->start;
+    return sa < sb ? -1 : sa > sb;
+}
+
+static void vrange_update(avl_node_t *node) {
+    vrange_t *r = avl_entry(node, vrange_t, node);
+    r->max_pages = r->pages;
+    if (node->left) {
+        size m = avl_entry(node->left, vrange_t, node)->max_pages;
+        if (m > r->max_pages) r->max_pages = m;
     }
+    if (node->right) {
+        size m = avl_entry(node->right, vrange_t, node)->max_pages;
+        if (m > r->max_pages) r->max_pages = m;
+    }
+}
 
-    //no suitable hole found so bump allocate from cursor
-    if (heap_virt_cursor + (pages * PAGE_SIZE) > KHEAP_VIRT_END) {
-        printf("[kheap] ERR: virtual address space exhausted\n");
-        return NULL;
+static vrange_t *vrange_node_alloc(void) {
+    if (!vrange_free_nodes) {
+        void *page = pmm_alloc(1);
+        if (!page) return NULL;
+
+        vrange_t *nodes = (vrange_t *)P2V(page);
+        for (size i = 0; i < PAGE_SIZE / sizeof(vrange_t); i++) {
+            nodes[i].node.parent = (avl_node_t *)vrange_free_nodes;
+            vrange_free_nodes = &nodes[i];
+        }
     }
 
-    void *paddr = pmm_alloc(pages);
-    if (!paddr) return NULL;
+    vrange_t *r = vrange_free_nodes;
+    vrange_free_nodes = (vrange_t *)r->node.parent;
+    return r;
+}
 
-    void *vaddr = (void *)heap_virt_cursor;
-    vmm_kernel_map(heap_virt_cursor, (uintptr)paddr, pages, MMU_FLAG_PRESENT | MMU_FLAG_WRITE);
-    heap_virt_cursor += pages * PAGE_SIZE;
+static void vrange_node_free(vrange_t *r) {
+    r->node.parent = (avl_node_t *)vrange_free_nodes;
+    vrange_free_nodes = r;
+}
 
+//page aligned start of a range rounded up to align, 0 if it can't hold pages
+static uintptr vrange_fit(vrange_t *r, size pages, size align) {
+    uintptr start = (r->start + align - 1) & ~(align - 1);
+    uintptr end = r->start + r->pages * PAGE_SIZE;
+    if (start < r->start || start >= end) return 0;
+    return (end - start) / PAGE_SIZE >= pages ? start : 0;
+}
+
+//lowest addressed range that fits, subtrees whose largest range is too small
+//are skipped so unaligned requests only visit O(log n) nodes
+static vrange_t *vrange_find(avl_node_t *node, size pages, size align) {
+    if (!node || avl_entry(node, vrange_t, node)->max_pages < pages) return NULL;
+
+    vrange_t *r = vrange_find(node->left, pages, align);
+    if (r) return r;
+
+    r = avl_entry(node, vrange_t, node);
+    if (vrange_fit(r, pages, align)) return r;
+
+    return vrange_find(node->right, pages, align);
+}
+
+//carve an aligned run of pages out of the free ranges
+static uintptr vrange_alloc(size pages, size align) {
+    vrange_t *r = vrange_find(vrange_tree.root, pages, align);
+    if (!r) return 0;
+
+    uintptr vaddr = vrange_fit(r, pages, align);
+    uintptr end = r->start + r->pages * PAGE_SIZE;
+    uintptr alloc_end = vaddr + pages * PAGE_SIZE;
+
+    if (vaddr == r->start) {
+        //taken from the front, the node's order doesn't change
+        r->start = alloc_end;
+        r->pages -= pages;
+        if (r->pages == 0) {
+            avl_remove(&vrange_tree, &r->node);
+            vrange_node_free(r);
+        } else {
+            avl_update_path(&vrange_tree, &r->node);
+        }
+        return vaddr;
+    }
+
+    //alignment left a gap in front, keep it and split off any tail
+    if (alloc_end < end) {
+        vrange_t *tail = vrange_node_alloc();
+        if (!tail) return 0;
+        tail->start = alloc_end;
+        tail->pages = (end - alloc_end) / PAGE_SIZE;
+        avl_insert(&vrange_tree, &tail->node);
+    }
+    r->pages = (vaddr - r->start) / PAGE_SIZE;
+    avl_update_path(&vrange_tree, &r->node);
     return vaddr;
 }
 
-//free backing pages and record the virtual range as a hole for reuse
-static void backing_free(void *virt, size pages) {
+//claim exactly [start, start + pages) if all of it is free
+static bool vrange_take(uintptr start, size pages) {
+    //the range that would contain start is the last one beginning at or below it
+    vrange_t *r = NULL;
+    avl_node_t *node = vrange_tree.root;
+    while (node) {
+        vrange_t *cur = avl_entry(node, vrange_t, node);
+        if (cur->start <= start) {
+            r = cur;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+
+    if (!r) return false;
+    uintptr end = start + pages * PAGE_SIZE;
+    uintptr r_end = r->start + r->pages * PAGE_SIZE;
+    if (end > r_end) return false;
+
+    if (start == r->start) {
+        r->start = end;
+        r->pages -= pages;
+        if (r->pages == 0) {
+            avl_remove(&vrange_tree, &r->node);
+            vrange_node_free(r);
+        } else {
+            avl_update_path(&vrange_tree, &r->node);
+        }
+        return true;
+    }
+
+    if (end < r_end) {
+        vrange_t *tail = vrange_node_alloc();
+        if (!tail) return false;
+        tail->start = end;
+        tail->pages = (r_end - end) / PAGE_SIZE;
+        avl_insert(&vrange_tree, &tail->node);
+    }
+    r->pages = (start - r->start) / PAGE_SIZE;
+    avl_update_path(&vrange_tree, &r->node);
+    return true;
+}
+
+//return a range to the tree merging it with the ranges on either side
+static void vrange_free(uintptr start, size pages) {
+    //find the last range starting below us
+    vrange_t *prev = NULL;
+    avl_node_t *node = vrange_tree.root;
+    while (node) {
+        vrange_t *r = avl_entry(node, vrange_t, node);
+        if (r->start < start) {
+            prev = r;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+
+    avl_node_t *next_node = prev ? avl_next(&prev->node) : avl_first(&vrange_tree);
+    vrange_t *next = next_node ? avl_entry(next_node, vrange_t, node) : NULL;
+    uintptr end = start + pages * PAGE_SIZE;
+
+    bool merge_prev = prev && prev->start + prev->pages * PAGE_SIZE == start;
+    bool merge_next = next && next->start == end;
+
+    if (merge_prev) {
+        prev->pages += pages;
+        if (merge_next) {
+            prev->pages += next->pages;
+            avl_remove(&vrange_tree, &next->node);
+            vrange_node_free(next);
+        }
+        avl_update_path(&vrange_tree, &prev->node);
+        return;
+    }
+
+    if (merge_next) {
+        //growing downwards keeps the node between the same neighbours
+        next->start = start;
+        next->pages += pages;
+        avl_update_path(&vrange_tree, &next->node);
+        return;
+    }
+
+    vrange_t *r = vrange_node_alloc();
+    if (!r) {
+        printf("[kheap] WARN: out of memory for range node, leaking %zu pages at %P\n", pages, (void *)start);
+        return;
+    }
+    r->start = start;
+    r->pages = pages;
+    avl_insert(&vrange_tree, &r->node);
+}
+
+//true when the 2MB chunk at vaddr is backed by one contiguous run of frames
+static bool chunk_contiguous(pagemap_t *map, uintptr vaddr, uintptr paddr) {
+    if (vaddr % HUGE_SIZE || paddr % HUGE_SIZE) return false;
+    for (size i = 1; i < HUGE_PAGES; i++) {
+        if (mmu_virt_to_phys(map, vaddr + i * PAGE_SIZE) != paddr + i * PAGE_SIZE) return false;
+    }
+    return true;
+}
+
+//free the frames behind a mapped range without touching the mapping itself
+static void free_backing_pages(uintptr virt, size pages) {
     pagemap_t *map = mmu_get_kernel_pagemap();
 
-    //free each underlying physical page
-    for (size i = 0; i < pages; i++) {
-        uintptr vaddr = (uintptr)virt + (i * PAGE_SIZE);
+    for (size i = 0; i < pages; ) {
+        uintptr vaddr = virt + (i * PAGE_SIZE);
         uintptr paddr = mmu_virt_to_phys(map, vaddr);
-        if (paddr) {
-            pmm_free((void *)paddr, 1);
+        if (!paddr) {
+            i++;
+            continue;
         }
+
+        //whole 2MB frames go straight back to the buddy lists in one piece
+        if (pages - i >= HUGE_PAGES && chunk_contiguous(map, vaddr, paddr)) {
+            pmm_free((void *)paddr, HUGE_PAGES);
+            i += HUGE_PAGES;
+            continue;
+        }
+
+        //pages of a big buffer have long left the cache so queue them as cold
+        if (pages > 1) pmm_free_cold((void *)paddr);
+        else pmm_free((void *)paddr, 1);
+        i++;
+    }
+}
+
+//back a virtual range with individually allocated pages
+//when zeroing they come from the idle-zeroed pool where possible so kzalloc can skip its memset
+static bool map_single_pages(uintptr vaddr, size pages, bool zero) {
+    for (size i = 0; i < pages; i++) {
+        void *paddr = zero ? pmm_alloc_zeroed(1) : pmm_alloc(1);
+        if (!paddr) {
+            //undo what we mapped so far
+            free_backing_pages(vaddr, i);
+            if (i) vmm_unmap(mmu_get_kernel_pagemap(), vaddr, i);
+            return false;
+        }
+        vmm_kernel_map(vaddr + i * PAGE_SIZE, (uintptr)paddr, 1, MMU_FLAG_PRESENT | MMU_FLAG_WRITE);
+    }
+    return true;
+}
+
+//back a 2MB aligned virtual range with huge frames falling back to single
+//pages for the tail or once the PMM runs out of aligned 2MB blocks
+static bool map_huge_chunks(uintptr vaddr, size pages, bool zero) {
+    size i = 0;
+    while (pages - i >= HUGE_PAGES) {
+        void *paddr = pmm_alloc_huge();
+        if (!paddr) break;
+        if (zero) memset(P2V(paddr), 0, HUGE_SIZE);
+        vmm_kernel_map(vaddr + i * PAGE_SIZE, (uintptr)paddr, HUGE_PAGES, MMU_FLAG_PRESENT | MMU_FLAG_WRITE);
+        i += HUGE_PAGES;
     }
 
+    if (i < pages && !map_single_pages(vaddr + i * PAGE_SIZE, pages - i, zero)) {
+        free_backing_pages(vaddr, i);
+        if (i) vmm_unmap(mmu_get_kernel_pagemap(), vaddr, i);
+        return false;
+    }
+    return true;
+}
+
+//back a range too small (or too misaligned) for huge frames
+static bool map_small(uintptr vaddr, size pages, bool zero) {
+    if (zero || pages >= HUGE_PAGES) return map_single_pages(vaddr, pages, zero);
+
+    //contiguous is nicer for the TLB but not required
+    void *paddr = pmm_alloc(pages);
+    if (!paddr) return map_single_pages(vaddr, pages, false);
+
+    vmm_kernel_map(vaddr, (uintptr)paddr, pages, MMU_FLAG_PRESENT | MMU_FLAG_WRITE);
+    return true;
+}
+
+//huge frames only pay off from the first 2MB boundary on, a range starting
+//mid-chunk (like the tail of an in-place grow) backs the head with small pages
+static bool map_backing(uintptr vaddr, size pages, bool zero) {
+    size head = (HUGE_SIZE - vaddr % HUGE_SIZE) % HUGE_SIZE / PAGE_SIZE;
+    if (pages < head || pages - head < HUGE_PAGES) return map_small(vaddr, pages, zero);
+
+    if (head && !map_small(vaddr, head, zero)) return false;
+    if (map_huge_chunks(vaddr + head * PAGE_SIZE, pages - head, zero)) return true;
+
+    if (head) {
+        free_backing_pages(vaddr, head);
+        vmm_unmap(mmu_get_kernel_pagemap(), vaddr, head);
+    }
+    return false;
+}
+
+//reserve a virtual range and back it with pages
+static void *backing_alloc(size pages, bool zero) {
+    size align = pages >= HUGE_PAGES ? HUGE_SIZE : PAGE_SIZE;
+
+    uintptr vaddr = vrange_alloc(pages, align);
+    if (!vaddr) {
+        printf("[kheap] ERR: virtual address space exhausted\n");
+        return NULL;
+    }
+
+    if (!map_backing(vaddr, pages, zero)) {
+        vrange_free(vaddr, pages);
+        return NULL;
+    }
+    return (void *)vaddr;
+}
+
+//free backing pages and give the virtual range back for reuse
+static void backing_free(void *virt, size pages) {
+    free_backing_pages((uintptr)virt, pages);
+
     //unmap the virtual range
-    vmm_unmap(map, (uintptr)virt, pages);
-
-    //record as a hole for future reuse
-    for (int i = 0; i < VHOLE_MAX_COUNT; i++) {
-        if (!vholes[i].in_use) {
-            vholes[i].addr = (uintptr)virt;
-            vholes[i].pages = pages;
-            vholes[i].in_use = true;
-            return;
+    vmm_unmap(mmu_get_kernel_pagemap(), (uintptr)virt, pages);
+
+    vrange_free((uintptr)virt, pages);
+}
+
+//move the frames behind a mapped range to new virtual addresses
+//whole 2MB frames stay huge when both sides are aligned
+static void remap_backing(uintptr from, uintptr to, size pages) {
+    pagemap_t *map = mmu_get_kernel_pagemap();
+
+    for (size i = 0; i < pages; ) {
+        uintptr vaddr = from + i * PAGE_SIZE;
+        uintptr paddr = mmu_virt_to_phys(map, vaddr);
+        size run = 1;
+        if (pages - i >= HUGE_PAGES && (to + i * PAGE_SIZE) % HUGE_SIZE == 0 &&
+            chunk_contiguous(map, vaddr, paddr)) {
+            run = HUGE_PAGES;
         }
+        if (paddr) vmm_kernel_map(to + i * PAGE_SIZE, paddr, run, MMU_FLAG_PRESENT | MMU_FLAG_WRITE);
+        i += run;
+    }
+    vmm_unmap(map, from, pages);
+}
+
+//grow a mapped range to new_pages keeping its contents, returns the new
+//address or NULL (the old range is untouched on failure)
+//extends in place when the pages after it are free, otherwise the existing
+//frames are remapped to a bigger range so nothing gets copied
+static void *backing_grow(void *virt, size old_pages, size new_pages) {
+    uintptr old = (uintptr)virt;
+    size extra = new_pages - old_pages;
+
+    if (vrange_take(old + old_pages * PAGE_SIZE, extra)) {
+        if (map_backing(old + old_pages * PAGE_SIZE, extra, false)) return virt;
+        vrange_free(old + old_pages * PAGE_SIZE, extra);
+        return NULL;
     }
 
-    //no free slots so virtual address is leaked (rare asf edge case)
-    printf("[kheap] WARN: vhole table full, leaking %zu pages at %P\n", pages, virt);
+    size align = new_pages >= HUGE_PAGES ? HUGE_SIZE : PAGE_SIZE;
+    uintptr new = vrange_alloc(new_pages, align);
+    if (!new) return NULL;
+
+    //back the new tail first so a failure leaves the old range intact
+    if (!map_backing(new + old_pages * PAGE_SIZE, extra, false)) {
+        vrange_free(new, new_pages);
+        return NULL;
+    }
+
+    remap_backing(old, new, old_pages);
+    vrange_free(old, old_pages);
+    return (void *)new;
 }
 
 static void list_remove(slab_t **head, slab_t *slab) {
@@ -101,25 +455,83 @@ static void list_prepend(slab_t **head, slab_t *slab) {
 }
 
 
-//reate a new slab for the given cache
-//the slab header is placed at the start of the page followed by aligned objects
+//offset of the first object in a slab
+static inline size slab_first_obj(size align) {
+    return (sizeof(slab_t) + align - 1) & ~(align - 1);
+}
+
+static inline uint32 slab_capacity(size pages, size obj_size, size align) {
+    size first = slab_first_obj(align);
+    size bytes = pages * PAGE_SIZE;
+    return bytes > first ? (bytes - first) / obj_size : 0;
+}
+
+//pick the smallest slab whose unused tail is within the waste target
+//falling back to whichever size wastes the least
+static uint32 slab_pages_for(size obj_size, size align) {
+    uint32 best = 0;
+    size best_waste = (size)-1;
+
+    for (uint32 pages = 1; pages <= SLAB_MAX_PAGES; pages <<= 1) {
+        uint32 n = slab_capacity(pages, obj_size, align);
+        if (n == 0) continue;
+
+        size bytes = pages * PAGE_SIZE;
+        size waste = bytes - n * obj_size;
+        if (waste * KHEAP_SLAB_WASTE_DIV <= bytes) return pages;
+
+        //compare as a fraction of the slab
+        if (best == 0 || waste * (best * PAGE_SIZE) < best_waste * bytes) {
+            best = pages;
+            best_waste = waste;
+        }
+    }
+    return best;
+}
+
+static uintptr slot_alloc(void) {
+    if (free_slot_count > 0) return free_slots[--free_slot_count];
+    if (slab_slot_cursor + SLAB_SLOT_SIZE > SLAB_VIRT_END) {
+        printf("[kheap] ERR: slab address space exhausted\n");
+        return 0;
+    }
+    uintptr slot = slab_slot_cursor;
+    slab_slot_cursor += SLAB_SLOT_SIZE;
+    return slot;
+}
+
+static void slot_free(uintptr slot) {
+    if (free_slot_count < SLAB_FREE_SLOTS) free_slots[free_slot_count++] = slot;
+}
+
+//find the slab an object lives in (NULL if it isn't a slab object)
+static inline slab_t *obj_to_slab(const void *p) {
+    uintptr addr = (uintptr)p;
+    if (addr < SLAB_VIRT_START || addr >= SLAB_VIRT_END) return NULL;
+    slab_t *slab = (slab_t *)(addr & ~((uintptr)SLAB_SLOT_SIZE - 1));
+    return slab->magic == KHEAP_MAGIC_SLAB ? slab : NULL;
+}
+
+//create a new slab for the given cache
+//the slab header is placed at the start of the slot followed by aligned objects
 static slab_t *slab_create(slab_cache_t *cache) {
-    void *page = backing_alloc(1);
-    if (!page) return NULL;
+    uintptr slot = slot_alloc();
+    if (!slot) return NULL;
+    if (!map_backing(slot, cache->slab_pages, false)) {
+        slot_free(slot);
+        return NULL;
+    }
 
-    slab_t *slab = (slab_t *)page;
+    slab_t *slab = (slab_t *)slot;
     slab->magic = KHEAP_MAGIC_SLAB;
     slab->cache = cache;
+    slab->pages = cache->slab_pages;
     slab->next = slab->prev = NULL;
 
-    //calculate aligned start address for objects
-    uintptr obj_start = (uintptr)page + sizeof(slab_t);
-    size align = cache->obj_size < KHEAP_MIN_ALIGN ? KHEAP_MIN_ALIGN : cache->obj_size;
-    obj_start = (obj_start + align - 1) & ~(align - 1);
-
     //initialize free list
+    uintptr obj_start = slot + slab_first_obj(cache->align);
     slab->free_list = (slab_obj_t *)obj_start;
-    slab->total_objs = (PAGE_SIZE - (obj_start - (uintptr)page)) / cache->obj_size;
+    slab->total_objs = slab_capacity(slab->pages, cache->obj_size, cache->align);
     slab->free_objs = slab->total_objs;
 
     //chain all objects into the free list
@@ -130,6 +542,7 @@ static slab_t *slab_create(slab_cache_t *cache) {
     }
     curr->next = NULL;
 
+    cache->slab_count++;
     return slab;
 }
 
@@ -137,55 +550,462 @@ static slab_t *slab_create(slab_cache_t *cache) {
 static void slab_destroy(slab_t *slab) {
     slab_cache_t *cache = slab->cache;
     list_remove(&cache->empty_slabs, slab);
-    backing_free(slab, 1);
+    cache->slab_count--;
+
+    uintptr slot = (uintptr)slab;
+    size pages = slab->pages;
+    free_backing_pages(slot, pages);
+    vmm_unmap(mmu_get_kernel_pagemap(), slot, pages);
+    slot_free(slot);
+}
+
+//take one object from the slab lists, caller holds cache->lock
+static void *slab_alloc_obj(slab_cache_t *cache) {
+    //find a slab with free space
+    slab_t *slab = cache->partial_slabs;
+    if (!slab) {
+        slab = cache->empty_slabs;
+        if (!slab) {
+            spinlock_acquire(&backing_lock);
+            slab = slab_create(cache);
+            spinlock_release(&backing_lock);
+            if (!slab) return NULL;
+        } else {
+            list_remove(&cache->empty_slabs, slab);
+        }
+        list_prepend(&cache->partial_slabs, slab);
+    }
+
+    //allocate from the slab's free list
+    slab_obj_t *obj = slab->free_list;
+    slab->free_list = obj->next;
+    slab->free_objs--;
+
+    //move to full list if slab is now exhausted
+    if (slab->free_objs == 0) {
+        list_remove(&cache->partial_slabs, slab);
+        list_prepend(&cache->full_slabs, slab);
+    }
+
+    //the free list link clobbered the object so construct it again
+    if (cache->ctor) cache->ctor(obj);
+    return obj;
+}
+
+//return one object to its slab, caller holds cache->lock
+static void slab_free_obj(slab_t *slab, void *p) {
+    slab_cache_t *cache = slab->cache;
+
+    slab_obj_t *obj = (slab_obj_t *)p;
+    obj->next = slab->free_list;
+    slab->free_list = obj;
+    slab->free_objs++;
+
+    //manage slab list transitions
+    //a slab holding a single object goes straight from full to empty
+    bool was_full = slab->free_objs == 1;
+    if (slab->free_objs == slab->total_objs) {
+        //now empty
+        list_remove(was_full ? &cache->full_slabs : &cache->partial_slabs, slab);
+        list_prepend(&cache->empty_slabs, slab);
+
+        //eagerly destroy this slab if we have other slabs available
+        //keep at least one empty slab per cache to avoid thrashing
+        bool have_other_slabs = cache->partial_slabs ||
+                                (cache->empty_slabs && cache->empty_slabs->next);
+        if (have_other_slabs) {
+            spinlock_acquire(&backing_lock);
+            slab_destroy(slab);
+            spinlock_release(&backing_lock);
+        }
+    } else if (was_full) {
+        //was full and now partial
+        list_remove(&cache->full_slabs, slab);
+        list_prepend(&cache->partial_slabs, slab);
+    }
+}
+
+//magazines are carved out of whole pages and kept on a global free list
+//so the magazine layer never recurses into kmalloc
+static kmag_t *mag_alloc(void) {
+    spinlock_acquire(&mag_lock);
+    if (!free_mags) {
+        spinlock_acquire(&backing_lock);
+        kmag_t *page = backing_alloc(1, false);
+        spinlock_release(&backing_lock);
+
+        if (page) {
+            for (size i = 0; i < PAGE_SIZE / sizeof(kmag_t); i++) {
+                page[i].next = free_mags;
+                free_mags = &page[i];
+            }
+        }
+    }
+
+    kmag_t *mag = free_mags;
+    if (mag) {
+        free_mags = mag->next;
+        mag->next = NULL;
+        mag->rounds = 0;
+    }
+    spinlock_release(&mag_lock);
+    return mag;
+}
+
+static void mag_free(kmag_t *mag) {
+    spinlock_acquire(&mag_lock);
+    mag->next = free_mags;
+    free_mags = mag;
+    spinlock_release(&mag_lock);
+}
+
+//full magazines a depot may hold before frees spill back into the slabs
+#define KMAG_DEPOT_MAX 8
+
+static void *cache_alloc(slab_cache_t *cache) {
+    irq_state_t flags = arch_irq_save();
+    kmag_cpu_t *mc = &cache->cpu[arch_cpu_id()];
+    void *obj = NULL;
+
+    mc->allocs++;
+
+    //fast path so pop from the loaded magazine
+    if (mc->loaded && mc->loaded->rounds > 0) {
+        obj = mc->loaded->objs[--mc->loaded->rounds];
+        arch_irq_restore(flags);
+        return obj;
+    }
+
+    //previous is full so swap it in
+    if (mc->previous && mc->previous->rounds > 0) {
+        kmag_t *tmp = mc->loaded;
+        mc->loaded = mc->previous;
+        mc->previous = tmp;
+        obj = mc->loaded->objs[--mc->loaded->rounds];
+        arch_irq_restore(flags);
+        return obj;
+    }
+
+    spinlock_acquire(&cache->lock);
+
+    //both magazines empty so trade one for a full magazine from the depot
+    kmag_t *full = cache->depot_full;
+    if (full) {
+        cache->depot_full = full->next;
+        cache->depot_count--;
+        spinlock_release(&cache->lock);
+
+        if (mc->previous) mag_free(mc->previous);
+        mc->previous = mc->loaded;
+        mc->loaded = full;
+        obj = full->objs[--full->rounds];
+        arch_irq_restore(flags);
+        return obj;
+    }
+
+    //depot is dry too so go to the slab layer
+    obj = slab_alloc_obj(cache);
+    spinlock_release(&cache->lock);
+    if (!obj) mc->allocs--;
+    arch_irq_restore(flags);
+    return obj;
+}
+
+static void cache_free(slab_t *slab, void *p) {
+    slab_cache_t *cache = slab->cache;
+    irq_state_t flags = arch_irq_save();
+    kmag_cpu_t *mc = &cache->cpu[arch_cpu_id()];
+
+    mc->frees++;
+
+    //fast path so push onto the loaded magazine
+    if (mc->loaded && mc->loaded->rounds < KMAG_SIZE) {
+        mc->loaded->objs[mc->loaded->rounds++] = p;
+        arch_irq_restore(flags);
+        return;
+    }
+
+    //previous is empty so swap it in
+    if (mc->previous && mc->previous->rounds == 0) {
+        kmag_t *tmp = mc->loaded;
+        mc->loaded = mc->previous;
+        mc->previous = tmp;
+        mc->loaded->objs[mc->loaded->rounds++] = p;
+        arch_irq_restore(flags);
+        return;
+    }
+
+    //both full (or missing) so hand a full one to the depot and load an empty one
+    //once the depot holds enough the full magazine is emptied into the slabs instead
+    kmag_t *empty = NULL;
+    if (mc->previous) {
+        kmag_t *full = mc->previous;
+        mc->previous = NULL;
+
+        spinlock_acquire(&cache->lock);
+        if (cache->depot_count < KMAG_DEPOT_MAX) {
+            full->next = cache->depot_full;
+            cache->depot_full = full;
+            cache->depot_count++;
+        } else {
+            while (full->rounds > 0) {
+                void *obj = full->objs[--full->rounds];
+                slab_free_obj(obj_to_slab(obj), obj);
+            }
+            empty = full;
+        }
+        spinlock_release(&cache->lock);
+    }
+
+    if (!empty) empty = mag_alloc();
+    if (empty) {
+        mc->previous = mc->loaded;
+        mc->loaded = empty;
+        empty->objs[empty->rounds++] = p;
+        arch_irq_restore(flags);
+        return;
+    }
+
+    //no memory for a magazine so free straight to the slab
+    spinlock_acquire(&cache->lock);
+    slab_free_obj(slab, p);
+    spinlock_release(&cache->lock);
+    arch_irq_restore(flags);
+}
+
+static void cache_init(slab_cache_t *cache, const char *name, size obj_size, size align,
+                       void (*ctor)(void *)) {
+    memset(cache, 0, sizeof(*cache));
+    strncpy(cache->name, name, KMEM_NAME_LEN - 1);
+    cache->obj_size = obj_size;
+    cache->align = align;
+    cache->ctor = ctor;
+    cache->slab_pages = slab_pages_for(obj_size, align);
+    spinlock_init(&cache->lock);
+
+    irq_state_t flags = spinlock_acquire_irqsave(&cache_list_lock);
+    cache->next = cache_list;
+    cache_list = cache;
+    spinlock_release_irqrestore(&cache_list_lock, flags);
+}
+
+//internal fragmentation of every kmalloc class as laid out in its slabs
+//tail is what's left after the last object, waste also counts the header
+static void kheap_report_layout(void) {
+    printf("[kheap] %-14s %6s %6s %6s %6s %6s\n", "class", "align", "pages", "objs", "tail", "waste");
+    for (int i = 0; i < BUCKET_COUNT; i++) {
+        slab_cache_t *cache = &buckets[i];
+        size bytes = cache->slab_pages * PAGE_SIZE;
+        uint32 n = slab_capacity(cache->slab_pages, cache->obj_size, cache->align);
+        size tail = bytes - slab_first_obj(cache->align) - n * cache->obj_size;
+        size waste = bytes - n * cache->obj_size;
+        printf("[kheap] %-14s %6zu %6u %6u %6zu %5zu%%\n", cache->name, cache->align,
+               cache->slab_pages, n, tail, (waste * 100) / bytes);
+    }
 }
 
 void kheap_init(void) {
+    //everything above the slab slots starts out as one free range
+    avl_init(&vrange_tree, vrange_cmp, vrange_update);
+    vrange_free(SLAB_VIRT_END, (KHEAP_VIRT_END - SLAB_VIRT_END) / PAGE_SIZE);
+
     for (int i = 0; i < BUCKET_COUNT; i++) {
-        buckets[i].obj_size = bucket_sizes[i];
-        buckets[i].partial_slabs = NULL;
-        buckets[i].full_slabs = NULL;
-        buckets[i].empty_slabs = NULL;
+        char name[KMEM_NAME_LEN];
+        snprintf(name, sizeof(name), "kmalloc-%zu", bucket_sizes[i]);
+
+        //natural alignment up to a cache line (3072 byte objects only need 64)
+        size align = bucket_sizes[i] & -bucket_sizes[i];
+        if (align > 64) align = 64;
+        cache_init(&buckets[i], name, bucket_sizes[i], align, NULL);
+    }
+
+    //map every 16 byte step of request size to the smallest bucket that holds it
+    int b = 0;
+    for (size i = 0; i <= BUCKET_MAX / KHEAP_MIN_ALIGN; i++) {
+        while (bucket_sizes[b] < i * KHEAP_MIN_ALIGN) b++;
+        bucket_index[i] = b;
     }
+
     kheap_ready = true;
-    printf("[kheap] initialized (buckets: 16B-2KB, range: 0x%lX...)\n", KHEAP_VIRT_START);
+    printf("[kheap] initialized (buckets: 16B-4KB, range: 0x%lX...)\n", KHEAP_VIRT_START);
+    kheap_report_layout();
 }
 
-void *kmalloc(size n) {
-    if (n == 0 || !kheap_ready) return NULL;
+kmem_cache_t *kmem_cache_create(const char *name, size obj_size, size align, void (*ctor)(void *)) {
+    if (!kheap_ready || obj_size == 0) return NULL;
+    if (align == 0) align = KHEAP_MIN_ALIGN;
+    if (align & (align - 1)) {
+        printf("[kheap] ERR: cache %s: alignment %zu is not a power of two\n", name, align);
+        return NULL;
+    }
 
-    //try to satisfy from a slab bucket
-    for (int i = 0; i < BUCKET_COUNT; i++) {
-        if (n <= bucket_sizes[i]) {
-            slab_cache_t *cache = &buckets[i];
-
-            //find a slab with free space
-            slab_t *slab = cache->partial_slabs;
-            if (!slab) {
-                slab = cache->empty_slabs;
-                if (!slab) {
-                    slab = slab_create(cache);
-                    if (!slab) return NULL;
-                } else {
-                    list_remove(&cache->empty_slabs, slab);
-                }
-                list_prepend(&cache->partial_slabs, slab);
-            }
+    //objects hold the free list link while free and are packed at their alignment
+    if (obj_size < sizeof(slab_obj_t)) obj_size = sizeof(slab_obj_t);
+    obj_size = (obj_size + align - 1) & ~(align - 1);
 
-            //allocate from the slab's free list
-            slab_obj_t *obj = slab->free_list;
-            slab->free_list = obj->next;
-            slab->free_objs--;
+    if (slab_capacity(SLAB_MAX_PAGES, obj_size, align) == 0) {
+        printf("[kheap] ERR: cache %s: %zu byte objects don't fit a slab\n", name, obj_size);
+        return NULL;
+    }
 
-            //move to full list if slab is now exhausted
-            if (slab->free_objs == 0) {
-                list_remove(&cache->partial_slabs, slab);
-                list_prepend(&cache->full_slabs, slab);
-            }
+    //whole pages keep the per-CPU state cache line aligned
+    kmem_cache_t *cache = kzalloc_pages((sizeof(kmem_cache_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (!cache) return NULL;
+
+    cache_init(cache, name, obj_size, align, ctor);
+    return cache;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    if (!cache) return NULL;
+    return cache_alloc(cache);
+}
 
-            return (void *)obj;
+void *kmem_cache_zalloc(kmem_cache_t *cache) {
+    void *obj = kmem_cache_alloc(cache);
+    if (obj) memset(obj, 0, cache->obj_size);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (!cache || !obj) return;
+
+    slab_t *slab = obj_to_slab(obj);
+    if (!slab || slab->cache != cache) {
+        printf("[kheap] ERR: %P does not belong to cache %s\n", obj, cache->name);
+        return;
+    }
+    cache_free(slab, obj);
+}
+
+//magazines handed back by every CPU for cache_flush()
+typedef struct {
+    slab_cache_t *cache;
+    kmag_t *mags;
+} cache_flush_t;
+
+//detach the calling CPU's magazines onto the flush list, interrupts are off
+//on the owning CPU so this can't land in the middle of the lock-free fast path
+static void cache_take_mags(void *arg) {
+    cache_flush_t *f = (cache_flush_t *)arg;
+    kmag_t **list = &f->mags;
+    kmag_cpu_t *mc = &f->cache->cpu[arch_cpu_id()];
+    kmag_t *mags[2] = { mc->loaded, mc->previous };
+    mc->loaded = mc->previous = NULL;
+
+    for (int m = 0; m < 2; m++) {
+        if (!mags[m]) continue;
+        kmag_t *head = __atomic_load_n(list, __ATOMIC_RELAXED);
+        do {
+            mags[m]->next = head;
+        } while (!__atomic_compare_exchange_n(list, &head, mags[m], false,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+}
+
+//push every cached object of a cache back into its slabs
+static void cache_flush(slab_cache_t *cache) {
+    //each CPU gives up its own magazines, reaching into another CPU's would
+    //race its fast path which touches them without the cache lock
+    cache_flush_t f = { cache, NULL };
+    irq_state_t flags = arch_irq_save();
+    cache_take_mags(&f);
+    smp_call_many(smp_online_mask(), cache_take_mags, &f);
+    arch_irq_restore(flags);
+
+    flags = spinlock_acquire_irqsave(&cache->lock);
+
+    //collected magazines go through the same path as the depot
+    kmag_t *mags = __atomic_load_n(&f.mags, __ATOMIC_ACQUIRE);
+    while (mags) {
+        kmag_t *mag = mags;
+        mags = mag->next;
+        mag->next = cache->depot_full;
+        cache->depot_full = mag;
+    }
+
+    while (cache->depot_full) {
+        kmag_t *mag = cache->depot_full;
+        cache->depot_full = mag->next;
+        while (mag->rounds > 0) {
+            void *obj = mag->objs[--mag->rounds];
+            slab_free_obj(obj_to_slab(obj), obj);
+        }
+        mag_free(mag);
+    }
+    cache->depot_count = 0;
+
+    spinlock_release_irqrestore(&cache->lock, flags);
+}
+
+void kmem_cache_destroy(kmem_cache_t *cache) {
+    if (!cache) return;
+
+    cache_flush(cache);
+
+    if (cache->partial_slabs || cache->full_slabs) {
+        printf("[kheap] ERR: destroying cache %s with live objects, leaking it\n", cache->name);
+        return;
+    }
+
+    irq_state_t flags = spinlock_acquire_irqsave(&cache_list_lock);
+    for (slab_cache_t **pp = &cache_list; *pp; pp = &(*pp)->next) {
+        if (*pp == cache) {
+            *pp = cache->next;
+            break;
         }
     }
+    spinlock_release_irqrestore(&cache_list_lock, flags);
+
+    flags = spinlock_acquire_irqsave(&backing_lock);
+    while (cache->empty_slabs) slab_destroy(cache->empty_slabs);
+    spinlock_release_irqrestore(&backing_lock, flags);
+
+    kfree_pages(cache, (sizeof(kmem_cache_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+}
+
+void kmem_cache_get_stats(kmem_cache_t *cache, kmem_cache_stats_t *stats) {
+    if (!cache || !stats) return;
+
+    memset(stats, 0, sizeof(*stats));
+    for (uint32 c = 0; c < MAX_CPUS; c++) {
+        stats->allocs += cache->cpu[c].allocs;
+        stats->frees += cache->cpu[c].frees;
+    }
+    stats->active = stats->allocs - stats->frees;
+    stats->obj_size = cache->obj_size;
+    stats->slabs = cache->slab_count;
+    stats->slab_pages = cache->slab_pages;
+    stats->objs_per_slab = slab_capacity(cache->slab_pages, cache->obj_size, cache->align);
+}
+
+void kmem_cache_dump(void) {
+    printf("[kheap] %-20s %6s %8s %10s %6s %5s\n", "cache", "size", "active", "allocs", "slabs", "used");
+
+    irq_state_t flags = spinlock_acquire_irqsave(&cache_list_lock);
+    for (slab_cache_t *cache = cache_list; cache; cache = cache->next) {
+        kmem_cache_stats_t st;
+        kmem_cache_get_stats(cache, &st);
+
+        //share of the slab memory that holds live objects
+        uint64 capacity = (uint64)st.slabs * st.slab_pages * PAGE_SIZE;
+        uint64 used = capacity ? (st.active * st.obj_size * 100) / capacity : 0;
+        printf("[kheap] %-20s %6zu %8llu %10llu %6u %4llu%%\n", cache->name, st.obj_size,
+               st.active, st.allocs, st.slabs, used);
+    }
+    spinlock_release_irqrestore(&cache_list_lock, flags);
+}
+
+static void *kheap_alloc(size n, bool zero) {
+    if (n == 0 || !kheap_ready) return NULL;
+
+    //try to satisfy from a slab bucket
+    if (n <= BUCKET_MAX) {
+        slab_cache_t *cache = &buckets[bucket_index[(n + KHEAP_MIN_ALIGN - 1) / KHEAP_MIN_ALIGN]];
+        void *obj = cache_alloc(cache);
+        if (obj && zero) memset(obj, 0, n);
+        return obj;
+    }
 
     //when large allocation allocate pages directly with header
     size total = n + sizeof(kheap_large_t);
@@ -193,7 +1013,9 @@ void *kmalloc(size n) {
     total = (total + KHEAP_MIN_ALIGN - 1) & ~(KHEAP_MIN_ALIGN - 1);
     size pages = (total + PAGE_SIZE - 1) / PAGE_SIZE;
 
-    kheap_large_t *large = (kheap_large_t *)backing_alloc(pages);
+    irq_state_t flags = spinlock_acquire_irqsave(&backing_lock);
+    kheap_large_t *large = (kheap_large_t *)backing_alloc(pages, zero);
+    spinlock_release_irqrestore(&backing_lock, flags);
     if (!large) return NULL;
 
     large->magic = KHEAP_MAGIC_LARGE;
@@ -205,55 +1027,71 @@ void *kmalloc(size n) {
     return (void *)data;
 }
 
+void *kmalloc(size n) {
+    return kheap_alloc(n, false);
+}
+
+//large allocations are backed by pre-zeroed pages so only slab objects get cleared here
 void *kzalloc(size n) {
-    void *p = kmalloc(n);
-    if (p) memset(p, 0, n);
+    return kheap_alloc(n, true);
+}
+
+void *kzalloc_pages(size pages) {
+    if (pages == 0 || !kheap_ready) return NULL;
+
+    irq_state_t flags = spinlock_acquire_irqsave(&backing_lock);
+    void *p = backing_alloc(pages, true);
+    spinlock_release_irqrestore(&backing_lock, flags);
     return p;
 }
 
+void kfree_pages(void *p, size pages) {
+    if (!p || pages == 0) return;
+
+    irq_state_t flags = spinlock_acquire_irqsave(&backing_lock);
+    backing_free(p, pages);
+    spinlock_release_irqrestore(&backing_lock, flags);
+}
+
+void *kvalloc(size pages) {
+    if (pages == 0 || !kheap_ready) return NULL;
+
+    size align = pages >= HUGE_PAGES ? HUGE_SIZE : PAGE_SIZE;
+    irq_state_t flags = spinlock_acquire_irqsave(&backing_lock);
+    uintptr vaddr = vrange_alloc(pages, align);
+    spinlock_release_irqrestore(&backing_lock, flags);
+    return (void *)vaddr;
+}
+
+void kvfree(void *p, size pages) {
+    if (!p || pages == 0) return;
+
+    vmm_unmap(mmu_get_kernel_pagemap(), (uintptr)p, pages);
+
+    irq_state_t flags = spinlock_acquire_irqsave(&backing_lock);
+    vrange_free((uintptr)p, pages);
+    spinlock_release_irqrestore(&backing_lock, flags);
+}
+
 void kfree(void *p) {
     if (!p) return;
 
-    //determine allocation type by checking magic at page start
-    uintptr page_addr = (uintptr)p & ~(PAGE_SIZE - 1);
-    slab_t *meta = (slab_t *)page_addr;
-
-    if (meta->magic == KHEAP_MAGIC_SLAB) {
-        //slab allocation: return object to free list
-        slab_t *slab = meta;
-        slab_cache_t *cache = slab->cache;
-
-        slab_obj_t *obj = (slab_obj_t *)p;
-        obj->next = slab->free_list;
-        slab->free_list = obj;
-        slab->free_objs++;
-
-        //manage slab list transitions
-        if (slab->free_objs == 1) {
-            //was full and now partial
-            list_remove(&cache->full_slabs, slab);
-            list_prepend(&cache->partial_slabs, slab);
-        } else if (slab->free_objs == slab->total_objs) {
-            //was partial and now empty
-            list_remove(&cache->partial_slabs, slab);
-            list_prepend(&cache->empty_slabs, slab);
-
-            //eagerly destroy this slab if we have other slabs available
-            //keep at least one empty slab per cache to avoid thrashing
-            bool have_other_slabs = cache->partial_slabs ||
-                                    (cache->empty_slabs && cache->empty_slabs->next);
-            if (have_other_slabs) {
-                slab_destroy(slab);
-            }
-        }
+    //slab objects are recognised by address, the header is at the slot start
+    slab_t *slab = obj_to_slab(p);
+    if (slab) {
+        //slab allocation: goes back through the per-CPU magazines
+        cache_free(slab, p);
+        return;
+    }
+
+    //large allocation: header at the start of the first page
+    kheap_large_t *large = (kheap_large_t *)((uintptr)p & ~(PAGE_SIZE - 1));
+    if (large->magic == KHEAP_MAGIC_LARGE) {
+        irq_state_t flags = spinlock_acquire_irqsave(&backing_lock);
+        backing_free(large, large->pages);
+        spinlock_release_irqrestore(&backing_lock, flags);
     } else {
-        //large allocation: find header and free pages
-        kheap_large_t *large = (kheap_large_t *)page_addr;
-        if (large->magic == KHEAP_MAGIC_LARGE) {
-            backing_free(large, large->pages);
-        } else {
-            printf("[kheap] ERR: kfree invalid pointer %P (magic 0x%X)\n", p, meta->magic);
-        }
+        printf("[kheap] ERR: kfree invalid pointer %P (magic 0x%X)\n", p, large->magic);
     }
 }
 
@@ -266,19 +1104,31 @@ void *krealloc(void *p, size n) {
 
     //determine current allocation size
     uintptr page_addr = (uintptr)p & ~(PAGE_SIZE - 1);
-    slab_t *meta = (slab_t *)page_addr;
+    slab_t *slab = obj_to_slab(p);
 
     size old_size = 0;
-    if (meta->magic == KHEAP_MAGIC_SLAB) {
-        old_size = meta->cache->obj_size;
+    if (slab) {
+        old_size = slab->cache->obj_size;
         if (n <= old_size) return p; //already fits
     } else {
         kheap_large_t *large = (kheap_large_t *)page_addr;
-        if (large->magic == KHEAP_MAGIC_LARGE) {
-            old_size = (large->pages * PAGE_SIZE) - sizeof(kheap_large_t);
-            if (n <= old_size) return p; //already fits
-        } else {
-            return NULL; //invalid pointer
+        if (large->magic != KHEAP_MAGIC_LARGE) return NULL; //invalid pointer
+
+        old_size = (large->pages * PAGE_SIZE) - sizeof(kheap_large_t);
+        if (n <= old_size) return p; //already fits
+
+        //grow the page range instead of copying, the data keeps its offset
+        //from the header so only the base address can change
+        size total = (n + sizeof(kheap_large_t) + KHEAP_MIN_ALIGN - 1) & ~(KHEAP_MIN_ALIGN - 1);
+        size pages = (total + PAGE_SIZE - 1) / PAGE_SIZE;
+
+        irq_state_t flags = spinlock_acquire_irqsave(&backing_lock);
+        kheap_large_t *grown = backing_grow(large, large->pages, pages);
+        spinlock_release_irqrestore(&backing_lock, flags);
+
+        if (grown) {
+            grown->pages = pages;
+            return (void *)((uintptr)grown + ((uintptr)p - page_addr));
         }
     }
 
@@ -3,6 +3,7 @@
 
 #include <arch/types.h>
 #include <arch/mmu.h>
+#include <lib/spinlock.h>
 
 //magic numbers for allocation validation
 #define KHEAP_MAGIC_SLAB  0x51AB51AB
@@ -19,11 +20,15 @@ typedef struct slab_obj {
 
 struct slab_cache;
 
-//slab header - stored at the start of each slab page
+//largest slab in pages - slabs sit in SLAB_MAX_PAGES sized aligned slots
+#define SLAB_MAX_PAGES 8
+
+//slab header - stored at the start of each slab
 //contains metadata and the free list for this slab
 typedef struct slab {
     uint32 magic;               //KHEAP_MAGIC_SLAB for validation
     uint32 total_objs;          //total objects this slab can hold
+    uint32 pages;               //size of this slab
     struct slab_cache *cache;   //parent cache this slab belongs to
     struct slab *next;          //next slab in list (partial/full/empty)
     struct slab *prev;          //previous slab in list
@@ -31,17 +36,63 @@ typedef struct slab {
     uint32 free_objs;           //current number of free objects
 } slab_t;
 
+//magazine - a fixed-size stack of free objects cached in front of the slabs
+//each CPU keeps two per cache and trades whole magazines with the cache's
+//depot so the common alloc/free never takes a lock or walks a slab list
+#define KMAG_SIZE 30
+
+typedef struct kmag {
+    struct kmag *next;          //depot or free list link
+    uint32 rounds;              //number of objects currently held
+    void *objs[KMAG_SIZE];
+} kmag_t;
+
+//per-CPU state of a cache
+//loaded is the magazine we pop/push, previous absorbs alloc/free ping-pong
+//around a magazine boundary without touching the depot
+//only touched by the owning CPU with interrupts off so it needs no lock
+typedef struct kmag_cpu {
+    kmag_t *loaded;
+    kmag_t *previous;
+    uint64 allocs;
+    uint64 frees;
+} __attribute__((aligned(64))) kmag_cpu_t;
+
+#define KMEM_NAME_LEN 24
+
 //slab cache - manages slabs for a specific object size
-//each bucket size (16, 32, 64, ..., 2048) has one cache
+//each kmalloc bucket (16, 32, 48, ..., 4096) has one and typed caches for
+//kernel structures are created with kmem_cache_create()
 typedef struct slab_cache {
+    char name[KMEM_NAME_LEN];
     size obj_size;              //object size for this cache
+    size align;                 //object alignment within a slab
+    void (*ctor)(void *obj);    //run when an object leaves the slab layer
+    uint32 slab_pages;          //pages per slab (chosen to limit the unused tail)
     slab_t *partial_slabs;      //slabs with some objects allocated
     slab_t *full_slabs;         //slabs with all objects allocated
     slab_t *empty_slabs;        //slabs with no objects allocated
+    kmag_t *depot_full;         //full magazines waiting to be loaded by a CPU
+    uint32 depot_count;
+    uint32 slab_count;
+    spinlock_t lock;            //protects the slab lists, depot and slab_count
+    struct slab_cache *next;    //list of all caches
+    kmag_cpu_t cpu[MAX_CPUS];
 } slab_cache_t;
 
+typedef slab_cache_t kmem_cache_t;
+
+typedef struct kmem_cache_stats {
+    size obj_size;
+    uint64 allocs;              //lifetime allocations
+    uint64 frees;               //lifetime frees
+    uint64 active;              //objects currently handed out
+    uint32 slabs;               //slabs backing the cache
+    uint32 slab_pages;          //pages per slab
+    uint32 objs_per_slab;
+} kmem_cache_stats_t;
 
-//header for large allocations (> 2KB)
+//header for large allocations (> 4KB)
 //stored at the start of the allocated pages
 typedef struct {
     size pages;                 //number of pages (putting first to avoid padding)
@@ -57,6 +108,40 @@ void *kmalloc(size n);
 //allocate n bytes zero-initialized
 void *kzalloc(size n);
 
+//allocate whole zeroed pages with no header
+//the result is page aligned (2MB aligned and huge page backed from 2MB up)
+//so it can be mapped elsewhere page by page, free with kfree_pages()
+void *kzalloc_pages(size pages);
+void kfree_pages(void *p, size pages);
+
+//reserve heap address space with nothing mapped, the caller maps its own frames
+//kvfree unmaps the range and releases it but never frees the frames
+void *kvalloc(size pages);
+void kvfree(void *p, size pages);
+
+//create a cache of fixed size objects
+//align of 0 means KHEAP_MIN_ALIGN, ctor (may be NULL) runs when an object
+//is handed out fresh from a slab - objects cycled through the per-CPU
+//magazines keep their state so callers must free them in constructed form
+kmem_cache_t *kmem_cache_create(const char *name, size obj_size, size align, void (*ctor)(void *));
+
+//allocate an object from a cache (zeroed variant skips the constructor state)
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void *kmem_cache_zalloc(kmem_cache_t *cache);
+
+//return an object to its cache (kfree also works for cache objects)
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+//destroy a cache, every object must have been freed and nothing may use it
+//any more (each CPU is asked to hand back its magazines)
+void kmem_cache_destroy(kmem_cache_t *cache);
+
+//snapshot a cache's counters
+void kmem_cache_get_stats(kmem_cache_t *cache, kmem_cache_stats_t *stats);
+
+//print statistics for every cache to the console
+void kmem_cache_dump(void);
+
 //reallocate to new size
 void *krealloc(void *p, size n);
 
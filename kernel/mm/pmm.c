@@ -2,16 +2,344 @@
 #include <mm/mm.h>
 #include <boot/db.h>
 #include <drivers/serial.h>
+#include <arch/cpu.h>
+#include <lib/spinlock.h>
+#include <lib/string.h>
 
-static uint8 *bitmap = NULL;
-static size bitmap_size = 0; //in bytes
+//binary buddy allocator
+//free blocks of 2^order pages are kept on one list per order, the list node
+//lives in the first page of the free block itself (through the HHDM)
+//page_order[] holds the order of every free block head and PMM_PAGE_USED for
+//everything else so finding and merging a buddy is a single array lookup
+//free single pages parked in a per-CPU cache or the zero pool are tagged
+//PMM_PAGE_CACHED so freeing one again is caught like any other double free
+//
+//memory is split into zones by physical address, each with its own lists
+//the DMA32 boundary (4GiB) is aligned far beyond the largest block so buddies
+//never straddle two zones and merging needs no zone checks
+
+#define PMM_PAGE_USED 0xFF
+#define PMM_PAGE_CACHED 0xFE
+
+typedef struct pmm_block {
+    struct pmm_block *next;
+    struct pmm_block *prev;
+} pmm_block_t;
+
+static uint8 *page_order = NULL;
+static size page_order_size = 0; //in bytes (one per page)
 static uint64 max_pages = 0;
 
-#define BITMAP_SET(bit)   (bitmap[(bit) / 8] |= (1 << ((bit) % 8)))
-#define BITMAP_CLEAR(bit) (bitmap[(bit) / 8] &= ~(1 << ((bit) % 8)))
-#define BITMAP_TEST(bit)  (bitmap[(bit) / 8] & (1 << ((bit) % 8)))
+#define PMM_DMA32_LIMIT_PFN (0x100000000ULL / PAGE_SIZE)
+
+typedef struct pmm_zone {
+    const char *name;
+    pmm_block_t *free_lists[PMM_MAX_ORDER + 1];
+    uint64 free_pages;
+} pmm_zone_t;
+
+static pmm_zone_t zones[PMM_ZONE_COUNT] = {
+    [PMM_ZONE_DMA32]  = { .name = "dma32" },
+    [PMM_ZONE_NORMAL] = { .name = "normal" },
+};
+
+static uint64 free_pages = 0;
+static uint64 total_pages = 0;
+
+//contiguous pool carved out of DMA32 at boot and kept away from general
+//allocations so pmm_alloc_contig() keeps working once the buddy lists fragment
+//managed with a first-fit bitmap, one bit per page
+#define PMM_DMA_POOL_MIN_ORDER 8    //1MiB
+#define PMM_DMA_POOL_MAX_ORDER 12   //16MiB
+static uint64 dma_pool_start = 0;   //pfn
+static uint64 dma_pool_pages = 0;
+static uint64 dma_pool_free = 0;
+static uint8 dma_pool_map[((size)1 << PMM_DMA_POOL_MAX_ORDER) / 8];
+
+//protects the zones, the DMA pool and the counters above
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
+//per-CPU single page cache in front of the buddy lists
+//hot pages (recently freed so likely still in cache) go on the head and are
+//handed out first, cold pages are queued at the tail and drained first
+//only the owning CPU touches its cache (with interrupts off) so it needs no lock
+typedef struct pmm_pcp {
+    pmm_block_t *head;
+    pmm_block_t *tail;
+    uint32 count;
+} __attribute__((aligned(64))) pmm_pcp_t;
+
+static pmm_pcp_t pcp_caches[MAX_CPUS];
+static uint32 pcp_high = 0;     //drain back to the buddy lists above this
+static uint32 pcp_batch = 0;    //pages moved per refill/drain
+
+//pool of pages zeroed ahead of time by the idle thread so pmm_alloc_zeroed()
+//doesn't have to clear memory on the allocation path
+//pages are linked through their first word which is cleared again on the way out
+#define PMM_ZERO_POOL_TARGET 512
+static spinlock_t zero_lock = SPINLOCK_INIT;
+static pmm_block_t *zero_pool = NULL;
+static uint32 zero_count = 0;
+
+//ranges that must never be handed out (pfn start inclusive, end exclusive)
+#define PMM_MAX_RESERVED 8
+static struct { uint64 start, end; } reserved[PMM_MAX_RESERVED];
+static uint32 reserved_count = 0;
+
+static inline pmm_block_t *pfn_to_block(uint64 pfn) {
+    return (pmm_block_t *)P2V(pfn * PAGE_SIZE);
+}
+
+static inline uint64 block_to_pfn(pmm_block_t *block) {
+    return V2P(block) / PAGE_SIZE;
+}
+
+static inline pmm_zone_t *pfn_zone(uint64 pfn) {
+    return &zones[pfn < PMM_DMA32_LIMIT_PFN ? PMM_ZONE_DMA32 : PMM_ZONE_NORMAL];
+}
+
+static void list_push(uint32 order, uint64 pfn) {
+    pmm_block_t **head = &pfn_zone(pfn)->free_lists[order];
+    pmm_block_t *block = pfn_to_block(pfn);
+    block->prev = NULL;
+    block->next = *head;
+    if (*head) (*head)->prev = block;
+    *head = block;
+    page_order[pfn] = order;
+}
+
+static void list_remove(uint32 order, uint64 pfn) {
+    pmm_block_t **head = &pfn_zone(pfn)->free_lists[order];
+    pmm_block_t *block = pfn_to_block(pfn);
+    if (block->prev) block->prev->next = block->next;
+    else *head = block->next;
+    if (block->next) block->next->prev = block->prev;
+    page_order[pfn] = PMM_PAGE_USED;
+}
+
+//smallest order whose block holds the requested page count
+static uint32 order_for(size pages) {
+    uint32 order = 0;
+    while (((size)1 << order) < pages) order++;
+    return order;
+}
+
+//return a block to its free list merging with its buddy as far as possible
+static void free_block(uint64 pfn, uint32 order) {
+    pfn_zone(pfn)->free_pages += (uint64)1 << order;
+    while (order < PMM_MAX_ORDER) {
+        uint64 buddy = pfn ^ ((uint64)1 << order);
+        if (buddy >= max_pages || page_order[buddy] != order) break;
+        list_remove(order, buddy);
+        pfn &= ~((uint64)1 << order);
+        order++;
+    }
+    list_push(order, pfn);
+}
+
+//split a free block of order o down to the wanted order keeping the low half
+static uint64 take_block(uint64 pfn, uint32 o, uint32 order) {
+    list_remove(o, pfn);
+
+    //give the upper halves back until the block is the right size
+    while (o > order) {
+        o--;
+        list_push(o, pfn + ((uint64)1 << o));
+    }
+
+    pfn_zone(pfn)->free_pages -= (uint64)1 << order;
+    return pfn;
+}
+
+//take a block of exactly the given order from one zone
+static bool zone_alloc_block(pmm_zone_t *zone, uint32 order, uint64 *pfn_out) {
+    uint32 o = order;
+    while (o <= PMM_MAX_ORDER && !zone->free_lists[o]) o++;
+    if (o > PMM_MAX_ORDER) return false;
+
+    *pfn_out = take_block(block_to_pfn(zone->free_lists[o]), o, order);
+    return true;
+}
+
+//general allocations prefer the normal zone and only dip into DMA32 when it's empty
+static bool alloc_block(uint32 order, uint64 *pfn_out) {
+    if (zone_alloc_block(&zones[PMM_ZONE_NORMAL], order, pfn_out)) return true;
+    return zone_alloc_block(&zones[PMM_ZONE_DMA32], order, pfn_out);
+}
+
+//free blocks looked at per order when the limit cuts into a zone, this runs
+//with pmm_lock held and interrupts off so a long list is not walked to the end
+#define PMM_BELOW_SCAN_MAX 64
+
+//take a block of the given order from one zone that ends at or below max_pfn
+//blocks are naturally aligned so the result is aligned to its own size
+static bool zone_alloc_below(pmm_zone_t *zone, uint32 order, uint64 max_pfn, uint64 *pfn_out) {
+    //every block of a zone that ends under the limit fits so take a list head
+    uint64 zone_end = max_pages;
+    if (zone == &zones[PMM_ZONE_DMA32] && zone_end > PMM_DMA32_LIMIT_PFN) zone_end = PMM_DMA32_LIMIT_PFN;
+    if (max_pfn >= zone_end) return zone_alloc_block(zone, order, pfn_out);
+
+    for (uint32 o = order; o <= PMM_MAX_ORDER; o++) {
+        uint32 scanned = 0;
+        for (pmm_block_t *b = zone->free_lists[o]; b && scanned < PMM_BELOW_SCAN_MAX; b = b->next, scanned++) {
+            uint64 pfn = block_to_pfn(b);
+            if (pfn + ((uint64)1 << order) > max_pfn) continue;
+            *pfn_out = take_block(pfn, o, order);
+            return true;
+        }
+    }
+    return false;
+}
+
+//like alloc_block() but below max_pfn, DMA32 is only used when the limit
+//requires it or the normal zone has nothing suitable
+static bool alloc_block_below(uint32 order, uint64 max_pfn, uint64 *pfn_out) {
+    if (max_pfn > PMM_DMA32_LIMIT_PFN &&
+        zone_alloc_below(&zones[PMM_ZONE_NORMAL], order, max_pfn, pfn_out)) {
+        return true;
+    }
+    return zone_alloc_below(&zones[PMM_ZONE_DMA32], order, max_pfn, pfn_out);
+}
+
+//free an arbitrary page range by splitting it into naturally aligned blocks
+static void free_range(uint64 pfn, uint64 count) {
+    while (count > 0) {
+        uint32 order = 0;
+        while (order < PMM_MAX_ORDER &&
+               !(pfn & ((uint64)1 << order)) &&
+               ((uint64)2 << order) <= count) {
+            order++;
+        }
+        free_block(pfn, order);
+        pfn += (uint64)1 << order;
+        count -= (uint64)1 << order;
+    }
+}
+
+static void reserve_range(uint64 phys, uint64 length) {
+    if (length == 0) return;
+    uint64 start = phys / PAGE_SIZE;
+    uint64 end = (phys + length + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    //ranges that overlap or touch share an entry
+    for (uint32 i = 0; i < reserved_count; i++) {
+        if (start <= reserved[i].end && end >= reserved[i].start) {
+            if (start < reserved[i].start) reserved[i].start = start;
+            if (end > reserved[i].end) reserved[i].end = end;
+            return;
+        }
+    }
+
+    //dropping it would hand the range out as free RAM
+    if (reserved_count >= PMM_MAX_RESERVED) {
+        serial_write("[pmm] ERROR: too many reserved ranges, can't reserve ");
+        serial_write_hex(phys);
+        serial_write("\n");
+        for (;;) arch_halt();
+    }
+
+    reserved[reserved_count].start = start;
+    reserved[reserved_count].end = end;
+    reserved_count++;
+}
+
+static bool is_reserved(uint64 pfn) {
+    for (uint32 i = 0; i < reserved_count; i++) {
+        if (pfn >= reserved[i].start && pfn < reserved[i].end) return true;
+    }
+    return false;
+}
+
+//hand a usable memory map region to the buddy lists skipping reserved pages
+static void release_region(uint64 start_pfn, uint64 end_pfn) {
+    if (end_pfn > max_pages) end_pfn = max_pages;
+
+    uint64 run_start = start_pfn;
+    for (uint64 pfn = start_pfn; pfn < end_pfn; pfn++) {
+        if (is_reserved(pfn)) {
+            if (pfn > run_start) free_range(run_start, pfn - run_start);
+            run_start = pfn + 1;
+        }
+    }
+    if (end_pfn > run_start) free_range(run_start, end_pfn - run_start);
+}
+
+//size the per-CPU caches from the amount of memory we manage
+static void pcp_init(void) {
+    pcp_high = total_pages / 1024;
+    if (pcp_high < 32) pcp_high = 32;
+    if (pcp_high > 512) pcp_high = 512;
+    pcp_batch = pcp_high / 4;
+
+    for (uint32 i = 0; i < MAX_CPUS; i++) {
+        pcp_caches[i].head = NULL;
+        pcp_caches[i].tail = NULL;
+        pcp_caches[i].count = 0;
+    }
+}
+
+//reserve the contiguous DMA pool from whatever the memory map gave DMA32
+//sized at 1/64th of memory within [1MiB, 16MiB]
+static void dma_pool_init(void) {
+    uint64 usable = zones[PMM_ZONE_DMA32].free_pages + zones[PMM_ZONE_NORMAL].free_pages;
+    uint32 order = PMM_DMA_POOL_MIN_ORDER;
+    while (order < PMM_DMA_POOL_MAX_ORDER && ((uint64)2 << order) <= usable / 64) order++;
+
+    //settle for a smaller pool if DMA32 is short on large blocks
+    for (; order >= PMM_DMA_POOL_MIN_ORDER; order--) {
+        uint64 pfn;
+        if (alloc_block_below(order, PMM_DMA32_LIMIT_PFN, &pfn)) {
+            dma_pool_start = pfn;
+            dma_pool_pages = (uint64)1 << order;
+            dma_pool_free = dma_pool_pages;
+            memset(dma_pool_map, 0, sizeof(dma_pool_map));
+            return;
+        }
+    }
+    serial_write("[pmm] WARN: no room for a contiguous DMA pool\n");
+}
+
+static inline bool dma_pool_bit(uint64 i) {
+    return dma_pool_map[i / 8] & (1 << (i % 8));
+}
+
+static void dma_pool_set(uint64 first, uint64 count, bool used) {
+    for (uint64 i = first; i < first + count; i++) {
+        if (used) dma_pool_map[i / 8] |= (1 << (i % 8));
+        else dma_pool_map[i / 8] &= ~(1 << (i % 8));
+    }
+    if (used) dma_pool_free -= count;
+    else dma_pool_free += count;
+}
 
-static uint64 last_free_page = 0;
+//first fit search of the pool bitmap, caller holds pmm_lock
+static bool dma_pool_alloc(size pages, uint64 align_pages, uint64 max_pfn, uint64 *pfn_out) {
+    if (pages > dma_pool_free) return false;
+
+    uint64 i = 0;
+    while (i + pages <= dma_pool_pages) {
+        uint64 pfn = dma_pool_start + i;
+        if (pfn % align_pages) {
+            i += align_pages - (pfn % align_pages);
+            continue;
+        }
+        if (pfn + pages > max_pfn) return false;
+
+        uint64 run = 0;
+        while (run < pages && !dma_pool_bit(i + run)) run++;
+        if (run == pages) {
+            dma_pool_set(i, pages, true);
+            *pfn_out = pfn;
+            return true;
+        }
+        i += run + 1;
+    }
+    return false;
+}
+
+static inline bool in_dma_pool(uint64 pfn) {
+    return pfn >= dma_pool_start && pfn < dma_pool_start + dma_pool_pages;
+}
 
 void pmm_init(void) {
     struct db_tag_memory_map *mmap = db_get_memory_map();
@@ -45,24 +373,22 @@ void pmm_init(void) {
     }
 
     max_pages = max_addr / PAGE_SIZE;
-    bitmap_size = max_pages / 8;
-    if (max_pages % 8) bitmap_size++;
+    page_order_size = max_pages;
 
     serial_write("[pmm] max_addr: ");
     serial_write_hex(max_addr);
-    serial_write(", bitmap_size: ");
-    serial_write_hex(bitmap_size);
+    serial_write(", page_order size: ");
+    serial_write_hex(page_order_size);
     serial_write(" bytes\n");
 
-    //find a place for the bitmap (avoiding the first 1MB if possible)
+    //find a place for the page order array (avoiding the first 1MB if possible)
     bool found = false;
     for (uint32 i = 0; i < mmap->entry_count; i++) {
         struct db_mmap_entry *current = (struct db_mmap_entry *)(entries_ptr + i * mmap->entry_size);
-        if (current->type == DB_MEM_USABLE && current->length >= bitmap_size) {
-            //don't put bitmap at address 0 try to keep it above 1MB
+        if (current->type == DB_MEM_USABLE && current->length >= page_order_size) {
             if (current->base >= 0x100000) {
-                //use HHDM for bitmap address
-                bitmap = (uint8 *)P2V(current->base);
+                //use HHDM for the array address
+                page_order = (uint8 *)P2V(current->base);
                 found = true;
                 break;
             }
@@ -73,8 +399,8 @@ void pmm_init(void) {
     if (!found) {
         for (uint32 i = 0; i < mmap->entry_count; i++) {
             struct db_mmap_entry *current = (struct db_mmap_entry *)(entries_ptr + i * mmap->entry_size);
-            if (current->type == DB_MEM_USABLE && current->length >= bitmap_size && current->base > 0) {
-                bitmap = (uint8 *)P2V(current->base);
+            if (current->type == DB_MEM_USABLE && current->length >= page_order_size && current->base > 0) {
+                page_order = (uint8 *)P2V(current->base);
                 found = true;
                 break;
             }
@@ -82,155 +408,416 @@ void pmm_init(void) {
     }
 
     if (!found) {
-        serial_write("[pmm] ERROR: could not find safe location for bitmap\n");
+        serial_write("[pmm] ERROR: could not find safe location for page order array\n");
         return;
     }
 
-    //initially mark everything as reserved (1)
-    for (size i = 0; i < bitmap_size; i++) bitmap[i] = 0xFF;
-
-    //mark usable regions as free (0)
-    for (uint32 i = 0; i < mmap->entry_count; i++) {
-        struct db_mmap_entry *current = (struct db_mmap_entry *)(entries_ptr + i * mmap->entry_size);
-        if (current->type == DB_MEM_USABLE) {
-            uint64 start_page = current->base / PAGE_SIZE;
-            uint64 page_count = current->length / PAGE_SIZE;
-            for (uint64 j = 0; j < page_count; j++) {
-                if (start_page + j < max_pages) {
-                    BITMAP_CLEAR(start_page + j);
-                }
-            }
-        }
-    }
-    
-    //reserve the bitmap itself
-    uintptr bitmap_phys = V2P(bitmap);
-    uint64 bitmap_start_page = bitmap_phys / PAGE_SIZE;
-    uint64 bitmap_page_count = bitmap_size / PAGE_SIZE;
-    if (bitmap_size % PAGE_SIZE) bitmap_page_count++;
-    for (uint64 i = 0; i < bitmap_page_count; i++) {
-        BITMAP_SET(bitmap_start_page + i);
+    //initially every page is in use until a usable region releases it
+    for (size i = 0; i < page_order_size; i++) page_order[i] = PMM_PAGE_USED;
+    for (uint32 z = 0; z < PMM_ZONE_COUNT; z++) {
+        for (uint32 i = 0; i <= PMM_MAX_ORDER; i++) zones[z].free_lists[i] = NULL;
+        zones[z].free_pages = 0;
     }
 
+    //reserve page 0 and the page order array itself
+    reserve_range(0, PAGE_SIZE);
+    reserve_range(V2P(page_order), page_order_size);
+
     //reserve the kernel physical segments
     struct db_tag_kernel_phys *kphys = db_get_kernel_phys();
-    if (kphys) {
-        uint64 k_start = kphys->phys_base / PAGE_SIZE;
-        uint64 k_count = kphys->phys_length / PAGE_SIZE;
-        if (kphys->phys_length % PAGE_SIZE) k_count++;
-        for (uint64 i = 0; i < k_count; i++) {
-            if (k_start + i < max_pages) BITMAP_SET(k_start + i);
-        }
-    }
+    if (kphys) reserve_range(kphys->phys_base, kphys->phys_length);
 
     //reserve the boot info structure and all tags (the tags region)
     struct db_boot_info *info = db_get_boot_info();
-    if (info) {
-        uint64 info_start = (uintptr)V2P(info) / PAGE_SIZE;
-        uint64 info_count = info->total_size / PAGE_SIZE;
-        if (info->total_size % PAGE_SIZE) info_count++;
-        for (uint64 i = 0; i < info_count; i++) {
-            if (info_start + i < max_pages) BITMAP_SET(info_start + i);
-        }
-    }
-    
+    if (info) reserve_range(V2P(info), info->total_size);
+
     //reserve Initrd
     struct db_tag_initrd *initrd = db_get_initrd();
-    if (initrd) {
-        uint64 rd_start = initrd->start / PAGE_SIZE;
-        uint64 rd_count = initrd->length / PAGE_SIZE;
-        if (initrd->length % PAGE_SIZE) rd_count++;
-        for (uint64 i = 0; i < rd_count; i++) {
-            if (rd_start + i < max_pages) BITMAP_SET(rd_start + i);
+    if (initrd) reserve_range(initrd->start, initrd->length);
+
+    //release usable regions into the buddy lists
+    for (uint32 i = 0; i < mmap->entry_count; i++) {
+        struct db_mmap_entry *current = (struct db_mmap_entry *)(entries_ptr + i * mmap->entry_size);
+        if (current->type == DB_MEM_USABLE) {
+            uint64 start_pfn = (current->base + PAGE_SIZE - 1) / PAGE_SIZE;
+            uint64 end_pfn = (current->base + current->length) / PAGE_SIZE;
+            if (end_pfn > start_pfn) release_region(start_pfn, end_pfn);
         }
     }
 
-    //reserve page 0
-    BITMAP_SET(0);
+    dma_pool_init();
+
+    free_pages = zones[PMM_ZONE_DMA32].free_pages + zones[PMM_ZONE_NORMAL].free_pages;
+    total_pages = free_pages;
+    pcp_init();
 
-    serial_write("[pmm] initialized, bitmap @ ");
-    serial_write_hex((uintptr)bitmap);
+    serial_write("[pmm] initialized, page order array @ ");
+    serial_write_hex((uintptr)page_order);
+    serial_write(", free pages: ");
+    serial_write_hex(free_pages);
+    serial_write(", pcp high/batch: ");
+    serial_write_hex(pcp_high);
+    serial_write("/");
+    serial_write_hex(pcp_batch);
     serial_write("\n");
+
+    for (uint32 z = 0; z < PMM_ZONE_COUNT; z++) {
+        serial_write("[pmm] zone ");
+        serial_write(zones[z].name);
+        serial_write(": ");
+        serial_write_hex(zones[z].free_pages);
+        serial_write(" free pages\n");
+    }
+    serial_write("[pmm] dma pool @ ");
+    serial_write_hex(dma_pool_start * PAGE_SIZE);
+    serial_write(", pages: ");
+    serial_write_hex(dma_pool_pages);
+    serial_write("\n");
+}
+
+static void pcp_push_head(pmm_pcp_t *pcp, pmm_block_t *block) {
+    block->prev = NULL;
+    block->next = pcp->head;
+    if (pcp->head) pcp->head->prev = block;
+    else pcp->tail = block;
+    pcp->head = block;
+    pcp->count++;
+    page_order[block_to_pfn(block)] = PMM_PAGE_CACHED;
+}
+
+static void pcp_push_tail(pmm_pcp_t *pcp, pmm_block_t *block) {
+    block->next = NULL;
+    block->prev = pcp->tail;
+    if (pcp->tail) pcp->tail->next = block;
+    else pcp->head = block;
+    pcp->tail = block;
+    pcp->count++;
+    page_order[block_to_pfn(block)] = PMM_PAGE_CACHED;
+}
+
+static pmm_block_t *pcp_pop_head(pmm_pcp_t *pcp) {
+    pmm_block_t *block = pcp->head;
+    if (!block) return NULL;
+    pcp->head = block->next;
+    if (pcp->head) pcp->head->prev = NULL;
+    else pcp->tail = NULL;
+    pcp->count--;
+    page_order[block_to_pfn(block)] = PMM_PAGE_USED;
+    return block;
+}
+
+static pmm_block_t *pcp_pop_tail(pmm_pcp_t *pcp) {
+    pmm_block_t *block = pcp->tail;
+    if (!block) return NULL;
+    pcp->tail = block->prev;
+    if (pcp->tail) pcp->tail->next = NULL;
+    else pcp->head = NULL;
+    pcp->count--;
+    page_order[block_to_pfn(block)] = PMM_PAGE_USED;
+    return block;
+}
+
+//pull a batch of single pages from the buddy lists in one lock round trip
+static void pcp_refill(pmm_pcp_t *pcp) {
+    spinlock_acquire(&pmm_lock);
+    for (uint32 i = 0; i < pcp_batch; i++) {
+        uint64 pfn;
+        if (!alloc_block(0, &pfn)) break;
+        free_pages--;
+        pcp_push_tail(pcp, pfn_to_block(pfn));
+    }
+    spinlock_release(&pmm_lock);
+}
+
+//push the coldest batch of pages back to the buddy lists
+static void pcp_drain(pmm_pcp_t *pcp, uint32 count) {
+    spinlock_acquire(&pmm_lock);
+    for (uint32 i = 0; i < count; i++) {
+        pmm_block_t *block = pcp_pop_tail(pcp);
+        if (!block) break;
+        free_block(block_to_pfn(block), 0);
+        free_pages++;
+    }
+    spinlock_release(&pmm_lock);
+}
+
+static void *pcp_alloc(void) {
+    irq_state_t flags = arch_irq_save();
+    pmm_pcp_t *pcp = &pcp_caches[arch_cpu_id()];
+
+    if (!pcp->head) pcp_refill(pcp);
+    pmm_block_t *block = pcp_pop_head(pcp);
+
+    arch_irq_restore(flags);
+    return block ? (void *)(uintptr)(block_to_pfn(block) * PAGE_SIZE) : NULL;
+}
+
+static void pcp_free(uint64 pfn, bool cold) {
+    irq_state_t flags = arch_irq_save();
+    pmm_pcp_t *pcp = &pcp_caches[arch_cpu_id()];
+
+    if (cold) pcp_push_tail(pcp, pfn_to_block(pfn));
+    else pcp_push_head(pcp, pfn_to_block(pfn));
+
+    if (pcp->count > pcp_high) pcp_drain(pcp, pcp_batch);
+
+    arch_irq_restore(flags);
+}
+
+static void *zero_pool_pop(void) {
+    irq_state_t flags = spinlock_acquire_irqsave(&zero_lock);
+    pmm_block_t *block = zero_pool;
+    if (block) {
+        zero_pool = block->next;
+        zero_count--;
+        page_order[block_to_pfn(block)] = PMM_PAGE_USED;
+    }
+    spinlock_release_irqrestore(&zero_lock, flags);
+
+    if (!block) return NULL;
+    block->next = NULL;
+    return (void *)V2P(block);
+}
+
+//give every cached page on this CPU back to the buddy lists
+//used when an allocation fails so cached pages can't keep buddies from merging
+static void reclaim_caches(void) {
+    irq_state_t flags = arch_irq_save();
+
+    pmm_pcp_t *pcp = &pcp_caches[arch_cpu_id()];
+    pcp_drain(pcp, pcp->count);
+
+    spinlock_acquire(&zero_lock);
+    pmm_block_t *pool = zero_pool;
+    zero_pool = NULL;
+    zero_count = 0;
+    spinlock_release(&zero_lock);
+
+    spinlock_acquire(&pmm_lock);
+    while (pool) {
+        pmm_block_t *next = pool->next;
+        page_order[block_to_pfn(pool)] = PMM_PAGE_USED;
+        free_block(block_to_pfn(pool), 0);
+        free_pages++;
+        pool = next;
+    }
+    spinlock_release(&pmm_lock);
+
+    arch_irq_restore(flags);
+}
+
+static bool buddy_alloc(size pages, uint64 *pfn_out) {
+    uint32 order = order_for(pages);
+    if (order > PMM_MAX_ORDER) return false;
+
+    irq_state_t flags = spinlock_acquire_irqsave(&pmm_lock);
+
+    uint64 pfn;
+    if (!alloc_block(order, &pfn)) {
+        spinlock_release_irqrestore(&pmm_lock, flags);
+        return false;
+    }
+
+    //give back the tail of the block that the caller didn't ask for
+    uint64 block_pages = (uint64)1 << order;
+    if (block_pages > pages) free_range(pfn + pages, block_pages - pages);
+
+    free_pages -= pages;
+    spinlock_release_irqrestore(&pmm_lock, flags);
+    *pfn_out = pfn;
+    return true;
 }
 
 void *pmm_alloc(size pages) {
     if (pages == 0) return NULL;
 
-    uint64 consecutive = 0;
-    uint64 start_bit = 0;
+    if (pages == 1 && pcp_high) {
+        void *page = pcp_alloc();
+        //a pre-zeroed page is still a page
+        if (!page) page = zero_pool_pop();
+        return page;
+    }
 
-    //word skipping optimization
-    uword *bitmap_words = (uword *)bitmap;
-    uint64 max_words = max_pages / ARCH_BITS;
+    uint64 pfn;
+    if (!buddy_alloc(pages, &pfn)) {
+        reclaim_caches();
+        if (!buddy_alloc(pages, &pfn)) return NULL;
+    }
+    return (void *)(uintptr)(pfn * PAGE_SIZE);
+}
 
-    for (uint64 i = last_free_page; i < max_pages; i++) {
-        //if we are at the start of a word and need more than current bit try skipping
-        if ((i % ARCH_BITS == 0) && (consecutive == 0)) {
-            while (i / ARCH_BITS < max_words && bitmap_words[i / ARCH_BITS] == (uword)-1) {
-                i += ARCH_BITS;
-            }
-            if (i >= max_pages) break;
-        }
+void *pmm_alloc_zeroed(size pages) {
+    if (pages == 1) {
+        void *page = zero_pool_pop();
+        if (page) return page;
+    }
 
-        if (!BITMAP_TEST(i)) {
-            if (consecutive == 0) start_bit = i;
-            consecutive++;
-            if (consecutive == pages) {
-                for (uint64 j = 0; j < pages; j++) {
-                    BITMAP_SET(start_bit + j);
-                }
-                last_free_page = start_bit + pages;
-                return (void *)(uintptr)(start_bit * PAGE_SIZE);
-            }
-        } else {
-            consecutive = 0;
-        }
+    void *phys = pmm_alloc(pages);
+    if (phys) memset(P2V(phys), 0, pages * PAGE_SIZE);
+    return phys;
+}
+
+size pmm_zero_pool_refill(size max) {
+    size added = 0;
+
+    while (added < max) {
+        if (__atomic_load_n(&zero_count, __ATOMIC_RELAXED) >= PMM_ZERO_POOL_TARGET) break;
+
+        void *phys = pmm_alloc(1);
+        if (!phys) break;
+
+        //clear outside any lock, only the list push is serialised
+        pmm_block_t *block = (pmm_block_t *)P2V(phys);
+        memset(block, 0, PAGE_SIZE);
+
+        irq_state_t flags = spinlock_acquire_irqsave(&zero_lock);
+        block->next = zero_pool;
+        zero_pool = block;
+        zero_count++;
+        page_order[block_to_pfn(block)] = PMM_PAGE_CACHED;
+        spinlock_release_irqrestore(&zero_lock, flags);
+
+        added++;
     }
 
-    //if we reached the end try searching from the beginning once
-    if (last_free_page > 0) {
-        uint64 search_limit = last_free_page;
-        last_free_page = 0;
-        consecutive = 0;
-        for (uint64 i = 0; i < search_limit; i++) {
-            if ((i % ARCH_BITS == 0) && (consecutive == 0)) {
-                while (i / ARCH_BITS < max_words && i + ARCH_BITS <= search_limit && bitmap_words[i / ARCH_BITS] == (uword)-1) {
-                    i += ARCH_BITS;
-                }
-                if (i >= search_limit) break;
-            }
+    return added;
+}
 
-            if (!BITMAP_TEST(i)) {
-                if (consecutive == 0) start_bit = i;
-                consecutive++;
-                if (consecutive == pages) {
-                    for (uint64 j = 0; j < pages; j++) {
-                        BITMAP_SET(start_bit + j);
-                    }
-                    last_free_page = start_bit + pages;
-                    return (void *)(uintptr)(start_bit * PAGE_SIZE);
-                }
-            } else {
-                consecutive = 0;
-            }
+static bool check_free(void *ptr, size pages) {
+    uint64 start_pfn = (uintptr)ptr / PAGE_SIZE;
+
+    if (start_pfn + pages > max_pages) {
+        serial_write("[pmm] WARN: free of out-of-range pages at ");
+        serial_write_hex((uintptr)ptr);
+        serial_write("\n");
+        return false;
+    }
+
+    //a free block head or a page sitting in a per-CPU cache or the zero pool
+    for (size i = 0; i < pages; i++) {
+        if (page_order[start_pfn + i] != PMM_PAGE_USED) {
+            serial_write("[pmm] WARN: double free at ");
+            serial_write_hex((start_pfn + i) * PAGE_SIZE);
+            serial_write("\n");
+            return false;
         }
     }
 
-    return NULL;
+    return true;
+}
+
+static void dma_pool_release(uint64 pfn, size pages) {
+    uint64 first = pfn - dma_pool_start;
+    irq_state_t flags = spinlock_acquire_irqsave(&pmm_lock);
+
+    //every page has to be in use, a partly free range is a double free and
+    //clearing it would count its free pages twice
+    bool bad = first + pages > dma_pool_pages;
+    for (uint64 i = 0; !bad && i < pages; i++) {
+        if (!dma_pool_bit(first + i)) bad = true;
+    }
+
+    if (bad) {
+        spinlock_release_irqrestore(&pmm_lock, flags);
+        serial_write("[pmm] WARN: bad free in dma pool at ");
+        serial_write_hex(pfn * PAGE_SIZE);
+        serial_write("\n");
+        return;
+    }
+
+    dma_pool_set(first, pages, false);
+    spinlock_release_irqrestore(&pmm_lock, flags);
 }
 
 void pmm_free(void *ptr, size pages) {
-    if (!ptr) return;
-    uintptr addr = (uintptr)ptr;
-    uint64 start_bit = addr / PAGE_SIZE;
+    if (!ptr || pages == 0) return;
 
-    for (uint64 i = 0; i < pages; i++) {
-        if (start_bit + i < max_pages) {
-            BITMAP_CLEAR(start_bit + i);
-        }
+    uint64 start_pfn = (uintptr)ptr / PAGE_SIZE;
+    if (in_dma_pool(start_pfn)) {
+        dma_pool_release(start_pfn, pages);
+        return;
     }
 
-    if (start_bit < last_free_page) {
-        last_free_page = start_bit;
+    if (!check_free(ptr, pages)) return;
+    if (pages == 1 && pcp_high) {
+        pcp_free(start_pfn, false);
+        return;
     }
-}
\ No newline at end of file
+
+    irq_state_t flags = spinlock_acquire_irqsave(&pmm_lock);
+    free_range(start_pfn, pages);
+    free_pages += pages;
+    spinlock_release_irqrestore(&pmm_lock, flags);
+}
+
+void pmm_free_cold(void *ptr) {
+    if (!ptr || !check_free(ptr, 1)) return;
+    if (!pcp_high) {
+        pmm_free(ptr, 1);
+        return;
+    }
+    pcp_free((uintptr)ptr / PAGE_SIZE, true);
+}
+
+//buddy blocks are naturally aligned so an order 9 block is a 2MB frame
+void *pmm_alloc_huge(void) {
+    return pmm_alloc(PMM_HUGE_PAGES);
+}
+
+void *pmm_alloc_contig(size pages, size align, uint64 max_phys) {
+    if (pages == 0) return NULL;
+    if (align < PAGE_SIZE) align = PAGE_SIZE;
+    if (align & (align - 1)) return NULL;
+
+    uint64 align_pages = align / PAGE_SIZE;
+    uint64 max_pfn = max_phys ? max_phys / PAGE_SIZE : max_pages;
+
+    //the buddy block must cover both the size and the alignment
+    uint32 order = order_for(pages);
+    uint32 align_order = order_for(align_pages);
+    if (align_order > order) order = align_order;
+    if (order > PMM_MAX_ORDER) return NULL;
+
+    uint64 pfn;
+    irq_state_t flags = spinlock_acquire_irqsave(&pmm_lock);
+
+    //the reserved pool sits below 4GiB, so a request that can live above
+    //that tries the normal zone before eating into it
+    bool high = max_pfn > PMM_DMA32_LIMIT_PFN;
+    bool ok = high && zone_alloc_below(&zones[PMM_ZONE_NORMAL], order, max_pfn, &pfn);
+    if (!ok && dma_pool_alloc(pages, align_pages, max_pfn, &pfn)) {
+        spinlock_release_irqrestore(&pmm_lock, flags);
+        return (void *)(uintptr)(pfn * PAGE_SIZE);
+    }
+
+    if (!ok) ok = zone_alloc_below(&zones[PMM_ZONE_DMA32], order, max_pfn, &pfn);
+    spinlock_release_irqrestore(&pmm_lock, flags);
+
+    if (!ok) {
+        reclaim_caches();
+        flags = spinlock_acquire_irqsave(&pmm_lock);
+        ok = alloc_block_below(order, max_pfn, &pfn);
+        spinlock_release_irqrestore(&pmm_lock, flags);
+        if (!ok) return NULL;
+    }
+
+    //trim the block down to what was asked for
+    flags = spinlock_acquire_irqsave(&pmm_lock);
+    uint64 block_pages = (uint64)1 << order;
+    if (block_pages > pages) free_range(pfn + pages, block_pages - pages);
+    free_pages -= pages;
+    spinlock_release_irqrestore(&pmm_lock, flags);
+
+    return (void *)(uintptr)(pfn * PAGE_SIZE);
+}
+
+size pmm_get_free_pages(void) {
+    //pages parked in the per-CPU caches and the zero pool are free too
+    size count = free_pages + zero_count;
+    for (uint32 i = 0; i < MAX_CPUS; i++) count += pcp_caches[i].count;
+    return count;
+}
+
+size pmm_get_total_pages(void) {
+    return total_pages;
+}
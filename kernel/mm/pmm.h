@@ -5,9 +5,49 @@
 
 #define PAGE_SIZE 4096
 
+//pages in one 2MB huge frame
+#define PMM_HUGE_ORDER 9
+#define PMM_HUGE_PAGES (1 << PMM_HUGE_ORDER)
+
+//largest buddy block is 2^PMM_MAX_ORDER pages (1GiB)
+#define PMM_MAX_ORDER 18
+
+//physical memory zones (DMA32 is everything below 4GiB)
+#define PMM_ZONE_DMA32  0
+#define PMM_ZONE_NORMAL 1
+#define PMM_ZONE_COUNT  2
+
 void pmm_init(void);
 
+//single-page requests are served from a per-CPU hot/cold cache
 void *pmm_alloc(size pages);
 void pmm_free(void *ptr, size pages);
 
-#endif
\ No newline at end of file
+//free a single page that is not expected to be touched again soon
+//(queued at the cold end of the per-CPU cache so it is drained first)
+void pmm_free_cold(void *ptr);
+
+//allocate pages that are guaranteed to be zero filled
+//single pages come straight from the pre-zeroed pool when it has any
+void *pmm_alloc_zeroed(size pages);
+
+//top up the pre-zeroed pool by at most max pages, returns how many were added
+//meant to be called from the idle loop in small batches
+size pmm_zero_pool_refill(size max);
+
+//allocate one 2MB aligned frame of PMM_HUGE_PAGES pages for a huge mapping
+//free with pmm_free(ptr, PMM_HUGE_PAGES)
+void *pmm_alloc_huge(void);
+
+//allocate physically contiguous pages for device DMA
+//align is in bytes (power of two, at least PAGE_SIZE), the whole range ends at or
+//below max_phys (0 for no limit), memory above 4GiB is used first when the limit
+//allows, then a boot-time reserved pool and the rest of DMA32
+//free with pmm_free()
+void *pmm_alloc_contig(size pages, size align, uint64 max_phys);
+
+//page counters (for diagnostics and cache sizing)
+size pmm_get_free_pages(void);
+size pmm_get_total_pages(void);
+
+#endif
@@ -1,6 +1,8 @@
 #include <mm/vmm.h>
 #include <mm/pmm.h>
+#include <mm/vmo.h>
 #include <arch/mmu.h>
+#include <proc/process.h>
 #include <lib/io.h>
 
 void vmm_map(pagemap_t *map, uintptr virt, uintptr phys, size pages, uint64 flags) {
@@ -15,6 +17,26 @@ void vmm_kernel_map(uintptr virt, uintptr phys, size pages, uint64 flags) {
     vmm_map(mmu_get_kernel_pagemap(), virt, phys, pages, flags);
 }
 
+int vmm_page_fault(uintptr addr, uint32 reason) {
+    //missing pages are demand filled and writes to shared copy-on-write
+    //pages copied, any other protection fault is a real error
+    if ((reason & VMM_FAULT_PRESENT) && !(reason & VMM_FAULT_WRITE)) return -1;
+
+    process_t *proc;
+    if (addr >= KHEAP_VIRT_START && addr < KHEAP_VIRT_END) {
+        //kernel mappings of VMOs are tracked by the kernel process
+        if (reason & VMM_FAULT_USER) return -1;
+        proc = process_get_kernel();
+    } else if (addr >= USER_SPACE_START && addr < USER_SPACE_END) {
+        proc = process_current();
+        if (!proc || !proc->pagemap) return -1;
+    } else {
+        return -1;
+    }
+
+    return vmo_fault(proc, addr, (reason & VMM_FAULT_WRITE) != 0);
+}
+
 void vmm_init(void) {
     pagemap_t *kernel_map = mmu_get_kernel_pagemap();
     printf("[vmm] initializing kernel address space (PML4: 0x%X)\n", kernel_map->top_level);
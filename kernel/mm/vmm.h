@@ -13,4 +13,14 @@ void vmm_unmap(pagemap_t *map, uintptr virt, size pages);
 //kernel-specific mappings
 void vmm_kernel_map(uintptr virt, uintptr phys, size pages, uint64 flags);
 
+//page fault reasons (decoded from the architecture's error code)
+#define VMM_FAULT_PRESENT   (1 << 0)    //page was mapped, protection violation
+#define VMM_FAULT_WRITE     (1 << 1)
+#define VMM_FAULT_USER      (1 << 2)    //raised by user mode
+#define VMM_FAULT_EXEC      (1 << 3)
+
+//try to resolve a page fault by demand paging
+//returns 0 if the page is now mapped and the access can be retried
+int vmm_page_fault(uintptr addr, uint32 reason);
+
 #endif
@@ -4,40 +4,244 @@
 #include <mm/mm.h>
 #include <arch/mmu.h>
 #include <proc/process.h>
+#include <proc/sched.h>
 #include <lib/string.h>
 #include <lib/io.h>
 
+//find the leaf slot for page index idx, creating missing nodes if create is set
+//caller holds vmo->lock, NULL if the path doesn't exist (or out of memory)
+static uintptr *vmo_slot(vmo_t *vmo, size idx, bool create) {
+    uintptr *link = &vmo->radix_root;
+
+    for (int32 level = vmo->radix_levels - 1; level >= 0; level--) {
+        if (!*link) {
+            if (!create) return NULL;
+            *link = (uintptr)pmm_alloc_zeroed(1);
+            if (!*link) return NULL;
+        }
+        uintptr *node = (uintptr *)P2V(*link);
+        link = &node[(idx >> (level * VMO_RADIX_SHIFT)) & (VMO_RADIX_SLOTS - 1)];
+    }
+    return link;
+}
+
+//page a COW child sees through its ancestors for its own page index idx
+//nothing is inherited at or past a VMO's inherit_limit (it was shrunk below
+//that so what the parent has there was cut off)
+//ancestors of a clone are hidden VMOs whose pages never change, so a page found
+//stays valid after the ancestor's lock is dropped, caller holds vmo->lock
+//(locks are only ever nested from child to parent)
+static uintptr vmo_inherited(vmo_t *vmo, size idx) {
+    while (vmo->parent && idx < vmo->inherit_limit) {
+        idx += vmo->parent_offset / PAGE_SIZE;
+        vmo = vmo->parent;
+        if (idx >= vmo->page_count) return 0;
+
+        spinlock_acquire(&vmo->lock);
+        uintptr *slot = vmo_slot(vmo, idx, false);
+        uintptr phys = slot ? *slot : 0;
+        spinlock_release(&vmo->lock);
+        if (phys) return phys;
+    }
+    return 0;
+}
+
+//physical page the VMO owns at page index idx
+//with commit set a missing page is allocated, as a private copy of the
+//inherited page for a clone or zeroed otherwise
+//caller holds vmo->lock, returns 0 for an uncommitted page (or out of memory)
+static uintptr vmo_page(vmo_t *vmo, size idx, bool commit) {
+    uintptr *slot = vmo_slot(vmo, idx, commit);
+    if (!slot) return 0;
+    if (*slot || !commit) return *slot;
+
+    uintptr src = vmo_inherited(vmo, idx);
+    uintptr phys = (uintptr)(src ? pmm_alloc(1) : pmm_alloc_zeroed(1));
+    if (!phys) return 0;
+    if (src) memcpy(P2V(phys), P2V(src), PAGE_SIZE);
+
+    *slot = phys;
+    vmo->committed += PAGE_SIZE;
+    return phys;
+}
+
+//a radix leaf covers VMO_RADIX_SLOTS pages, exactly one 2MB frame
+#define VMO_HUGE_SIZE ((size)PMM_HUGE_PAGES * PAGE_SIZE)
+
+//back the whole leaf around idx with one zeroed 2MB frame so mappings of it
+//can use a huge page, only for a VMO with nothing to inherit whose leaf lies
+//entirely inside it and is still empty, anything else (or no free 2MB frame)
+//is committed page by page
+//the frame is cleared with vmo->lock dropped so callers re-check what they
+//read before, returns the flags to release the lock with
+static irq_state_t vmo_commit_huge(vmo_t *vmo, size idx, irq_state_t flags) {
+    size first = idx & ~(size)(VMO_RADIX_SLOTS - 1);
+    if (vmo->parent || first + VMO_RADIX_SLOTS > vmo->page_count) return flags;
+    
+    uintptr *leaf = vmo_slot(vmo, first, false);
+    for (size i = 0; leaf && i < VMO_RADIX_SLOTS; i++) {
+        if (leaf[i]) return flags;
+    }
+    
+    spinlock_release_irqrestore(&vmo->lock, flags);
+    void *frame = pmm_alloc_huge();
+    if (frame) memset(P2V(frame), 0, VMO_HUGE_SIZE);
+    flags = spinlock_acquire_irqsave(&vmo->lock);
+    if (!frame) return flags;
+    
+    //the leaf may have been filled (or the VMO shrunk or cloned) meanwhile
+    leaf = NULL;
+    if (!vmo->parent && first + VMO_RADIX_SLOTS <= vmo->page_count) leaf = vmo_slot(vmo, first, true);
+    for (size i = 0; leaf && i < VMO_RADIX_SLOTS; i++) {
+        if (leaf[i]) leaf = NULL;
+    }
+    if (!leaf) {
+        pmm_free(frame, PMM_HUGE_PAGES);
+        return flags;
+    }
+    
+    //slots stay per page so decommit and COW still work a page at a time
+    for (size i = 0; i < VMO_RADIX_SLOTS; i++) leaf[i] = (uintptr)frame + i * PAGE_SIZE;
+    vmo->committed += VMO_HUGE_SIZE;
+    return flags;
+}
+
+//2MB frame behind the leaf starting at page index first, 0 unless the VMO owns
+//every page of it in one aligned contiguous run, caller holds vmo->lock
+static uintptr vmo_huge_frame(vmo_t *vmo, size first) {
+    uintptr *leaf = vmo_slot(vmo, first, false);
+    if (!leaf || !leaf[0] || (leaf[0] & (VMO_HUGE_SIZE - 1))) return 0;
+    for (size i = 1; i < VMO_RADIX_SLOTS; i++) {
+        if (leaf[i] != leaf[0] + i * PAGE_SIZE) return 0;
+    }
+    return leaf[0];
+}
+
+//page visible at idx, owned or inherited (0 reads as zeros)
+static inline uintptr vmo_lookup(vmo_t *vmo, size idx) {
+    uintptr phys = vmo_page(vmo, idx, false);
+    return phys ? phys : vmo_inherited(vmo, idx);
+}
+
+//free a subtree, level 0 nodes hold the data pages
+static void vmo_free_tree(uintptr node_phys, uint32 level) {
+    uintptr *node = (uintptr *)P2V(node_phys);
+    for (size i = 0; i < VMO_RADIX_SLOTS; i++) {
+        if (!node[i]) continue;
+        if (level) vmo_free_tree(node[i], level - 1);
+        else pmm_free((void *)node[i], 1);
+    }
+    pmm_free((void *)node_phys, 1);
+}
+
+static inline pagemap_t *vmo_pagemap(process_t *proc) {
+    return proc->pagemap ? proc->pagemap : mmu_get_kernel_pagemap();
+}
+
+//whether a mapping record for vaddr in map still exists, caller holds vmo->lock
+static bool vmo_mapping_live(vmo_t *vmo, pagemap_t *map, uintptr vaddr) {
+    for (vmo_mapping_t *m = vmo->mappings; m; m = m->next) {
+        if (m->pagemap == map && m->vaddr == vaddr) return true;
+    }
+    return false;
+}
+
+//pages are never freed while an unlocked copy is in flight (vmo->pins), so
+//callers about to free some wait here first, dropping vmo->lock meanwhile
+static irq_state_t vmo_wait_unpinned(vmo_t *vmo, irq_state_t flags) {
+    while (vmo->pins) {
+        spinlock_release_irqrestore(&vmo->lock, flags);
+        sched_yield();
+        flags = spinlock_acquire_irqsave(&vmo->lock);
+    }
+    return flags;
+}
+
 //VMO object ops
+//data is copied page by page through the HHDM, reads of uncommitted pages
+//return zeros without committing them
+//the lock is only held to find (or commit) a page and pin it, the copy itself
+//runs unlocked and preemptible so a large transfer doesn't stall the CPU
 static ssize vmo_obj_read(object_t *obj, void *buf, size len, size offset) {
     vmo_t *vmo = (vmo_t *)obj;
-    if (!vmo || !vmo->pages) return -1;
+    if (!vmo) return -1;
     
-    if (offset >= vmo->size) return 0;
-    if (offset + len > vmo->size) len = vmo->size - offset;
+    irq_state_t flags = spinlock_acquire_irqsave(&vmo->lock);
+    if (offset >= vmo->size) len = 0;
+    else if (len > vmo->size - offset) len = vmo->size - offset;
     
-    memcpy(buf, (char *)vmo->pages + offset, len);
-    return len;
+    size done = 0;
+    while (done < len) {
+        size pos = offset + done;
+        size chunk = PAGE_SIZE - (pos % PAGE_SIZE);
+        if (chunk > len - done) chunk = len - done;
+        if (pos / PAGE_SIZE >= vmo->page_count) break;  //shrunk meanwhile
+
+        uintptr phys = vmo_lookup(vmo, pos / PAGE_SIZE);
+        vmo->pins++;
+        spinlock_release_irqrestore(&vmo->lock, flags);
+        
+        if (phys) memcpy((char *)buf + done, (char *)P2V(phys) + pos % PAGE_SIZE, chunk);
+        else memset((char *)buf + done, 0, chunk);
+        
+        flags = spinlock_acquire_irqsave(&vmo->lock);
+        vmo->pins--;
+        done += chunk;
+    }
+    spinlock_release_irqrestore(&vmo->lock, flags);
+    return done;
 }
 
 static ssize vmo_obj_write(object_t *obj, const void *buf, size len, size offset) {
     vmo_t *vmo = (vmo_t *)obj;
-    if (!vmo || !vmo->pages) return -1;
+    if (!vmo) return -1;
     
-    if (offset >= vmo->size) return 0;
-    if (offset + len > vmo->size) len = vmo->size - offset;
+    irq_state_t flags = spinlock_acquire_irqsave(&vmo->lock);
+    if (offset >= vmo->size) len = 0;
+    else if (len > vmo->size - offset) len = vmo->size - offset;
     
-    memcpy((char *)vmo->pages + offset, buf, len);
-    return len;
+    size done = 0;
+    while (done < len) {
+        size pos = offset + done;
+        size chunk = PAGE_SIZE - (pos % PAGE_SIZE);
+        if (chunk > len - done) chunk = len - done;
+        if (pos / PAGE_SIZE >= vmo->page_count) break;  //shrunk meanwhile
+
+        flags = vmo_commit_huge(vmo, pos / PAGE_SIZE, flags);
+        if (pos / PAGE_SIZE >= vmo->page_count) break;  //shrunk meanwhile
+        uintptr phys = vmo_page(vmo, pos / PAGE_SIZE, true);
+        if (!phys) break;
+        vmo->pins++;
+        spinlock_release_irqrestore(&vmo->lock, flags);
+        
+        memcpy((char *)P2V(phys) + pos % PAGE_SIZE, (const char *)buf + done, chunk);
+        
+        flags = spinlock_acquire_irqsave(&vmo->lock);
+        vmo->pins--;
+        done += chunk;
+    }
+    spinlock_release_irqrestore(&vmo->lock, flags);
+
+    if (done == 0 && len) return -1;  //out of memory
+    return done;
 }
 
 static int vmo_obj_close(object_t *obj) {
     vmo_t *vmo = (vmo_t *)obj;
     if (!vmo) return -1;
     
-    //free the backing memory
-    if (vmo->pages) {
-        kfree(vmo->pages);
-        vmo->pages = NULL;
+    //every mapping holds a reference so there are none left by now
+    //free whatever got committed
+    if (vmo->radix_root) {
+        vmo_free_tree(vmo->radix_root, vmo->radix_levels - 1);
+        vmo->radix_root = 0;
+        vmo->committed = 0;
+    }
+    
+    //a clone keeps its parent alive
+    if (vmo->parent) {
+        object_deref(&vmo->parent->obj);
+        vmo->parent = NULL;
     }
     
     return 0;
@@ -51,19 +255,20 @@ static object_ops_t vmo_ops = {
     .lookup = NULL
 };
 
-int32 vmo_create(process_t *proc, size size, uint32 flags, handle_rights_t rights) {
-    if (!proc || size == 0) return -1;
-    
+//allocate and initialize a VMO with one reference and no pages
+static vmo_t *vmo_alloc(size size, uint32 flags) {
     //allocate VMO structure
     vmo_t *vmo = kzalloc(sizeof(vmo_t));
-    if (!vmo) return -1;
+    if (!vmo) return NULL;
     
-    //allocate backing memory (for now fully committed)
-    vmo->pages = kzalloc(size);
-    if (!vmo->pages) {
-        kfree(vmo);
-        return -1;
+    //nothing is allocated up front, tree nodes and pages appear on first touch
+    vmo->page_count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    vmo->radix_levels = 1;
+    while (vmo->radix_levels * VMO_RADIX_SHIFT < 64 &&
+           (vmo->page_count - 1) >> (vmo->radix_levels * VMO_RADIX_SHIFT)) {
+        vmo->radix_levels++;
     }
+    spinlock_init(&vmo->lock);
     
     //initialize embedded object
     vmo->obj.type = OBJECT_VMO;
@@ -72,13 +277,21 @@ int32 vmo_create(process_t *proc, size size, uint32 flags, handle_rights_t right
     vmo->obj.data = vmo;
     
     vmo->size = size;
-    vmo->committed = size;
+    vmo->committed = 0;
     vmo->flags = flags;
+    vmo->inherit_limit = vmo->page_count;
+    return vmo;
+}
+
+int32 vmo_create(process_t *proc, size size, uint32 flags, handle_rights_t rights) {
+    if (!proc || size == 0) return -1;
+    
+    vmo_t *vmo = vmo_alloc(size, flags);
+    if (!vmo) return -1;
     
     //grant handle to process
     int32 h = process_grant_handle(proc, &vmo->obj, rights);
     if (h < 0) {
-        kfree(vmo->pages);
         kfree(vmo);
         return -1;
     }
@@ -86,109 +299,487 @@ int32 vmo_create(process_t *proc, size size, uint32 flags, handle_rights_t right
     return h;
 }
 
-vmo_t *vmo_get(process_t *proc, int32 handle) {
-    if (!proc) return NULL;
+int32 vmo_create_child(process_t *proc, int32 handle, uint32 options,
+                       size offset, size size, handle_rights_t rights) {
+    if (!proc || size == 0 || (offset & (PAGE_SIZE - 1))) return -1;
+    if (!(options & VMO_CHILD_COW)) return -1;  //only copy-on-write clones exist
     
-    object_t *obj = process_get_handle(proc, handle);
-    if (!obj || obj->type != OBJECT_VMO) return NULL;
+    handle_rights_t have;
+    vmo_t *vmo = vmo_get(proc, handle, &have);
+    if (!vmo) return -1;
+    if (!rights_has(have, HANDLE_RIGHT_READ)) {
+        object_deref(&vmo->obj);
+        return -2;  //no read permission
+    }
     
-    return (vmo_t *)obj;
+    vmo_t *child = vmo_alloc(size, VMO_FLAG_NONE);
+    if (!child) {
+        object_deref(&vmo->obj);
+        return -1;
+    }
+    vmo_t *hidden = NULL;
+    if (vmo->radix_root) {
+        hidden = vmo_alloc(vmo->size, VMO_FLAG_NONE);
+        if (!hidden) {
+            kfree(child);
+            object_deref(&vmo->obj);
+            return -1;
+        }
+    }
+    
+    irq_state_t flags = spinlock_acquire_irqsave(&vmo->lock);
+    flags = vmo_wait_unpinned(vmo, flags);  //no writes may land in the snapshot
+    if (hidden && vmo->radix_root) {
+        //the pages written so far move to a hidden VMO that both the original
+        //and the clone inherit from, so each sees the snapshot and copies a
+        //page when it first writes to it
+        //sized here as the VMO may have grown since hidden was allocated
+        hidden->radix_root = vmo->radix_root;
+        hidden->radix_levels = vmo->radix_levels;
+        hidden->page_count = vmo->page_count;
+        hidden->size = vmo->size;
+        hidden->committed = vmo->committed;
+        hidden->parent = vmo->parent;
+        hidden->parent_offset = vmo->parent_offset;
+        hidden->inherit_limit = vmo->inherit_limit;
+        
+        vmo->radix_root = 0;
+        vmo->committed = 0;
+        vmo->parent = hidden;   //takes the initial reference
+        vmo->parent_offset = 0;
+        vmo->inherit_limit = vmo->page_count;
+        
+        //existing mappings may be writable, drop them and let faults map
+        //the now shared pages read-only
+        for (vmo_mapping_t *m = vmo->mappings; m; m = m->next) {
+            mmu_unmap_range(m->pagemap, m->vaddr, m->len / PAGE_SIZE);
+        }
+        hidden = NULL;
+    }
+    
+    //the clone inherits from whatever the original inherits from, and no
+    //further than the original does
+    if (vmo->parent) {
+        child->parent = vmo->parent;
+        child->parent_offset = vmo->parent_offset + offset;
+        uint64 skip = offset / PAGE_SIZE;
+        uint64 limit = vmo->inherit_limit > skip ? vmo->inherit_limit - skip : 0;
+        if (limit < child->inherit_limit) child->inherit_limit = limit;
+        object_ref(&child->parent->obj);
+    }
+    spinlock_release_irqrestore(&vmo->lock, flags);
+    object_deref(&vmo->obj);
+    if (hidden) kfree(hidden);  //someone decommitted everything meanwhile
+    
+    int32 h = process_grant_handle(proc, &child->obj, rights);
+    if (h < 0) {
+        object_deref(&child->obj);
+        return -1;
+    }
+    
+    return h;
+}
+
+vmo_t *vmo_get(process_t *proc, int32 handle, handle_rights_t *rights) {
+    //one copy of the entry so the rights and the object can't come from
+    //two different handles if the slot is closed and reused in between
+    proc_handle_t entry;
+    if (!proc || process_get_handle_entry(proc, handle, &entry) < 0) return NULL;
+    if (entry.obj->type != OBJECT_VMO) {
+        object_deref(entry.obj);
+        return NULL;
+    }
+    
+    if (rights) *rights = entry.rights;
+    return (vmo_t *)entry.obj;
 }
 
 ssize vmo_read(process_t *proc, int32 handle, void *buf, size len, size offset) {
     if (!proc || !buf) return -1;
     
-    //check read rights
-    if (!process_handle_has_rights(proc, handle, HANDLE_RIGHT_READ)) {
-        return -2;  //no read permission
-    }
-    
-    vmo_t *vmo = vmo_get(proc, handle);
+    handle_rights_t have;
+    vmo_t *vmo = vmo_get(proc, handle, &have);
     if (!vmo) return -1;
     
-    return vmo_obj_read(&vmo->obj, buf, len, offset);
+    //check read rights
+    ssize ret = -2;  //no read permission
+    if (rights_has(have, HANDLE_RIGHT_READ)) ret = vmo_obj_read(&vmo->obj, buf, len, offset);
+    object_deref(&vmo->obj);
+    return ret;
 }
 
 ssize vmo_write(process_t *proc, int32 handle, const void *buf, size len, size offset) {
     if (!proc || !buf) return -1;
     
-    //check write rights
-    if (!process_handle_has_rights(proc, handle, HANDLE_RIGHT_WRITE)) {
-        return -2;  //no write permission
-    }
-    
-    vmo_t *vmo = vmo_get(proc, handle);
+    handle_rights_t have;
+    vmo_t *vmo = vmo_get(proc, handle, &have);
     if (!vmo) return -1;
     
-    return vmo_obj_write(&vmo->obj, buf, len, offset);
+    //check write rights
+    ssize ret = -2;  //no write permission
+    if (rights_has(have, HANDLE_RIGHT_WRITE)) ret = vmo_obj_write(&vmo->obj, buf, len, offset);
+    object_deref(&vmo->obj);
+    return ret;
 }
 
 size vmo_get_size(process_t *proc, int32 handle) {
-    vmo_t *vmo = vmo_get(proc, handle);
+    vmo_t *vmo = vmo_get(proc, handle, NULL);
     if (!vmo) return 0;
-    return vmo->size;
+    size bytes = vmo->size;
+    object_deref(&vmo->obj);
+    return bytes;
 }
 
-void *vmo_map(process_t *proc, int32 handle, void *vaddr_hint,
-              size offset, size len, handle_rights_t map_rights) {
-    if (!proc) return NULL;
-    
-    //check map rights
-    if (!process_handle_has_rights(proc, handle, HANDLE_RIGHT_MAP)) {
-        return NULL;  //no map permission
-    }
-    
-    vmo_t *vmo = vmo_get(proc, handle);
-    if (!vmo) return NULL;
-    
+//map a VMO the caller holds a reference to, the VMA takes its own
+static void *vmo_map_vmo(process_t *proc, vmo_t *vmo, void *vaddr_hint,
+                         size offset, size len, handle_rights_t map_rights) {
     //validate offset and length
-    if (offset >= vmo->size) return NULL;
+    if (offset >= vmo->size || (offset & (PAGE_SIZE - 1))) return NULL;
     if (len == 0) len = vmo->size - offset;
-    if (offset + len > vmo->size) return NULL;
-    
-    //for kernel process (NULL pagemap) return direct pointer
-    if (!proc->pagemap) {
-        return (char *)vmo->pages + offset;
+    if (len > vmo->size - offset) return NULL;
+    size pages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+    
+    //a user hint has to put the whole mapping inside the user window
+    uintptr hint = (uintptr)vaddr_hint;
+    if (proc->pagemap && hint) {
+        if ((hint & (PAGE_SIZE - 1)) || hint < USER_SPACE_START || hint > USER_SPACE_END) return NULL;
+        if (pages * PAGE_SIZE - 1 > USER_SPACE_END - hint) return NULL;
     }
     
-    //for user processes we need to map pages into their address space    
-    uint64 flags = MMU_FLAG_PRESENT | MMU_FLAG_USER;
+    uint64 flags = MMU_FLAG_PRESENT;
     if (map_rights & HANDLE_RIGHT_WRITE) flags |= MMU_FLAG_WRITE;
     if (map_rights & HANDLE_RIGHT_EXECUTE) flags |= MMU_FLAG_EXEC;
     
-    //get physical address of VMO pages using HHDM offset
-    uint64 phys = V2P((uintptr)vmo->pages + offset);
+    vmo_mapping_t *m = kmalloc(sizeof(vmo_mapping_t));
+    if (!m) return NULL;
     
-    //choose virtual address - use hint if provided or allocate from VMA
+    //choose virtual address - kernel mappings live in the heap range, user
+    //ones use the hint if provided or allocate from VMA
     uintptr vaddr;
-    if (vaddr_hint) {
-        vaddr = (uintptr)vaddr_hint;
-        //add VMA entry for tracking at specified address
-        if (process_vma_add(proc, vaddr, len, flags, &vmo->obj, offset) < 0) {
+    if (!proc->pagemap) {
+        //tracked by the kernel process whichever kernel thread asked
+        vaddr = (uintptr)kvalloc(pages);
+        if (!vaddr || process_vma_add(process_get_kernel(), vaddr, pages * PAGE_SIZE, flags, &vmo->obj, offset) < 0) {
+            if (vaddr) kvfree((void *)vaddr, pages);
+            kfree(m);
             return NULL;
         }
     } else {
-        //allocate a free region using VMA
-        vaddr = process_vma_alloc(proc, len, flags, &vmo->obj, offset);
-        if (!vaddr) return NULL;
+        flags |= MMU_FLAG_USER;
+        if (hint) {
+            vaddr = hint;
+            //add VMA entry for tracking at specified address
+            if (process_vma_add(proc, vaddr, pages * PAGE_SIZE, flags, &vmo->obj, offset) < 0) {
+                kfree(m);
+                return NULL;
+            }
+        } else {
+            //allocate a free region using VMA
+            vaddr = process_vma_alloc(proc, len, flags, &vmo->obj, offset);
+            if (!vaddr) {
+                kfree(m);
+                return NULL;
+            }
+        }
     }
     
-    //map pages
-    size pages = (len + 0xFFF) / 0x1000;
-    mmu_map_range(proc->pagemap, vaddr, phys, pages, flags);
+    m->pagemap = vmo_pagemap(proc);
+    m->vaddr = vaddr;
+    m->offset = offset;
+    m->len = pages * PAGE_SIZE;
+    
+    //map what is already committed in physically contiguous runs (a run
+    //covering an aligned 2MB frame becomes a huge mapping), the rest is
+    //filled in by vmo_fault on first access
+    irq_state_t irq = spinlock_acquire_irqsave(&vmo->lock);
+    m->next = vmo->mappings;
+    vmo->mappings = m;
+    
+    size first = offset / PAGE_SIZE;
+    size i = 0;
+    while (i < pages) {
+        uintptr phys = vmo_page(vmo, first + i, false);
+        if (!phys) {
+            i++;
+            continue;
+        }
+        size run = 1;
+        while (i + run < pages && vmo_page(vmo, first + i + run, false) == phys + run * PAGE_SIZE) run++;
+        mmu_map_range(m->pagemap, vaddr + i * PAGE_SIZE, phys, run, flags);
+        i += run;
+    }
+    spinlock_release_irqrestore(&vmo->lock, irq);
     
     return (void *)vaddr;
 }
 
+void *vmo_map(process_t *proc, int32 handle, void *vaddr_hint,
+              size offset, size len, handle_rights_t map_rights) {
+    if (!proc) return NULL;
+    
+    handle_rights_t have;
+    vmo_t *vmo = vmo_get(proc, handle, &have);
+    if (!vmo) return NULL;
+    
+    //check map rights, and a mapping can't grant more than the handle holds
+    void *addr = NULL;
+    if (rights_has(have, HANDLE_RIGHT_MAP) && rights_has(have, map_rights)) {
+        addr = vmo_map_vmo(proc, vmo, vaddr_hint, offset, len, map_rights);
+    }
+    object_deref(&vmo->obj);
+    return addr;
+}
+
 int vmo_unmap(process_t *proc, void *vaddr, size len) {
-    if (!proc || !vaddr || !proc->pagemap) return -1;
+    if (!proc || !vaddr) return -1;
+    if (!proc->pagemap) proc = process_get_kernel();
+    
+    //only VMO mappings, the rest of the address space isn't ours to drop
+    proc_vma_t vma;
+    if (process_vma_get(proc, (uintptr)vaddr, &vma) < 0) return -1;
+    if (!vma.obj || vma.obj->type != OBJECT_VMO || (uintptr)vaddr != vma.start) {
+        if (vma.obj) object_deref(vma.obj);
+        return -1;
+    }
+    
+    //drop the mapping record so decommit stops touching this range, a racing
+    //unmap of the same range finds it gone and backs off
+    pagemap_t *map = vmo_pagemap(proc);
+    vmo_t *vmo = (vmo_t *)vma.obj;
+    vmo_mapping_t *m = NULL;
+    irq_state_t flags = spinlock_acquire_irqsave(&vmo->lock);
+    for (vmo_mapping_t **pp = &vmo->mappings; *pp; pp = &(*pp)->next) {
+        if ((*pp)->pagemap == map && (*pp)->vaddr == (uintptr)vaddr) {
+            m = *pp;
+            *pp = m->next;
+            break;
+        }
+    }
+    spinlock_release_irqrestore(&vmo->lock, flags);
+    object_deref(&vmo->obj);
+    if (!m) return -1;
+    len = m->len;
     
     //unmap pages
-    size pages = (len + 0xFFF) / 0x1000;
-    mmu_unmap_range(proc->pagemap, (uintptr)vaddr, pages);
+    size pages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (proc->pagemap) mmu_unmap_range(proc->pagemap, (uintptr)vaddr, pages);
+    else kvfree(vaddr, pages);
+    kfree(m);
     
-    //remove VMA entry
+    //remove VMA entry (drops its reference on the VMO)
     process_vma_remove(proc, (uintptr)vaddr);
     
     return 0;
 }
+
+//drop page range [first, end) from every mapping of the VMO, caller holds vmo->lock
+static void vmo_unmap_pages(vmo_t *vmo, size first, size end) {
+    size lo = first * PAGE_SIZE, hi = end * PAGE_SIZE;
+    for (vmo_mapping_t *m = vmo->mappings; m; m = m->next) {
+        size from = m->offset > lo ? m->offset : lo;
+        size to = m->offset + m->len < hi ? m->offset + m->len : hi;
+        if (from >= to) continue;
+        mmu_unmap_range(m->pagemap, m->vaddr + (from - m->offset), (to - from) / PAGE_SIZE);
+    }
+}
+
+//free the owned pages in [first, end) after unmapping them from every mapping
+//each mapping drops the whole range in one batched unmap, inherited pages in
+//it just fault back in
+//caller holds vmo->lock and has waited for pins to drain
+static void vmo_release_pages(vmo_t *vmo, size first, size end) {
+    vmo_unmap_pages(vmo, first, end);
+    
+    for (size i = first; i < end; i++) {
+        uintptr *slot = vmo_slot(vmo, i, false);
+        if (!slot || !*slot) continue;
+        pmm_free((void *)*slot, 1);
+        *slot = 0;
+        vmo->committed -= PAGE_SIZE;
+    }
+}
+
+//page aligned [first, end) page range of a request clamped to the VMO
+static int vmo_range(vmo_t *vmo, size offset, size len, size *first, size *end) {
+    if (offset >= vmo->size || len == 0) return -1;
+    if (offset + len > vmo->size || offset + len < offset) len = vmo->size - offset;
+    *first = offset / PAGE_SIZE;
+    *end = (offset + len + PAGE_SIZE - 1) / PAGE_SIZE;
+    return 0;
+}
+
+int vmo_commit(process_t *proc, int32 handle, size offset, size len) {
+    if (!proc) return -1;
+    
+    handle_rights_t have;
+    vmo_t *vmo = vmo_get(proc, handle, &have);
+    if (!vmo) return -1;
+    if (!rights_has(have, HANDLE_RIGHT_WRITE)) {
+        object_deref(&vmo->obj);
+        return -2;
+    }
+    size first, end;
+    if (vmo_range(vmo, offset, len, &first, &end) < 0) {
+        object_deref(&vmo->obj);
+        return -1;
+    }
+    
+    int ret = 0;
+    irq_state_t flags = spinlock_acquire_irqsave(&vmo->lock);
+    for (size i = first; i < end; i++) {
+        flags = vmo_commit_huge(vmo, i, flags);
+        if (i >= vmo->page_count) break;  //shrunk meanwhile
+        if (!vmo_page(vmo, i, true)) {
+            ret = -3;  //out of memory
+            break;
+        }
+    }
+    spinlock_release_irqrestore(&vmo->lock, flags);
+    object_deref(&vmo->obj);
+    return ret;
+}
+
+int vmo_decommit(process_t *proc, int32 handle, size offset, size len) {
+    if (!proc) return -1;
+    
+    handle_rights_t have;
+    vmo_t *vmo = vmo_get(proc, handle, &have);
+    if (!vmo) return -1;
+    if (!rights_has(have, HANDLE_RIGHT_WRITE)) {
+        object_deref(&vmo->obj);
+        return -2;
+    }
+    size first, end;
+    if (vmo_range(vmo, offset, len, &first, &end) < 0) {
+        object_deref(&vmo->obj);
+        return -1;
+    }
+    
+    irq_state_t flags = spinlock_acquire_irqsave(&vmo->lock);
+    flags = vmo_wait_unpinned(vmo, flags);
+    vmo_release_pages(vmo, first, end);
+    spinlock_release_irqrestore(&vmo->lock, flags);
+    object_deref(&vmo->obj);
+    return 0;
+}
+
+//resize a VMO the caller holds a reference to
+static int vmo_resize(vmo_t *vmo, size new_size) {
+    if (!(vmo->flags & VMO_FLAG_RESIZABLE)) return -3;
+    
+    size new_count = (new_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    
+    irq_state_t flags = spinlock_acquire_irqsave(&vmo->lock);
+    flags = vmo_wait_unpinned(vmo, flags);
+    if (new_count < vmo->page_count) {
+        //mappings lose everything past the end, owned or inherited, and a
+        //later grow must not bring back what the parent has there
+        vmo_release_pages(vmo, new_count, vmo->page_count);
+        if (new_count < vmo->inherit_limit) vmo->inherit_limit = new_count;
+    }
+    
+    //bytes past the new end of the last page must read as zero if it grows
+    //again, an inherited last page gets a private copy to clear first
+    if (new_size < vmo->size && new_size % PAGE_SIZE) {
+        size last = new_size / PAGE_SIZE;
+        uintptr phys = vmo_page(vmo, last, false);
+        if (!phys && vmo_inherited(vmo, last)) {
+            phys = vmo_page(vmo, last, true);
+            if (phys) vmo_unmap_pages(vmo, last, last + 1);  //mapped read-only from the parent
+        }
+        if (phys) memset((char *)P2V(phys) + new_size % PAGE_SIZE, 0, PAGE_SIZE - new_size % PAGE_SIZE);
+    }
+    
+    //a bigger VMO may need more tree levels, the old tree becomes slot 0
+    while (vmo->radix_levels * VMO_RADIX_SHIFT < 64 &&
+           (new_count - 1) >> (vmo->radix_levels * VMO_RADIX_SHIFT)) {
+        if (vmo->radix_root) {
+            uintptr node = (uintptr)pmm_alloc_zeroed(1);
+            if (!node) {
+                spinlock_release_irqrestore(&vmo->lock, flags);
+                return -4;  //out of memory
+            }
+            ((uintptr *)P2V(node))[0] = vmo->radix_root;
+            vmo->radix_root = node;
+        }
+        vmo->radix_levels++;
+    }
+    
+    vmo->page_count = new_count;
+    vmo->size = new_size;
+    spinlock_release_irqrestore(&vmo->lock, flags);
+    return 0;
+}
+
+int vmo_set_size(process_t *proc, int32 handle, size new_size) {
+    if (!proc || new_size == 0) return -1;
+    
+    handle_rights_t have;
+    vmo_t *vmo = vmo_get(proc, handle, &have);
+    if (!vmo) return -1;
+    
+    int ret = -2;
+    if (rights_has(have, HANDLE_RIGHT_WRITE)) ret = vmo_resize(vmo, new_size);
+    object_deref(&vmo->obj);
+    return ret;
+}
+
+int vmo_fault(process_t *proc, uintptr addr, bool write) {
+    if (!proc) return -1;
+    
+    //the copy holds a reference so an unmap on another CPU can't free the
+    //VMO under us
+    proc_vma_t vma;
+    if (process_vma_get(proc, addr, &vma) < 0) return -1;
+    if (!vma.obj || vma.obj->type != OBJECT_VMO || (write && !(vma.flags & MMU_FLAG_WRITE))) {
+        if (vma.obj) object_deref(vma.obj);
+        return -1;
+    }
+    
+    vmo_t *vmo = (vmo_t *)vma.obj;
+    uintptr page = addr & ~(uintptr)(PAGE_SIZE - 1);
+    size offset = vma.obj_offset + (page - vma.start);
+    size idx = offset / PAGE_SIZE;
+    
+    //map while still holding the lock so a racing decommit can't free the
+    //page between the two steps, and only while the mapping record exists
+    //(vmo_unmap drops it before unmapping, vmo_map adds it after the VMA) so
+    //without one just retry the access until the other side is done
+    int ret = 0;
+    irq_state_t flags = spinlock_acquire_irqsave(&vmo->lock);
+    if (idx < vmo->page_count && !vmo_page(vmo, idx, false)) flags = vmo_commit_huge(vmo, idx, flags);
+    if (offset >= vmo->size) {
+        ret = -1;
+    } else if (vmo_mapping_live(vmo, vmo_pagemap(proc), vma.start)) {
+        uint64 map_flags = vma.flags;
+        uintptr phys = vmo_page(vmo, idx, false);
+        bool owned = true;
+        if (!phys && !write) {
+            //reads of a clone share the inherited page until it is written
+            phys = vmo_inherited(vmo, idx);
+            map_flags &= ~(uint64)MMU_FLAG_WRITE;
+            owned = false;
+        }
+        if (!phys) {
+            phys = vmo_page(vmo, idx, true);
+            owned = true;
+        }
+        
+        //an owned 2MB frame lined up with an aligned 2MB of the mapping goes
+        //in as one huge page
+        uintptr huge_va = page & ~(uintptr)(VMO_HUGE_SIZE - 1);
+        uintptr huge_pa = 0;
+        if (phys && owned && huge_va >= vma.start && huge_va + VMO_HUGE_SIZE <= vma.start + vma.length) {
+            size huge_idx = idx - (page - huge_va) / PAGE_SIZE;
+            if (huge_idx % VMO_RADIX_SLOTS == 0) huge_pa = vmo_huge_frame(vmo, huge_idx);
+        }
+        
+        if (huge_pa) mmu_map_range(vmo_pagemap(proc), huge_va, huge_pa, PMM_HUGE_PAGES, map_flags);
+        else if (phys) mmu_map_range(vmo_pagemap(proc), page, phys, 1, map_flags);
+        else ret = -1;
+    }
+    spinlock_release_irqrestore(&vmo->lock, flags);
+    object_deref(&vmo->obj);
+    
+    return ret;
+}
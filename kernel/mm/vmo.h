@@ -4,6 +4,7 @@
 #include <arch/types.h>
 #include <obj/object.h>
 #include <obj/rights.h>
+#include <lib/spinlock.h>
 
 /*
  *virtual memory object
@@ -12,30 +13,70 @@
  *- read from / written to directly
  *- mapped into a process's address space
  *- shared between processes via handle transfer
+ *
+ *pages are committed lazily: a new VMO owns no memory, a page is allocated
+ *(zeroed) the first time it is written or touched through a mapping
+ *the first commit into an empty 2MB aligned stretch of a VMO without a parent
+ *takes a whole 2MB frame for it so mappings can use huge pages
 */
 
 //VMO flags
 #define VMO_FLAG_NONE       0
 #define VMO_FLAG_RESIZABLE  (1 << 0)   //can be resized after creation
 
+//vmo_create_child options
+#define VMO_CHILD_COW       (1 << 0)   //copy-on-write snapshot of the parent
+
 //forward declarations
 struct process;
 
+//one place a VMO is mapped, kept so decommitted pages can be unmapped
+typedef struct vmo_mapping {
+    void *pagemap;          //address space the range lives in
+    uintptr vaddr;
+    size offset;            //offset into the VMO
+    size len;
+    struct vmo_mapping *next;
+} vmo_mapping_t;
+
+//pages are indexed by a radix tree of page sized nodes, each level resolves
+//VMO_RADIX_SHIFT bits of the page index and the leaves hold physical addresses
+//so a sparse VMO only pays for the nodes over its committed pages
+#define VMO_RADIX_SHIFT 9
+#define VMO_RADIX_SLOTS (1 << VMO_RADIX_SHIFT)
+
 //VMO structure
 typedef struct vmo {
     object_t obj;           //kernel object (embedded)
-    void *pages;            //physical memory backing (kernel virtual address)
+    uintptr radix_root;     //physical address of the top node, 0 when empty
+    uint32 radix_levels;    //node levels needed to cover page_count
+    size page_count;
     size size;              //size in bytes
     size committed;         //actually allocated bytes
     uint32 flags;
+    spinlock_t lock;        //protects the page tree, committed and mappings
+    uint32 pins;            //unlocked copies in flight, no page is freed meanwhile
+    vmo_mapping_t *mappings;
+    struct vmo *parent;     //COW clones read pages they don't own from here
+    size parent_offset;     //byte offset of this VMO within the parent
+    size inherit_limit;     //pages from here on are never inherited (lowest shrink)
 } vmo_t;
 
 //create a new VMO of the specified size
 //returns handle to the VMO or INVALID_HANDLE
 int32 vmo_create(struct process *proc, size size, uint32 flags, handle_rights_t rights);
 
-//get VMO from handle (returns NULL if not a VMO)
-vmo_t *vmo_get(struct process *proc, int32 handle);
+//create a copy-on-write clone of size bytes starting at offset (page aligned)
+//into the VMO behind handle, pages are shared until either side writes one
+//reads past the end of the parent return zeros
+//returns handle to the clone or negative error
+int32 vmo_create_child(struct process *proc, int32 handle, uint32 options,
+                       size offset, size size, handle_rights_t rights);
+
+//get VMO from handle (returns NULL if not a VMO), rights receives the
+//handle's rights from the same lookup if not NULL
+//the VMO comes with a reference the caller drops with object_deref
+vmo_t *vmo_get(struct process *proc, int32 handle, handle_rights_t *rights);
 
 //read from VMO into buffer
 //returns bytes read or negative error
@@ -48,6 +89,11 @@ ssize vmo_write(struct process *proc, int32 handle, const void *buf, size len, s
 //get VMO size
 size vmo_get_size(struct process *proc, int32 handle);
 
+//resize a VMO created with VMO_FLAG_RESIZABLE
+//pages past the new end are freed and unmapped, growing adds zero pages
+//returns 0 on success or negative error
+int vmo_set_size(struct process *proc, int32 handle, size new_size);
+
 //map VMO into a process's address space
 //returns virtual address or NULL on failure
 //vaddr hint can be NULL for kernel to choose address
@@ -57,4 +103,17 @@ void *vmo_map(struct process *proc, int32 handle, void *vaddr_hint,
 //unmap VMO from a process's address space
 int vmo_unmap(struct process *proc, void *vaddr, size len);
 
+//allocate backing pages for a range up front (so later access can't fail)
+//returns 0 on success or negative error
+int vmo_commit(struct process *proc, int32 handle, size offset, size len);
+
+//release the pages of a range, they read as zero afterwards (a clone falls
+//back to the content it inherited)
+//and are unmapped from every mapping of the VMO
+int vmo_decommit(struct process *proc, int32 handle, size offset, size len);
+
+//resolve a fault on a VMO mapping of proc by committing and mapping the page
+//returns 0 when handled, negative if addr isn't a valid VMO access
+int vmo_fault(struct process *proc, uintptr addr, bool write);
+
 #endif
@@ -15,6 +15,7 @@ static process_t *get_handle_owner(void) {
 }
 
 void handle_init(void) {
+    object_init();
     ns_init();
 }
 
@@ -131,18 +132,20 @@ handle_t handle_duplicate(handle_t h, handle_rights_t new_rights) {
     return process_duplicate_handle(proc, h, new_rights);
 }
 
+//the entry is a copy so the position is stored back once the op is done
 ssize handle_read(handle_t h, void *buf, size len) {
     process_t *proc = get_handle_owner();
     if (!proc) return INVALID_HANDLE;
     
-    proc_handle_t *entry = process_get_handle_entry(proc, h);
-    if (!entry) return -2;
-    if (!entry->obj->ops || !entry->obj->ops->read) return -3;
+    proc_handle_t entry;
+    if (process_get_handle_entry(proc, h, &entry) < 0) return -2;
     
-    ssize result = entry->obj->ops->read(entry->obj, buf, len, entry->offset);
-    if (result > 0) {
-        entry->offset += result;
+    ssize result = -3;
+    if (entry.obj->ops && entry.obj->ops->read) {
+        result = entry.obj->ops->read(entry.obj, buf, len, entry.offset);
+        if (result > 0) process_set_handle_offset(proc, h, entry.obj, entry.offset + result);
     }
+    object_deref(entry.obj);
     return result;
 }
 
@@ -150,14 +153,15 @@ ssize handle_write(handle_t h, const void *buf, size len) {
     process_t *proc = get_handle_owner();
     if (!proc) return -1;
     
-    proc_handle_t *entry = process_get_handle_entry(proc, h);
-    if (!entry) return -1;
-    if (!entry->obj->ops || !entry->obj->ops->write) return -1;
+    proc_handle_t entry;
+    if (process_get_handle_entry(proc, h, &entry) < 0) return -1;
     
-    ssize result = entry->obj->ops->write(entry->obj, buf, len, entry->offset);
-    if (result > 0) {
-        entry->offset += result;
+    ssize result = -1;
+    if (entry.obj->ops && entry.obj->ops->write) {
+        result = entry.obj->ops->write(entry.obj, buf, len, entry.offset);
+        if (result > 0) process_set_handle_offset(proc, h, entry.obj, entry.offset + result);
     }
+    object_deref(entry.obj);
     return result;
 }
 
@@ -165,15 +169,16 @@ ssize handle_seek(handle_t h, ssize offset, int whence) {
     process_t *proc = get_handle_owner();
     if (!proc) return -1;
     
-    proc_handle_t *entry = process_get_handle_entry(proc, h);
-    if (!entry) return -1;
+    proc_handle_t entry;
+    if (process_get_handle_entry(proc, h, &entry) < 0) return -1;
+    object_deref(entry.obj);
     
     switch (whence) {
         case SEEK_SET:
-            entry->offset = offset;
+            entry.offset = offset;
             break;
         case SEEK_CUR:
-            entry->offset += offset;
+            entry.offset += offset;
             break;
         case SEEK_END:
             return -1;
@@ -181,7 +186,8 @@ ssize handle_seek(handle_t h, ssize offset, int whence) {
             return -1;
     }
     
-    return entry->offset;
+    if (process_set_handle_offset(proc, h, entry.obj, entry.offset) < 0) return -1;
+    return entry.offset;
 }
 
 int handle_close(handle_t h) {
@@ -194,15 +200,18 @@ int handle_readdir(handle_t h, void *entries, uint32 count) {
     process_t *proc = get_handle_owner();
     if (!proc) return -1;
     
-    proc_handle_t *entry = process_get_handle_entry(proc, h);
-    if (!entry) return -1;
-    if (!entry->obj->ops || !entry->obj->ops->readdir) return -1;
+    proc_handle_t entry;
+    if (process_get_handle_entry(proc, h, &entry) < 0) return -1;
     
-    uint32 index = (uint32)entry->offset;
-    int result = entry->obj->ops->readdir(entry->obj, entries, count, &index);
-    if (result >= 0) {
-        entry->offset = index;  //update position for next call
+    int result = -1;
+    if (entry.obj->ops && entry.obj->ops->readdir) {
+        uint32 index = (uint32)entry.offset;
+        result = entry.obj->ops->readdir(entry.obj, entries, count, &index);
+        if (result >= 0) {
+            process_set_handle_offset(proc, h, entry.obj, index);  //update position for next call
+        }
     }
+    object_deref(entry.obj);
     return result;
 }
 
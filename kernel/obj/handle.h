@@ -25,7 +25,7 @@ int handle_create(const char *path, uint32 type);
 //allocate a handle for an object with rights (current process)
 handle_t handle_alloc(object_t *obj, handle_rights_t rights);
 
-//get object from handle (does NOT add ref)
+//get object from handle, it comes with a reference the caller drops
 object_t *handle_get(handle_t h);
 
 //check if handle has required rights
@@ -2,8 +2,15 @@
 #include <mm/kheap.h>
 #include <lib/io.h>
 
+static kmem_cache_t *object_cache = NULL;
+
+void object_init(void) {
+    object_cache = kmem_cache_create("object_t", sizeof(object_t), 0, NULL);
+    if (!object_cache) printf("[object] ERR: failed to create object cache\n");
+}
+
 object_t *object_create(uint32 type, object_ops_t *ops, void *data) {
-    object_t *obj = kmalloc(sizeof(object_t));
+    object_t *obj = kmem_cache_alloc(object_cache);
     if (!obj) return NULL;
     
     obj->type = type;
@@ -32,6 +39,8 @@ void object_deref(object_t *obj) {
         if (obj->ops && obj->ops->close) {
             obj->ops->close(obj);
         }
+        //objects are either from object_create or embedded in a larger
+        //allocation (vmo_t etc) and kfree handles both
         kfree(obj);
     }
 }
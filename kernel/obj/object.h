@@ -32,6 +32,9 @@ typedef struct object {
     void *data;            //type-specific data
 } object_t;
 
+//set up the object cache, before anything calls object_create
+void object_init(void);
+
 //create a new object
 object_t *object_create(uint32 type, object_ops_t *ops, void *data);
 
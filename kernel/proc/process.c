@@ -2,15 +2,50 @@
 #include <proc/thread.h>
 #include <mm/kheap.h>
 #include <mm/mm.h>
+#include <mm/pmm.h>
+#include <mm/vmo.h>
 #include <arch/mmu.h>
 #include <lib/string.h>
 #include <lib/io.h>
+#include <lib/spinlock.h>
+#include <arch/cpu.h>
+#include <arch/timer.h>
 
 static uint64 next_pid = 1;
 static process_t *process_list = NULL;
-static process_t *current_process = NULL;
+static spinlock_t process_list_lock = SPINLOCK_INIT;
 static process_t *kernel_process = NULL;
 
+static kmem_cache_t *vma_cache = NULL;
+
+static int vma_cmp(const avl_node_t *a, const avl_node_t *b) {
+    uintptr sa = avl_entry(a, proc_vma_t, node)->start;
+    uintptr sb = avl_entry(b, proc_vma_t, node)->start;
+    return sa < sb ? -1 : sa > sb;
+}
+
+//recompute the subtree extent and largest inner gap of a VMA node
+static void vma_update(avl_node_t *node) {
+    proc_vma_t *vma = avl_entry(node, proc_vma_t, node);
+    vma->subtree_start = vma->start;
+    vma->subtree_end = vma->start + vma->length;
+    vma->subtree_gap = 0;
+
+    if (node->left) {
+        proc_vma_t *l = avl_entry(node->left, proc_vma_t, node);
+        vma->subtree_start = l->subtree_start;
+        vma->subtree_gap = l->subtree_gap;
+        if (vma->start - l->subtree_end > vma->subtree_gap) vma->subtree_gap = vma->start - l->subtree_end;
+    }
+    if (node->right) {
+        proc_vma_t *r = avl_entry(node->right, proc_vma_t, node);
+        size end = vma->start + vma->length;
+        vma->subtree_end = r->subtree_end;
+        if (r->subtree_gap > vma->subtree_gap) vma->subtree_gap = r->subtree_gap;
+        if (r->subtree_start - end > vma->subtree_gap) vma->subtree_gap = r->subtree_start - end;
+    }
+}
+
 //process object ops (called when all handles to a process are closed)
 static int process_obj_close(object_t *obj) {
     (void)obj;
@@ -29,7 +64,7 @@ process_t *process_create(const char *name) {
     process_t *proc = kzalloc(sizeof(process_t));
     if (!proc) return NULL;
     
-    proc->pid = next_pid++;
+    proc->pid = __atomic_fetch_add(&next_pid, 1, __ATOMIC_RELAXED);
     strncpy(proc->name, name, sizeof(proc->name) - 1);
     proc->state = PROC_STATE_READY;
     
@@ -50,13 +85,17 @@ process_t *process_create(const char *name) {
     proc->handle_count = 0;
     proc->handle_capacity = PROC_INITIAL_HANDLES;
     
+    spinlock_init(&proc->lock);
     proc->pagemap = NULL;
+    avl_init(&proc->vma_tree, vma_cmp, vma_update);
     proc->threads = NULL;
     proc->thread_count = 0;
     
     //add to process list
+    irq_state_t flags = spinlock_acquire_irqsave(&process_list_lock);
     proc->next = process_list;
     process_list = proc;
+    spinlock_release_irqrestore(&process_list_lock, flags);
     
     return proc;
 }
@@ -72,13 +111,47 @@ process_t *process_create_user(const char *name) {
         return NULL;
     }
     
+    //the clock page lets userspace read the time without a syscall, it is
+    //shared so the VMA doesn't own it
+    uintptr clock = arch_timer_clock_page();
+    if (process_vma_add(proc, USER_CLOCK_PAGE, PAGE_SIZE, MMU_FLAG_USER, NULL, 0) < 0) {
+        process_destroy(proc);
+        return NULL;
+    }
+    mmu_map_range(proc->pagemap, USER_CLOCK_PAGE, clock, 1, MMU_FLAG_USER);
+    if (mmu_virt_to_phys(proc->pagemap, USER_CLOCK_PAGE) != clock) {
+        process_destroy(proc);  //out of memory for page tables
+        return NULL;
+    }
+    
     return proc;
 }
 
+//queue the frames of a process owned VMA for freeing and unmap it, contiguous
+//runs go back to the PMM as one block once the TLB is flushed
+static void vma_release_owned(process_t *proc, proc_vma_t *vma, mmu_gather_t *g) {
+    uintptr end = vma->start + vma->length;
+    for (uintptr v = vma->start; v < end; ) {
+        uintptr phys = mmu_virt_to_phys(proc->pagemap, v);
+        if (!phys) {
+            v += PAGE_SIZE;
+            continue;
+        }
+        size n = 1;
+        while (v + n * PAGE_SIZE < end &&
+               mmu_virt_to_phys(proc->pagemap, v + n * PAGE_SIZE) == phys + n * PAGE_SIZE) {
+            n++;
+        }
+        mmu_gather_free(g, phys, n);
+        v += n * PAGE_SIZE;
+    }
+    mmu_unmap_gather(g, vma->start, vma->length / PAGE_SIZE);
+}
+
 void process_destroy(process_t *proc) {
     if (!proc) return;
     
-    //close all handles
+    //close all handles, nothing else runs in the process any more
     for (uint32 i = 0; i < proc->handle_capacity; i++) {
         if (proc->handles[i].obj) {
             object_deref(proc->handles[i].obj);
@@ -86,6 +159,23 @@ void process_destroy(process_t *proc) {
     }
     kfree(proc->handles);
     
+    //tear down mappings first, VMO pages are only unmapped (they still belong
+    //to the VMO) while owned memory is freed after one batched flush
+    mmu_gather_t gather;
+    if (proc->pagemap) mmu_gather_init(&gather, proc->pagemap);
+    while (proc->vma_tree.root) {
+        proc_vma_t *vma = avl_entry(proc->vma_tree.root, proc_vma_t, node);
+        if (proc->pagemap && vma->obj && vma->obj->type == OBJECT_VMO &&
+            vmo_unmap(proc, (void *)vma->start, vma->length) == 0) {
+            continue;
+        }
+        if (proc->pagemap && (vma->flags & PROC_VMA_OWNED)) {
+            vma_release_owned(proc, vma, &gather);
+        }
+        process_vma_remove(proc, vma->start);
+    }
+    if (proc->pagemap) mmu_gather_flush(&gather);
+    
     //free user address space if present
     if (proc->pagemap) {
         mmu_pagemap_destroy(proc->pagemap);
@@ -93,6 +183,7 @@ void process_destroy(process_t *proc) {
     }
     
     //remove from process list
+    irq_state_t flags = spinlock_acquire_irqsave(&process_list_lock);
     process_t **pp = &process_list;
     while (*pp) {
         if (*pp == proc) {
@@ -101,6 +192,7 @@ void process_destroy(process_t *proc) {
         }
         pp = &(*pp)->next;
     }
+    spinlock_release_irqrestore(&process_list_lock, flags);
     
     //free the process object
     if (proc->obj) {
@@ -116,115 +208,167 @@ object_t *process_get_object(process_t *proc) {
     return proc->obj;
 }
 
+//index of a free handle slot, -1 if the table is full, caller holds proc->lock
+static int handle_free_slot(process_t *proc) {
+    for (uint32 i = 0; i < proc->handle_capacity; i++) {
+        if (!proc->handles[i].obj) return i;
+    }
+    return -1;
+}
+
+//entry for a live handle, caller holds proc->lock
+static proc_handle_t *handle_entry(process_t *proc, int handle) {
+    if (handle < 0 || (uint32)handle >= proc->handle_capacity) return NULL;
+    if (!proc->handles[handle].obj) return NULL;
+    return &proc->handles[handle];
+}
+
 int process_grant_handle(process_t *proc, object_t *obj, handle_rights_t rights) {
     if (!proc || !obj) return -1;
     
-    //find free slot
-    for (uint32 i = 0; i < proc->handle_capacity; i++) {
-        if (!proc->handles[i].obj) {
-            proc->handles[i].obj = obj;
-            proc->handles[i].offset = 0;
-            proc->handles[i].flags = 0;
-            proc->handles[i].rights = rights;
-            object_ref(obj);
-            proc->handle_count++;
-            return i;
+    irq_state_t flags = spinlock_acquire_irqsave(&proc->lock);
+    int h = handle_free_slot(proc);
+    while (h < 0) {
+        //grow table, the new one is allocated unlocked so another thread
+        //may have grown it meanwhile
+        uint32 cap = proc->handle_capacity;
+        spinlock_release_irqrestore(&proc->lock, flags);
+        proc_handle_t *new_handles = kzalloc(cap * 2 * sizeof(proc_handle_t));
+        if (!new_handles) return -1;
+        
+        flags = spinlock_acquire_irqsave(&proc->lock);
+        if (proc->handle_capacity == cap) {
+            memcpy(new_handles, proc->handles, cap * sizeof(proc_handle_t));
+            kfree(proc->handles);
+            proc->handles = new_handles;
+            proc->handle_capacity = cap * 2;
+        } else {
+            kfree(new_handles);
         }
+        h = handle_free_slot(proc);
     }
     
-    //grow table
-    uint32 new_cap = proc->handle_capacity * 2;
-    proc_handle_t *new_handles = krealloc(proc->handles, new_cap * sizeof(proc_handle_t));
-    if (!new_handles) return -1;
-    
-    //zero new entries
-    for (uint32 i = proc->handle_capacity; i < new_cap; i++) {
-        new_handles[i].obj = NULL;
-        new_handles[i].offset = 0;
-        new_handles[i].flags = 0;
-        new_handles[i].rights = HANDLE_RIGHT_NONE;
-    }
-    
-    int h = proc->handle_capacity;
-    new_handles[h].obj = obj;
-    new_handles[h].offset = 0;
-    new_handles[h].flags = 0;
-    new_handles[h].rights = rights;
+    proc->handles[h].obj = obj;
+    proc->handles[h].offset = 0;
+    proc->handles[h].flags = 0;
+    proc->handles[h].rights = rights;
     object_ref(obj);
-    
-    proc->handles = new_handles;
-    proc->handle_capacity = new_cap;
     proc->handle_count++;
+    spinlock_release_irqrestore(&proc->lock, flags);
     
     return h;
 }
 
 object_t *process_get_handle(process_t *proc, int handle) {
-    if (!proc || handle < 0 || (uint32)handle >= proc->handle_capacity) return NULL;
-    return proc->handles[handle].obj;
+    if (!proc) return NULL;
+    
+    irq_state_t flags = spinlock_acquire_irqsave(&proc->lock);
+    proc_handle_t *entry = handle_entry(proc, handle);
+    object_t *obj = entry ? entry->obj : NULL;
+    if (obj) object_ref(obj);
+    spinlock_release_irqrestore(&proc->lock, flags);
+    return obj;
 }
 
-proc_handle_t *process_get_handle_entry(process_t *proc, int handle) {
-    if (!proc || handle < 0 || (uint32)handle >= proc->handle_capacity) return NULL;
-    if (!proc->handles[handle].obj) return NULL;
-    return &proc->handles[handle];
+int process_get_handle_entry(process_t *proc, int handle, proc_handle_t *out) {
+    if (!proc || !out) return -1;
+    
+    irq_state_t flags = spinlock_acquire_irqsave(&proc->lock);
+    proc_handle_t *entry = handle_entry(proc, handle);
+    if (entry) {
+        *out = *entry;
+        object_ref(out->obj);
+    }
+    spinlock_release_irqrestore(&proc->lock, flags);
+    return entry ? 0 : -1;
+}
+
+int process_set_handle_offset(process_t *proc, int handle, object_t *obj, size offset) {
+    if (!proc) return -1;
+    
+    irq_state_t flags = spinlock_acquire_irqsave(&proc->lock);
+    proc_handle_t *entry = handle_entry(proc, handle);
+    //the slot may have been closed and reused for another object meanwhile
+    bool same = entry && entry->obj == obj;
+    if (same) entry->offset = offset;
+    spinlock_release_irqrestore(&proc->lock, flags);
+    return same ? 0 : -1;
 }
 
 int process_handle_has_rights(process_t *proc, int handle, handle_rights_t required) {
-    proc_handle_t *entry = process_get_handle_entry(proc, handle);
-    if (!entry) return 0;
-    return rights_has(entry->rights, required);
+    if (!proc) return 0;
+    
+    irq_state_t flags = spinlock_acquire_irqsave(&proc->lock);
+    proc_handle_t *entry = handle_entry(proc, handle);
+    int ok = entry && rights_has(entry->rights, required);
+    spinlock_release_irqrestore(&proc->lock, flags);
+    return ok;
 }
 
 int process_duplicate_handle(process_t *proc, int handle, handle_rights_t new_rights) {
-    proc_handle_t *entry = process_get_handle_entry(proc, handle);
-    if (!entry) return -1;
+    proc_handle_t entry;
+    if (process_get_handle_entry(proc, handle, &entry) < 0) return -1;
     
     //check DUPLICATE right
-    if (!rights_has(entry->rights, HANDLE_RIGHT_DUPLICATE)) {
+    if (!rights_has(entry.rights, HANDLE_RIGHT_DUPLICATE)) {
+        object_deref(entry.obj);
         return -1;  //not allowed to duplicate
     }
     
     //new rights must be subset of original (can only reduce never increase)
-    handle_rights_t actual_rights = rights_reduce(entry->rights, new_rights);
+    handle_rights_t actual_rights = rights_reduce(entry.rights, new_rights);
     
     //create new handle with reduced rights
-    return process_grant_handle(proc, entry->obj, actual_rights);
+    int h = process_grant_handle(proc, entry.obj, actual_rights);
+    object_deref(entry.obj);
+    return h;
 }
 
 int process_replace_handle_rights(process_t *proc, int handle, handle_rights_t new_rights) {
-    proc_handle_t *entry = process_get_handle_entry(proc, handle);
-    if (!entry) return -1;
+    if (!proc) return -1;
+    
+    irq_state_t flags = spinlock_acquire_irqsave(&proc->lock);
+    proc_handle_t *entry = handle_entry(proc, handle);
     
     //can only reduce rights never increase
-    if ((new_rights & ~entry->rights) != 0) {
-        return -1;  //trying to add rights we don't have
+    int ret = -1;
+    if (entry && (new_rights & ~entry->rights) == 0) {
+        entry->rights = new_rights;
+        ret = 0;
     }
-    
-    entry->rights = new_rights;
-    return 0;
+    spinlock_release_irqrestore(&proc->lock, flags);
+    return ret;
 }
 
 int process_close_handle(process_t *proc, int handle) {
-    if (!proc || handle < 0 || (uint32)handle >= proc->handle_capacity) return -1;
-    if (!proc->handles[handle].obj) return -1;
-    
-    object_deref(proc->handles[handle].obj);
-    proc->handles[handle].obj = NULL;
-    proc->handles[handle].offset = 0;
-    proc->handles[handle].flags = 0;
-    proc->handles[handle].rights = HANDLE_RIGHT_NONE;
+    if (!proc) return -1;
+    
+    irq_state_t flags = spinlock_acquire_irqsave(&proc->lock);
+    proc_handle_t *entry = handle_entry(proc, handle);
+    if (!entry) {
+        spinlock_release_irqrestore(&proc->lock, flags);
+        return -1;
+    }
+    object_t *obj = entry->obj;
+    entry->obj = NULL;
+    entry->offset = 0;
+    entry->flags = 0;
+    entry->rights = HANDLE_RIGHT_NONE;
     proc->handle_count--;
+    spinlock_release_irqrestore(&proc->lock, flags);
     
+    //the close op may block, never run it under the lock
+    object_deref(obj);
     return 0;
 }
 
+//each CPU tracks the process of the thread it is running
 process_t *process_current(void) {
-    return current_process;
+    return (process_t *)percpu_current_process();
 }
 
 void process_set_current(process_t *proc) {
-    current_process = proc;
+    percpu_get()->current_process = proc;
 }
 
 process_t *process_get_kernel(void) {
@@ -232,6 +376,13 @@ process_t *process_get_kernel(void) {
 }
 
 void proc_init(void) {
+    vma_cache = kmem_cache_create("proc_vma_t", sizeof(proc_vma_t), 0, NULL);
+    if (!vma_cache) {
+        printf("[proc] ERR: failed to create VMA cache\n");
+        return;
+    }
+    thread_init();
+    
     //create kernel process (PID 0)
     process_t *kproc = process_create("kernel");
     if (!kproc) {
@@ -250,104 +401,152 @@ void proc_init(void) {
     printf("[proc] initialized (kernel PID 0)\n");
 }
 
-uintptr process_vma_find_free(process_t *proc, size length) {
-    if (!proc || length == 0) return 0;
-    
-    //page-align the length
-    length = (length + 0xFFF) & ~0xFFFULL;
-    
-    //start from the hint or default
-    uintptr addr = proc->vma_next_addr;
-    if (addr < USER_SPACE_START) addr = USER_SPACE_START;
+//lowest aligned address in [lo, hi) with room for length bytes, 0 if none
+static uintptr gap_fit(uintptr lo, uintptr hi, size length, uintptr align) {
+    uintptr addr = (lo + align - 1) & ~(align - 1);
+    if (addr < lo || addr >= hi || hi - addr < length) return 0;
+    return addr;
+}
+
+//first fit search of the gaps of a subtree that lies between lo and hi
+//(the end of the VMA before it and the start of the one after it)
+static uintptr gap_find(avl_node_t *node, uintptr lo, uintptr hi, size length, uintptr align) {
+    if (!node) return gap_fit(lo, hi, length, align);
+
+    //skip subtrees without a big enough gap anywhere
+    proc_vma_t *vma = avl_entry(node, proc_vma_t, node);
+    size best = vma->subtree_gap;
+    if (vma->subtree_start > lo && vma->subtree_start - lo > best) best = vma->subtree_start - lo;
+    if (hi > vma->subtree_end && hi - vma->subtree_end > best) best = hi - vma->subtree_end;
+    if (best < length) return 0;
+
+    uintptr addr = gap_find(node->left, lo, vma->start, length, align);
+    if (addr) return addr;
+    return gap_find(node->right, vma->start + vma->length, hi, length, align);
+}
+
+//page aligned free range for length bytes, caller holds proc->lock
+static uintptr vma_find_free(process_t *proc, size length) {
+    //regions of 2MB or more are 2MB aligned so they can be mapped with huge pages
+    uintptr align = length >= 0x200000 ? 0x200000 : 0x1000;
     
-    //scan for a free region
-    while (addr + length <= USER_SPACE_END) {
-        int conflict = 0;
-        
-        //check against all existing VMAs
-        for (proc_vma_t *vma = proc->vma_list; vma; vma = vma->next) {
-            uintptr vma_end = vma->start + vma->length;
-            uintptr region_end = addr + length;
-            
-            //check for overlap
-            if (addr < vma_end && region_end > vma->start) {
-                //overlap - skip past this VMA
-                addr = vma_end;
-                addr = (addr + 0xFFF) & ~0xFFFULL;  //page align
-                conflict = 1;
-                break;
-            }
-        }
-        
-        if (!conflict) {
-            //found a free region
-            proc->vma_next_addr = addr + length;
-            return addr;
+    return gap_find(proc->vma_tree.root, USER_SPACE_START, USER_SPACE_END, length, align);
+}
+
+//link vma into the tree unless it overlaps another one, caller holds proc->lock
+static int vma_insert(process_t *proc, proc_vma_t *vma) {
+    //refuse overlaps, the neighbours in address order are the only candidates
+    proc_vma_t *prev = NULL, *next = NULL;
+    for (avl_node_t *node = proc->vma_tree.root; node; ) {
+        proc_vma_t *cur = avl_entry(node, proc_vma_t, node);
+        if (cur->start < vma->start) {
+            prev = cur;
+            node = node->right;
+        } else {
+            next = cur;
+            node = node->left;
         }
     }
+    if (prev && prev->start + prev->length > vma->start) return -1;
+    if (next && next->start < vma->start + vma->length) return -1;
     
-    return 0;  //no space found
+    if (vma->obj) object_ref(vma->obj);
+    avl_insert(&proc->vma_tree, &vma->node);
+    return 0;
 }
 
-int process_vma_add(process_t *proc, uintptr start, size length, 
-                    uint32 flags, object_t *backing_obj, size obj_offset) {
-    if (!proc) return -1;
-    
-    proc_vma_t *vma = kzalloc(sizeof(proc_vma_t));
-    if (!vma) return -1;
+static proc_vma_t *vma_new(uintptr start, size length, uint32 flags, object_t *backing_obj, size obj_offset) {
+    proc_vma_t *vma = kmem_cache_zalloc(vma_cache);
+    if (!vma) return NULL;
     
     vma->start = start;
     vma->length = length;
     vma->flags = flags;
     vma->obj = backing_obj;
     vma->obj_offset = obj_offset;
+    return vma;
+}
+
+uintptr process_vma_find_free(process_t *proc, size length) {
+    if (!proc || length == 0) return 0;
     
-    if (backing_obj) object_ref(backing_obj);
+    //page-align the length
+    length = (length + 0xFFF) & ~0xFFFULL;
+    
+    irq_state_t flags = spinlock_acquire_irqsave(&proc->lock);
+    uintptr addr = vma_find_free(proc, length);
+    spinlock_release_irqrestore(&proc->lock, flags);
+    return addr;
+}
+
+int process_vma_add(process_t *proc, uintptr start, size length, 
+                    uint32 flags, object_t *backing_obj, size obj_offset) {
+    if (!proc || length == 0) return -1;
     
-    //insert at head of list
-    vma->next = proc->vma_list;
-    proc->vma_list = vma;
+    //user address spaces share the kernel half, nothing may be tracked there
+    if (proc->pagemap && (start < USER_SPACE_START || start > USER_SPACE_END ||
+                          length - 1 > USER_SPACE_END - start)) {
+        return -1;
+    }
     
-    return 0;
+    proc_vma_t *vma = vma_new(start, length, flags, backing_obj, obj_offset);
+    if (!vma) return -1;
+    
+    irq_state_t irq = spinlock_acquire_irqsave(&proc->lock);
+    int ret = vma_insert(proc, vma);
+    spinlock_release_irqrestore(&proc->lock, irq);
+    
+    if (ret < 0) kmem_cache_free(vma_cache, vma);
+    return ret;
 }
 
 uintptr process_vma_alloc(process_t *proc, size length, uint32 flags,
                           object_t *backing_obj, size obj_offset) {
-    uintptr addr = process_vma_find_free(proc, length);
-    if (!addr) return 0;
+    if (!proc || length == 0) return 0;
+    length = (length + 0xFFF) & ~0xFFFULL;
     
-    if (process_vma_add(proc, addr, (length + 0xFFF) & ~0xFFFULL, 
-                        flags, backing_obj, obj_offset) < 0) {
-        return 0;
-    }
+    proc_vma_t *vma = vma_new(0, length, flags, backing_obj, obj_offset);
+    if (!vma) return 0;
+    
+    //search and insert under one hold so nobody takes the range in between
+    irq_state_t irq = spinlock_acquire_irqsave(&proc->lock);
+    vma->start = vma_find_free(proc, length);
+    uintptr addr = vma->start && vma_insert(proc, vma) == 0 ? vma->start : 0;
+    spinlock_release_irqrestore(&proc->lock, irq);
     
+    if (!addr) kmem_cache_free(vma_cache, vma);
     return addr;
 }
 
 int process_vma_remove(process_t *proc, uintptr start) {
     if (!proc) return -1;
     
-    proc_vma_t **pp = &proc->vma_list;
-    while (*pp) {
-        if ((*pp)->start == start) {
-            proc_vma_t *vma = *pp;
-            *pp = vma->next;
-            
-            if (vma->obj) object_deref(vma->obj);
-            kfree(vma);
-            return 0;
-        }
-        pp = &(*pp)->next;
+    irq_state_t flags = spinlock_acquire_irqsave(&proc->lock);
+    proc_vma_t *vma = process_vma_find(proc, start);
+    if (!vma || vma->start != start) {
+        spinlock_release_irqrestore(&proc->lock, flags);
+        return -1;  //not found
     }
+    avl_remove(&proc->vma_tree, &vma->node);
+    spinlock_release_irqrestore(&proc->lock, flags);
     
-    return -1;  //not found
+    if (vma->obj) object_deref(vma->obj);
+    kmem_cache_free(vma_cache, vma);
+    return 0;
 }
 
 proc_vma_t *process_vma_find(process_t *proc, uintptr addr) {
     if (!proc) return NULL;
     
-    for (proc_vma_t *vma = proc->vma_list; vma; vma = vma->next) {
-        if (addr >= vma->start && addr < vma->start + vma->length) {
+    //the candidate is the last VMA starting at or below addr
+    avl_node_t *node = proc->vma_tree.root;
+    while (node) {
+        proc_vma_t *vma = avl_entry(node, proc_vma_t, node);
+        if (addr < vma->start) {
+            node = node->left;
+        } else if (addr >= vma->start + vma->length) {
+            node = node->right;
+        } else {
             return vma;
         }
     }
@@ -355,6 +554,19 @@ proc_vma_t *process_vma_find(process_t *proc, uintptr addr) {
     return NULL;
 }
 
+int process_vma_get(process_t *proc, uintptr addr, proc_vma_t *out) {
+    if (!proc || !out) return -1;
+    
+    irq_state_t flags = spinlock_acquire_irqsave(&proc->lock);
+    proc_vma_t *vma = process_vma_find(proc, addr);
+    if (vma) {
+        *out = *vma;
+        if (out->obj) object_ref(out->obj);
+    }
+    spinlock_release_irqrestore(&proc->lock, flags);
+    return vma ? 0 : -1;
+}
+
 uintptr process_setup_user_stack(uintptr stack_phys, uintptr stack_base, 
                                   size stack_size, int argc, char *argv[]) {
     //write to physical memory since user pagemap isn't active
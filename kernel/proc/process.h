@@ -4,6 +4,8 @@
 #include <arch/types.h>
 #include <obj/object.h>
 #include <obj/rights.h>
+#include <lib/avl.h>
+#include <lib/spinlock.h>
 
 //process states
 #define PROC_STATE_READY    0
@@ -24,15 +26,25 @@ typedef struct {
 } proc_handle_t;
 
 //virtual memory area (for tracking user mappings)
+//kept in an AVL tree ordered by start, every node caches the extent of its
+//subtree and the largest unmapped gap inside it so lookups and free range
+//searches are O(log n)
 typedef struct proc_vma {
+    avl_node_t node;
     uintptr start;              //start virtual address
     size length;                //length in bytes
     uint32 flags;               //mapping flags
     object_t *obj;              //backing object (VMO) if any
     size obj_offset;            //offset into backing object
-    struct proc_vma *next;      //linked list
+    uintptr subtree_start;      //lowest start in this subtree
+    uintptr subtree_end;        //highest end in this subtree
+    size subtree_gap;           //largest gap between VMAs of this subtree
 } proc_vma_t;
 
+//the frames mapped in the VMA belong to the process (ELF segments, stacks)
+//and are freed with it, other VMAs map memory owned by their object
+#define PROC_VMA_OWNED (1U << 31)
+
 //process structure
 typedef struct process {
     uint64 pid;
@@ -42,6 +54,10 @@ typedef struct process {
     //kernel object wrapper (for capability-based access)
     object_t *obj;
     
+    //protects handles and vma_tree, threads of the process (and every kernel
+    //thread for the kernel process) use them from any CPU
+    spinlock_t lock;
+    
     //capability-based handle table (dynamic)
     proc_handle_t *handles;
     uint32 handle_count;
@@ -51,8 +67,7 @@ typedef struct process {
     void *pagemap;
     
     //virtual memory areas (for address space tracking)
-    proc_vma_t *vma_list;       //head of VMA list
-    uintptr vma_next_addr;      //next allocation address hint
+    avl_tree_t vma_tree;
     
     //threads in this process
     struct thread *threads;
@@ -65,6 +80,7 @@ typedef struct process {
 //user address space bounds
 #define USER_SPACE_START    0x0000000000400000ULL  //4MB
 #define USER_SPACE_END      0x00007FFFFFFFFFFFULL  //canonical low half
+#define USER_CLOCK_PAGE     0x00007FFFFFFFF000ULL  //read only clock page (see arch_timer_clock_page)
 
 //create a new process
 process_t *process_create(const char *name);
@@ -81,11 +97,15 @@ object_t *process_get_object(process_t *proc);
 //grant a handle to a process with rights (returns handle index or -1)
 int process_grant_handle(process_t *proc, object_t *obj, handle_rights_t rights);
 
-//get object from handle (does NOT add ref)
+//get object from handle, it comes with a reference the caller drops
 object_t *process_get_handle(process_t *proc, int handle);
 
-//get handle entry (for rights/offset access)
-proc_handle_t *process_get_handle_entry(process_t *proc, int handle);
+//copy a handle entry (for rights/offset access), the object in the copy gets
+//a reference the caller drops, returns 0 or -1 for a bad handle
+int process_get_handle_entry(process_t *proc, int handle, proc_handle_t *out);
+
+//store a new file position, ignored (-1) if the handle no longer refers to obj
+int process_set_handle_offset(process_t *proc, int handle, object_t *obj, size offset);
 
 //check if handle has required rights
 int process_handle_has_rights(process_t *proc, int handle, handle_rights_t required);
@@ -118,15 +138,19 @@ uintptr process_vma_alloc(process_t *proc, size length, uint32 flags, object_t *
 //find free virtual address region
 uintptr process_vma_find_free(process_t *proc, size length);
 
-//add a VMA entry (for tracking existing mappings)
+//add a VMA entry (for tracking existing mappings), fails if it overlaps one
 int process_vma_add(process_t *proc, uintptr start, size length, uint32 flags, object_t *backing_obj, size obj_offset);
 
 //remove a VMA entry
 int process_vma_remove(process_t *proc, uintptr start);
 
-//find VMA containing the given address
+//find VMA containing the given address, caller holds proc->lock
 proc_vma_t *process_vma_find(process_t *proc, uintptr addr);
 
+//copy the VMA containing addr, its object gets a reference the caller drops
+//returns 0 or -1 if nothing is mapped there
+int process_vma_get(process_t *proc, uintptr addr, proc_vma_t *out);
+
 //setup user stack with argc/argv
 //returns adjusted stack pointer to use for thread creation
 uintptr process_setup_user_stack(uintptr stack_phys, uintptr stack_base,
@@ -4,145 +4,320 @@
 #include <arch/context.h>
 #include <arch/interrupts.h>
 #include <arch/mmu.h>
+#include <arch/timer.h>
+#include <mm/pmm.h>
 #include <lib/io.h>
+#include <lib/spinlock.h>
 #include <drivers/serial.h>
 
 #define KERNEL_STACK_SIZE 16384  //16KB
 
-//simple round-robin queue
-static thread_t *run_queue_head = NULL;
-static thread_t *run_queue_tail = NULL;
-static uint32 tick_count = 0;
-static uint32 time_slice = 10; //switch every 10 ticks
+//time slices, batch threads get long ones since they only run when nothing
+//interactive is waiting and switching less is all they care about
+//the CPU's timer is armed for the end of the running thread's slice and left
+//off while it idles, so there's no periodic tick
+#define SLICE_INTERACTIVE   (50 * NS_PER_MS)
+#define SLICE_BATCH         (200 * NS_PER_MS)
 
-//dead thread list - threads waiting to have their resources freed
-static thread_t *dead_list_head = NULL;
+//the wakeup bonus, using up whole slices wears it down to -BONUS_MAX
+#define BONUS_MAX           4
 
-//idle thread - always runnable runs when no other threads available
-static thread_t *idle_thread = NULL;
+//per-CPU run queue - one round-robin list per priority plus a bitmap of the
+//non-empty ones so the highest priority thread is found in O(1)
+//doubly linked so a thread can be pulled out from anywhere in O(1), other
+//CPUs take the lock to queue wakeups and to steal work
+typedef struct run_queue {
+    thread_t *head[SCHED_PRIORITIES];
+    thread_t *tail[SCHED_PRIORITIES];
+    uint32 bitmap;          //bit n set while level n has threads
+    uint32 count;
+    spinlock_t lock;
+} run_queue_t;
+
+//CPUs halted in their idle loop, kicked when work is queued
+static uint64 idle_mask = 0;
+
+//per-CPU scheduler state
+//apart from the run queue only touched by the owning CPU with interrupts off
+typedef struct sched_cpu {
+    run_queue_t rq;
+    thread_t *idle;         //runs when there is no work (on the CPU's boot stack)
+    thread_t *dead_list;    //threads waiting to have their resources freed
+    thread_t *prev;         //thread we switched away from, see sched_switch_finish()
+    uint64 slice_end;       //arch_timer_ns() time the running thread's slice is up
+    arch_context_t resume;  //kernel side of entering a thread that sits in usermode
+} __attribute__((aligned(64))) sched_cpu_t;
+
+static sched_cpu_t sched_cpus[MAX_CPUS];
 
 extern void thread_set_current(thread_t *thread);
 extern void process_set_current(process_t *proc);
 
+static inline sched_cpu_t *this_cpu(void) {
+    return &sched_cpus[arch_cpu_id()];
+}
+
+static inline bool is_idle(thread_t *thread) {
+    return thread == sched_cpus[thread->cpu].idle;
+}
+
+static inline void *kernel_stack_top(thread_t *thread) {
+    return (char *)thread->kernel_stack + thread->kernel_stack_size;
+}
+
 //reap dead threads (free their resources)
-static void reap_dead_threads(void) {
-    while (dead_list_head) {
-        thread_t *dead = dead_list_head;
-        dead_list_head = dead->sched_next;
+//only threads that died on this CPU and we've switched away from since, so
+//none of their stacks is still in use
+static void reap_dead_threads(sched_cpu_t *sc) {
+    while (sc->dead_list) {
+        thread_t *dead = sc->dead_list;
+        sc->dead_list = dead->sched_next;
         thread_destroy(dead);
     }
 }
 
-//idle thread entry - just halts forever
-static void idle_thread_entry(void *arg) {
-    (void)arg;
-    
+//recompute a thread's effective priority from its class, nice and bonus
+//only done while the thread is off the run queues since it picks the level
+static void update_priority(thread_t *thread) {
+    int32 band = thread->sched_class == SCHED_CLASS_BATCH ? SCHED_BATCH_FIRST : 0;
+    int32 prio = band + SCHED_BAND_SIZE / 2 + thread->nice - thread->bonus;
+    if (prio < band) prio = band;
+    if (prio > band + SCHED_BAND_SIZE - 1) prio = band + SCHED_BAND_SIZE - 1;
+    thread->priority = prio;
+}
+
+static inline uint64 time_slice(thread_t *thread) {
+    return thread->sched_class == SCHED_CLASS_BATCH ? SLICE_BATCH : SLICE_INTERACTIVE;
+}
+
+static inline uint32 rq_count(run_queue_t *rq) {
+    return __atomic_load_n(&rq->count, __ATOMIC_ACQUIRE);
+}
+
+//best priority waiting on a queue, SCHED_PRIORITIES if it is empty
+static inline uint32 rq_top(run_queue_t *rq) {
+    uint32 bitmap = __atomic_load_n(&rq->bitmap, __ATOMIC_ACQUIRE);
+    return bitmap ? (uint32)__builtin_ctz(bitmap) : SCHED_PRIORITIES;
+}
+
+//queue operations, the caller holds rq->lock
+static void rq_push(run_queue_t *rq, thread_t *thread) {
+    update_priority(thread);
+    uint32 level = thread->priority;
+
+    thread->sched_next = NULL;
+    thread->sched_prev = rq->tail[level];
+    if (rq->tail[level]) rq->tail[level]->sched_next = thread;
+    else rq->head[level] = thread;
+    rq->tail[level] = thread;
+    thread->rq = rq;
+    __atomic_store_n(&rq->bitmap, rq->bitmap | (1U << level), __ATOMIC_RELEASE);
+    __atomic_store_n(&rq->count, rq->count + 1, __ATOMIC_RELEASE);
+}
+
+static void rq_unlink(run_queue_t *rq, thread_t *thread) {
+    uint32 level = thread->priority;
+
+    if (thread->sched_prev) thread->sched_prev->sched_next = thread->sched_next;
+    else rq->head[level] = thread->sched_next;
+    if (thread->sched_next) thread->sched_next->sched_prev = thread->sched_prev;
+    else rq->tail[level] = thread->sched_prev;
+    thread->sched_next = NULL;
+    thread->sched_prev = NULL;
+    thread->rq = NULL;
+    if (!rq->head[level]) __atomic_store_n(&rq->bitmap, rq->bitmap & ~(1U << level), __ATOMIC_RELEASE);
+    __atomic_store_n(&rq->count, rq->count - 1, __ATOMIC_RELEASE);
+}
+
+//take the first thread of the best non-empty level - NULL if the queue is empty
+static thread_t *rq_pop(run_queue_t *rq) {
+    if (!rq_count(rq)) return NULL;
+
+    irq_state_t flags = spinlock_acquire_irqsave(&rq->lock);
+    thread_t *thread = NULL;
+    if (rq->bitmap) {
+        thread = rq->head[__builtin_ctz(rq->bitmap)];
+        rq_unlink(rq, thread);
+    }
+    spinlock_release_irqrestore(&rq->lock, flags);
+    return thread;
+}
+
+//the CPU with the longest queue other than us, -1 if nobody has spare work
+static int32 busiest_cpu(uint32 self) {
+    int32 busiest = -1;
+    uint32 max = 0;
+    uint32 cpus = arch_cpu_count();
+    for (uint32 cpu = 0; cpu < cpus; cpu++) {
+        if (cpu == self) continue;
+        uint32 count = rq_count(&sched_cpus[cpu].rq);
+        if (count > max) {
+            max = count;
+            busiest = cpu;
+        }
+    }
+    return busiest;
+}
+
+//pull a waiting thread over from the busiest CPU
+//the head has waited longest so it is the least likely to be cache hot there
+static thread_t *steal_work(uint32 self) {
+    int32 victim = busiest_cpu(self);
+    if (victim < 0) return NULL;
+    return rq_pop(&sched_cpus[victim].rq);
+}
+
+static inline bool work_available(uint32 self) {
+    return rq_count(&sched_cpus[self].rq) || busiest_cpu(self) >= 0;
+}
+
+//pages zeroed per idle iteration - small so an interrupt that makes work
+//runnable is never held up for long
+#define IDLE_ZERO_BATCH 16
+
+//idle loop - runs queued (or stolen) work, tops up the pre-zeroed page pool,
+//then halts
+static void idle_loop(void) {
+    uint32 cpu = arch_cpu_id();
+    uint64 bit = 1ULL << cpu;
+
     for (;;) {
-        arch_halt();
+        if (work_available(cpu)) {
+            sched_yield();
+            continue;
+        }
+
+        //keep zeroing while there's nothing else to do and the pool isn't full
+        if (pmm_zero_pool_refill(IDLE_ZERO_BATCH) > 0) continue;
+
+        //advertise that we're halting before the final check so sched_add
+        //either sees us in idle_mask or we see its thread
+        arch_interrupts_disable();
+        __atomic_or_fetch(&idle_mask, bit, __ATOMIC_SEQ_CST);
+        if (!work_available(cpu)) arch_idle();
+        __atomic_and_fetch(&idle_mask, ~bit, __ATOMIC_SEQ_CST);
+        arch_interrupts_enable();
     }
 }
 
 void sched_init(void) {
-    run_queue_head = NULL;
-    run_queue_tail = NULL;
-    dead_list_head = NULL;
-    tick_count = 0;
-    
-    //create idle thread attached to kernel process
+    sched_init_cpu(0);
+}
+
+void sched_init_cpu(uint32 cpu) {
+    sched_cpu_t *sc = &sched_cpus[cpu];
+    for (uint32 i = 0; i < SCHED_PRIORITIES; i++) {
+        sc->rq.head[i] = NULL;
+        sc->rq.tail[i] = NULL;
+    }
+    sc->rq.bitmap = 0;
+    sc->rq.count = 0;
+    spinlock_init(&sc->rq.lock);
+    sc->dead_list = NULL;
+    sc->prev = NULL;
+    sc->slice_end = 0;
+
+    //idle thread attached to kernel process, its stack and entry go unused
+    //since sched_start() turns the CPU's boot stack into the idle thread
     process_t *kernel = process_get_kernel();
-    idle_thread = thread_create(kernel, idle_thread_entry, NULL);
-    if (idle_thread) {
-        idle_thread->state = THREAD_STATE_READY;
+    if (!sc->idle) sc->idle = thread_create(kernel, NULL, NULL);
+    if (sc->idle) {
+        sc->idle->state = THREAD_STATE_READY;
+        sc->idle->cpu = cpu;
     }
 }
 
+static inline bool cpu_is_idle(uint32 cpu) {
+    return __atomic_load_n(&idle_mask, __ATOMIC_RELAXED) & (1ULL << cpu);
+}
+
+//wake a halted CPU so it can steal newly queued work
+static void kick_idle_cpu(uint32 self) {
+    uint64 mask = __atomic_load_n(&idle_mask, __ATOMIC_RELAXED) & ~(1ULL << self);
+    if (mask) arch_cpu_kick(__builtin_ctzll(mask));
+}
+
 void sched_add(thread_t *thread) {
     if (!thread) return;
-    if (thread == idle_thread) return; //don't add idle to queue
-    
-    //save interrupt state and disable - we may be called from IRQ context
-    irq_state_t flags = arch_irq_save();
-    
-    thread->sched_next = NULL;
-    
-    if (!run_queue_tail) {
-        run_queue_head = thread;
-        run_queue_tail = thread;
-    } else {
-        run_queue_tail->sched_next = thread;
-        run_queue_tail = thread;
+    if (is_idle(thread)) return; //don't add idle to queue
+
+    //the waker's CPU is likely to share the data the thread wakes up for,
+    //but if the CPU it last ran on is idle it can run it right away with
+    //its old cache contents still around
+    uint32 self = arch_cpu_id();
+    uint32 target = self;
+    if (thread->cpu != self && thread->cpu < arch_cpu_count() && cpu_is_idle(thread->cpu)) {
+        target = thread->cpu;
     }
-    
+
+    //we may be called from IRQ context
+    run_queue_t *rq = &sched_cpus[target].rq;
+    irq_state_t flags = spinlock_acquire_irqsave(&rq->lock);
     thread->state = THREAD_STATE_READY;
-    
-    //restore interrupt state
-    arch_irq_restore(flags);
-}
+    thread->cpu = target;
+    rq_push(rq, thread);
+    spinlock_release_irqrestore(&rq->lock, flags);
 
-void sched_remove(thread_t *thread) {
-    if (!thread) return;
-    if (thread == idle_thread) return;  //idle never in queue
-    
-    thread_t **tp = &run_queue_head;
-    while (*tp) {
-        if (*tp == thread) {
-            *tp = thread->sched_next;
-            if (run_queue_tail == thread) {
-                run_queue_tail = NULL;
-                //find new tail
-                thread_t *t = run_queue_head;
-                while (t && t->sched_next) t = t->sched_next;
-                run_queue_tail = t;
+    //pairs with the idle loop's update of idle_mask before its last check
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    //the target checks whether it outranks what it's running (there's no
+    //tick that would notice later)
+    if (target != self) {
+        arch_cpu_kick(target);
+    } else {
+        thread_t *current = thread_current();
+        if (current && !is_idle(current)) {
+            if (thread->priority < current->priority) {
+                //the ISR or the end of our critical section switches to it
+                arch_set_need_resched(true);
+                arch_preempt_resched();
+            } else {
+                //we're busy so let an idle CPU steal it
+                kick_idle_cpu(self);
             }
-            thread->sched_next = NULL;
-            return;
         }
-        tp = &(*tp)->sched_next;
     }
 }
 
-//pick next thread - returns idle thread if no other threads
-static thread_t *pick_next(void) {
-    if (run_queue_head) {
-        return run_queue_head;
+void sched_remove(thread_t *thread) {
+    if (!thread) return;
+
+    //the thread can be stolen between reading its queue and locking it
+    for (;;) {
+        run_queue_t *rq = __atomic_load_n(&thread->rq, __ATOMIC_ACQUIRE);
+        if (!rq) return;
+
+        irq_state_t flags = spinlock_acquire_irqsave(&rq->lock);
+        bool found = thread->rq == rq;
+        if (found) rq_unlink(rq, thread);
+        spinlock_release_irqrestore(&rq->lock, flags);
+        if (found) return;
     }
-    return idle_thread;
 }
 
-//pick next thread and switch to it
-static void schedule(void) {
-    thread_t *current = thread_current();
-    thread_t *next = pick_next();
-    
-    if (!next) {
-        //no idle thread that shouldn't happen
-        return;
-    }
-    
-    if (current && current->state == THREAD_STATE_RUNNING && current != idle_thread) {
-        //move current to end of queue
-        current->state = THREAD_STATE_READY;
-        sched_remove(current);
-        sched_add(current);
-    }
-    
-    if (next == current) {
-        //same thread so nothing to do
-        return;
-    }
-    
-    //switch to next thread
-    if (next != idle_thread) {
-        sched_remove(next);
-    }
+//make next the running thread on this CPU (everything short of the register switch)
+static void set_running(thread_t *current, thread_t *next) {
     next->state = THREAD_STATE_RUNNING;
+    next->on_cpu = true;
+    next->cpu = arch_cpu_id();
+    arch_set_need_resched(false);
+
+    //fresh slice, the idle thread has none so the timer stays quiet
+    sched_cpu_t *sc = &sched_cpus[next->cpu];
+    if (next == sc->idle) {
+        sc->slice_end = 0;
+        arch_timer_oneshot(0);
+    } else {
+        sc->slice_end = arch_timer_ns() + time_slice(next);
+        arch_timer_oneshot(sc->slice_end);
+    }
     thread_set_current(next);
     process_set_current(next->process);
-    
+
     //switch address space if different process has user pagemap
     process_t *next_proc = next->process;
     process_t *curr_proc = current ? current->process : NULL;
-    
+
     if (next_proc && next_proc->pagemap) {
         //switching to userspace process - load its address space
         mmu_switch((pagemap_t *)next_proc->pagemap);
@@ -150,153 +325,274 @@ static void schedule(void) {
         //switching from user to kernel - reload kernel pagemap
         mmu_switch(mmu_get_kernel_pagemap());
     }
-    
+
     //set kernel stack for ring 3 -> ring 0 transitions
-    void *kernel_stack_top = (char *)next->kernel_stack + next->kernel_stack_size;
-    arch_set_kernel_stack(kernel_stack_top);
-    
+    arch_set_kernel_stack(kernel_stack_top(next));
+}
+
+//the thread is off the CPU for good, returns true if it has to be queued
+//by the caller (it was runnable or got woken while switching away)
+static bool off_cpu(thread_t *thread) {
+    irq_state_t flags = spinlock_acquire_irqsave(&thread->sched_lock);
+    thread->on_cpu = false;
+    bool runnable = thread->state == THREAD_STATE_READY;
+    spinlock_release_irqrestore(&thread->sched_lock, flags);
+    return runnable;
+}
+
+void sched_switch_finish(void) {
+    //the thread we switched away from could only be queued once its context
+    //was saved, otherwise another CPU could pick it up first
+    sched_cpu_t *sc = this_cpu();
+    reap_dead_threads(sc);
+    thread_t *prev = sc->prev;
+    if (!prev) return;
+    sc->prev = NULL;
+    if (off_cpu(prev)) sched_add(prev);
+}
+
+void sched_wakeup(thread_t *thread) {
+    if (!thread) return;
+
+    irq_state_t flags = spinlock_acquire_irqsave(&thread->sched_lock);
+    bool queue = false;
+    if (thread->state == THREAD_STATE_BLOCKED) {
+        thread->state = THREAD_STATE_READY;
+        //still switching away, the CPU it's leaving queues it when done
+        queue = !thread->on_cpu;
+    }
+    spinlock_release_irqrestore(&thread->sched_lock, flags);
+
+    if (queue) sched_add(thread);
+}
+
+//kernel half of getting a thread that was interrupted in usermode (or never
+//ran) back there, runs on the thread's own empty kernel stack
+static void resume_user(void *arg) {
+    thread_t *thread = (thread_t *)arg;
+    sched_switch_finish();
+    arch_return_to_usermode(&thread->context);
+}
+
+//pick next thread and switch to it
+static void schedule(void) {
+    irq_state_t flags = arch_irq_save();
+    uint32 cpu = arch_cpu_id();
+    sched_cpu_t *sc = &sched_cpus[cpu];
+    thread_t *current = thread_current();
+    thread_t *next = rq_pop(&sc->rq);
+
+    if (!next) {
+        //nothing queued - a runnable thread keeps the CPU (a sleeper woken
+        //before it got to switch away counts, nobody else will queue it while
+        //it is on_cpu), otherwise look for work elsewhere before going idle
+        if (current && current != sc->idle &&
+            (current->state == THREAD_STATE_RUNNING || current->state == THREAD_STATE_READY)) {
+            current->state = THREAD_STATE_RUNNING;
+            arch_irq_restore(flags);
+            return;
+        }
+        if (!sc->idle) {
+            arch_irq_restore(flags);
+            return;
+        }
+        next = steal_work(cpu);
+    }
+
+    if (!next) {
+        next = sc->idle;
+        if (next == current) {
+            arch_irq_restore(flags);
+            return;
+        }
+    }
+
+    if (current && current != sc->idle) {
+        //requeued by sched_switch_finish() once its context is saved if it's
+        //still runnable, a blocked thread is left to whoever wakes it
+        if (current->state == THREAD_STATE_RUNNING) current->state = THREAD_STATE_READY;
+        sc->prev = current;
+    }
+
+    set_running(current, next);
+
+    //a context saved by the ISR (or a new user thread) is a usermode one and
+    //has to be entered with iretq from the thread's kernel stack
+    arch_context_t *next_ctx = &next->context;
+    if ((next->context.cs & 3) == 3) {
+        arch_context_init(&sc->resume, kernel_stack_top(next), resume_user, next);
+        next_ctx = &sc->resume;
+    }
+
     //switch CPU context
     if (current) {
-        arch_context_switch(&current->context, &next->context);
+        arch_context_switch(&current->context, next_ctx);
     } else {
-        arch_context_load(&next->context);
+        arch_context_load(next_ctx);
     }
+
+    //back on this thread, possibly on another CPU
+    sched_switch_finish();
+    arch_irq_restore(flags);
 }
 
 void sched_yield(void) {
     schedule();
 }
 
+void sched_block(void) {
+    schedule();
+}
+
 void sched_exit(void) {
     //disable interrupts - critical section soooo can't have timer fire during exit
     arch_interrupts_disable();
-    
+
     thread_t *current = thread_current();
     if (!current) {
         arch_interrupts_enable();
         return;
     }
-    
-    //mark as dead and add to dead list for cleanup
+
+    //mark as dead and add to this CPU's dead list for cleanup
+    sched_cpu_t *sc = this_cpu();
     current->state = THREAD_STATE_DEAD;
-    current->sched_next = dead_list_head;
-    dead_list_head = current;
-    
+    current->sched_next = sc->dead_list;
+    sc->dead_list = current;
+
     //clear current thread
     thread_set_current(NULL);
-    
-    //schedule next thread (will be idle if no others)
+
+    //switch to the next thread (idle if no others), never comes back
     schedule();
-    
-    //schedule() set up the next thread - we need to actually jump to it
-    //interrupts will be re-enabled when we iret/sysret to the next thread
-    thread_t *next = thread_current();
-    if (next) {
-        if ((next->context.cs & 3) == 3) {
-            //usermode thread
-            arch_enter_usermode(&next->context);
-        } else {
-            //kernel thread - load its context
-            arch_context_load(&next->context);
-        }
-    }
-    
+
     //should never reach here
     for(;;) arch_halt();
 }
 
-//ISR-safe preemption 
+//ISR-safe preemption
 //only updates scheduler state no context swithc
 //the ISR will restore the new thread's context via its normal iretq path
 static void sched_preempt(void) {
     thread_t *current = thread_current();
-    
-    //only preempt if there's an actual runnable thread in the queue
-    //we can't switch to idle via ISR path because its context wasn't
-    //set up for iretq restoration (it was set up for cooperative switching)
-    if (!run_queue_head) return;  //nothing to preempt to
-    
-    thread_t *next = run_queue_head;
-    
-    //if current thread is still running, move to end of queue
-    if (current && current->state == THREAD_STATE_RUNNING && current != idle_thread) {
+
+    //only preempt if there's an actual runnable thread in our queue at our
+    //priority or better, we can't switch to idle via ISR path because it
+    //runs on a boot stack that has no context saved for iretq restoration
+    run_queue_t *rq = &this_cpu()->rq;
+    if (current && rq_top(rq) > current->priority) return;
+    thread_t *next = rq_pop(rq);
+    if (!next) return;  //nothing to preempt to
+
+    set_running(current, next);
+
+    //the ISR saved current's context already so it can be queued right away
+    if (current && current->state == THREAD_STATE_RUNNING && !is_idle(current)) {
         current->state = THREAD_STATE_READY;
-        sched_remove(current);
-        sched_add(current);
+        if (off_cpu(current)) sched_add(current);
     }
-    
-    if (next == current) return;  //same thread, nothing to do
-    
-    //update scheduler state - the ISR saved current's context already
-    //and will restore next's context via iretq
-    if (next != idle_thread) {
-        sched_remove(next);
-    }
-    next->state = THREAD_STATE_RUNNING;
-    thread_set_current(next);
-    process_set_current(next->process);
-    
-    //switch address space if needed
-    process_t *next_proc = next->process;
-    process_t *curr_proc = current ? current->process : NULL;
-    
-    if (next_proc && next_proc->pagemap) {
-        mmu_switch((pagemap_t *)next_proc->pagemap);
-    } else if (curr_proc && curr_proc->pagemap) {
-        mmu_switch(mmu_get_kernel_pagemap());
+}
+
+//preempt current if its slice is up or a better thread waits on our queue
+static void check_preempt(sched_cpu_t *sc, thread_t *current, bool expired, int from_usermode) {
+    uint32 top = rq_top(&sc->rq);
+    if (!expired && top >= current->priority) return;
+
+    if (from_usermode) {
+        sched_preempt();  //ISR-safe: only updates state, lets ISR do context switch
+    } else if (top <= current->priority) {
+        //kernel code (a syscall or kernel thread) is switched away from on
+        //the way out of the interrupt if it isn't in a critical section, or
+        //as soon as it leaves one (see sched_preempt_pending)
+        arch_set_need_resched(true);
     }
-    
-    //set kernel stack for ring 3 -> ring 0 transitions
-    void *kernel_stack_top = (char *)next->kernel_stack + next->kernel_stack_size;
-    arch_set_kernel_stack(kernel_stack_top);
 }
 
 void sched_tick(int from_usermode) {
-    //reap dead threads
-    reap_dead_threads();
-    
-    tick_count++;
-    if (tick_count >= time_slice) {
-        tick_count = 0;
-        //only preempt when interrupted from usermode
-        //kernel-mode preemption is not safe (thread may be in syscall)
-        if (from_usermode) {
-            sched_preempt();  //ISR-safe: only updates state, lets ISR do context switch
-        }
+    sched_cpu_t *sc = this_cpu();
+    thread_t *current = thread_current();
+    if (!current || current == sc->idle) return;
+
+    //the timer can go off early (it only reaches so far in one go, or the
+    //PIT drives us) so check the slice against the clock
+    uint64 now = arch_timer_ns();
+    bool expired = now >= sc->slice_end;
+
+    //a thread that burns its whole slice loses some of its wakeup bonus,
+    //CPU bound work sinks below threads that mostly wait for input
+    if (expired) {
+        if (current->bonus > -BONUS_MAX) current->bonus--;
+        update_priority(current);
+        sc->slice_end = now + time_slice(current);
     }
+    arch_timer_oneshot(sc->slice_end);
+
+    check_preempt(sc, current, expired, from_usermode);
+}
+
+void sched_resched_ipi(int from_usermode) {
+    sched_cpu_t *sc = this_cpu();
+    thread_t *current = thread_current();
+    if (!current || current == sc->idle) return;  //the idle loop finds the work itself
+
+    //a preemption held off by a critical section comes through here too
+    check_preempt(sc, current, arch_need_resched(), from_usermode);
+}
+
+bool sched_preempt_pending(void) {
+    return arch_need_resched() && arch_preempt_count() == 0;
+}
+
+void sched_preempt_kernel(void) {
+    arch_set_need_resched(false);
+
+    thread_t *current = thread_current();
+    if (!current || is_idle(current)) return;
+
+    //like sched_preempt() never hand the CPU to a worse thread
+    if (rq_top(&this_cpu()->rq) > current->priority) return;
+    schedule();
+}
+
+void sched_boost(thread_t *thread) {
+    if (!thread) return;
+    thread->bonus = BONUS_MAX;
+    if (!thread->rq) update_priority(thread);
+}
+
+int sched_set_params(thread_t *thread, uint32 sched_class, int32 nice) {
+    if (!thread) return -1;
+    if (sched_class != SCHED_CLASS_INTERACTIVE && sched_class != SCHED_CLASS_BATCH) return -1;
+    if (nice < SCHED_NICE_MIN || nice > SCHED_NICE_MAX) return -1;
+
+    //a queued thread's level must not change under it
+    bool queued = __atomic_load_n(&thread->rq, __ATOMIC_ACQUIRE) != NULL;
+    if (queued) sched_remove(thread);
+
+    thread->sched_class = sched_class;
+    thread->nice = nice;
+    thread->bonus = 0;
+    update_priority(thread);
+
+    if (queued) sched_add(thread);
+    return 0;
 }
 
 void sched_start(void) {
-    thread_t *first = pick_next();
-    if (!first) {
-        printf("[sched] no threads to run!\n");
-        return;
-    }
-    
-    sched_remove(first);
-    first->state = THREAD_STATE_RUNNING;
-    thread_set_current(first);
-    process_set_current(first->process);
-    
-    //switch address space if first thread has user pagemap
-    if (first->process && first->process->pagemap) {
-        mmu_switch((pagemap_t *)first->process->pagemap);
-    }
-    
-    //set kernel stack for ring 3 -> ring 0 transitions
-    void *kernel_stack_top = (char *)first->kernel_stack + first->kernel_stack_size;
-    arch_set_kernel_stack(kernel_stack_top);
-    
-    printf("[sched] starting scheduler with thread %llu\n", first->tid);
-    
-    //check if this is a usermode thread (cs has RPL=3)
-    if ((first->context.cs & 3) == 3) {
-        //enter usermode for the first time
-        arch_enter_usermode(&first->context);
-    } else {
-        //kernel thread so just jump to entry point
-        void (*entry)(void *) = (void (*)(void *))first->context.rip;
-        void *arg = (void *)first->context.rdi;
-        entry(arg);
+    sched_cpu_t *sc = this_cpu();
+    thread_t *idle = sc->idle;
+    if (!idle) {
+        printf("[sched] ERR: CPU %u has no idle thread\n", arch_cpu_id());
+        for (;;) arch_halt();
     }
+
+    //this stack becomes the idle thread's, queued work is picked up from its loop
+    idle->state = THREAD_STATE_RUNNING;
+    thread_set_current(idle);
+    process_set_current(idle->process);
+
+    printf("[sched] CPU %u entering scheduler\n", arch_cpu_id());
+
+    arch_interrupts_enable();
+    idle_loop();
 }
@@ -3,24 +3,79 @@
 
 #include <proc/thread.h>
 
-//initialize scheduler
+//priorities, 0 is the best - the queue with the best priority always runs
+//first and threads at the same priority take turns
+#define SCHED_PRIORITIES        32
+#define SCHED_BAND_SIZE         16
+#define SCHED_BATCH_FIRST       16
+
+//scheduling classes
+//interactive threads use priorities 0-15 with short slices, batch threads
+//16-31 with long slices and only run when no interactive thread is ready
+#define SCHED_CLASS_INTERACTIVE 0
+#define SCHED_CLASS_BATCH       1
+
+//nice moves a thread within its class's band (lower is better)
+#define SCHED_NICE_MIN          -8
+#define SCHED_NICE_MAX          7
+
+//initialize scheduler (and the boot CPU's idle thread)
 void sched_init(void);
 
-//add thread to run queue
+//set up scheduler state for another CPU before it is started
+void sched_init_cpu(uint32 cpu);
+
+//make a thread runnable, it goes on the calling CPU's run queue unless the
+//CPU it last ran on is idle
 void sched_add(thread_t *thread);
 
-//remove thread from run queue
+//take a thread off whichever run queue it is on (O(1))
 void sched_remove(thread_t *thread);
 
+//make a blocked thread runnable again, safe against the thread still being
+//on its way off a CPU (does nothing if it isn't blocked)
+void sched_wakeup(thread_t *thread);
+
+//give up the CPU, the current thread must already be marked BLOCKED and be
+//on something that will wake it with sched_wakeup()
+void sched_block(void);
+
 //yield current thread (cooperative)
 void sched_yield(void);
 
-//called from timer interrupt for preemptive scheduling
+//called from the timer interrupt (armed for the end of the current slice)
+//usermode is preempted right there, kernel code once it's outside critical
+//sections (preemption count zero, interrupts on)
 void sched_tick(int from_usermode);
 
-//start the scheduler (never returns - idle thread runs when no work)
+//called from the reschedule IPI, another CPU (or we) may have queued a thread
+//that outranks the current one
+void sched_resched_ipi(int from_usermode);
+
+//asked by the interrupt return path before going back to kernel code with
+//interrupts on, true if it should call sched_preempt_kernel() first
+bool sched_preempt_pending(void);
+
+//switch away from kernel code interrupted by the tick, runs on the thread's
+//own stack with interrupts off and returns once it is scheduled again
+void sched_preempt_kernel(void);
+
+//set a thread's class and nice value, 0 on success and -1 if out of range
+int sched_set_params(thread_t *thread, uint32 sched_class, int32 nice);
+
+//priority boost for a thread that waited on something and is now woken,
+//using up whole time slices wears it off again
+void sched_boost(thread_t *thread);
+
+//start the scheduler on the calling CPU (never returns - the calling stack
+//becomes the CPU's idle thread and runs queued work from there)
 void sched_start(void);
 
+//complete a context switch, every path that starts running a thread after a
+//switch calls this first (it requeues the thread switched away from if it is
+//still runnable or was woken while switching out)
+void sched_switch_finish(void);
+
 //exit current thread and schedule next (never returns)
 void sched_exit(void);
 
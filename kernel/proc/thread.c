@@ -3,13 +3,25 @@
 #include <proc/sched.h>
 #include <arch/context.h>
 #include <arch/interrupts.h>
+#include <arch/cpu.h>
 #include <mm/kheap.h>
 #include <lib/string.h>
+#include <lib/io.h>
 
 #define KERNEL_STACK_SIZE 16384  //16KB
 
 static uint64 next_tid = 1;
-static thread_t *current_thread = NULL;
+
+static kmem_cache_t *thread_cache = NULL;
+
+void thread_init(void) {
+    thread_cache = kmem_cache_create("thread_t", sizeof(thread_t), 0, NULL);
+    if (!thread_cache) printf("[thread] ERR: failed to create thread cache\n");
+}
+
+static thread_t *thread_alloc(void) {
+    return kmem_cache_zalloc(thread_cache);
+}
 
 //thread object ops (called when all handles to a thread are closed)
 static int thread_obj_close(object_t *obj) {
@@ -31,6 +43,9 @@ static object_ops_t thread_object_ops = {
 static void thread_entry_trampoline(void *thread_ptr) {
     thread_t *thread = (thread_t *)thread_ptr;
     
+    //we got here from a context switch that still has loose ends
+    sched_switch_finish();
+    
     //enable interrupts before calling user code
     arch_interrupts_enable();
     
@@ -44,17 +59,17 @@ static void thread_entry_trampoline(void *thread_ptr) {
 thread_t *thread_create(process_t *proc, void (*entry)(void *), void *arg) {
     if (!proc) return NULL;
     
-    thread_t *thread = kzalloc(sizeof(thread_t));
+    thread_t *thread = thread_alloc();
     if (!thread) return NULL;
     
-    thread->tid = next_tid++;
+    thread->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
     thread->process = proc;
     thread->state = THREAD_STATE_READY;
     
     //create kernel object for this thread
     thread->obj = object_create(OBJECT_THREAD, &thread_object_ops, thread);
     if (!thread->obj) {
-        kfree(thread);
+        kmem_cache_free(thread_cache, thread);
         return NULL;
     }
     
@@ -66,7 +81,7 @@ thread_t *thread_create(process_t *proc, void (*entry)(void *), void *arg) {
     thread->kernel_stack = kmalloc(KERNEL_STACK_SIZE);
     if (!thread->kernel_stack) {
         object_deref(thread->obj);
-        kfree(thread);
+        kmem_cache_free(thread_cache, thread);
         return NULL;
     }
     thread->kernel_stack_size = KERNEL_STACK_SIZE;
@@ -106,7 +121,7 @@ void thread_destroy(thread_t *thread) {
     }
     
     kfree(thread->kernel_stack);
-    kfree(thread);
+    kmem_cache_free(thread_cache, thread);
 }
 
 object_t *thread_get_object(thread_t *thread) {
@@ -114,28 +129,29 @@ object_t *thread_get_object(thread_t *thread) {
     return thread->obj;
 }
 
+//the running thread lives in the per-CPU data so each CPU sees its own
 thread_t *thread_current(void) {
-    return current_thread;
+    return (thread_t *)percpu_current_thread();
 }
 
 void thread_set_current(thread_t *thread) {
-    current_thread = thread;
+    percpu_get()->current_thread = thread;
 }
 
 thread_t *thread_create_user(process_t *proc, void *entry, void *user_stack) {
     if (!proc) return NULL;
     
-    thread_t *thread = kzalloc(sizeof(thread_t));
+    thread_t *thread = thread_alloc();
     if (!thread) return NULL;
     
-    thread->tid = next_tid++;
+    thread->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
     thread->process = proc;
     thread->state = THREAD_STATE_READY;
     
     //create kernel object for this thread
     thread->obj = object_create(OBJECT_THREAD, &thread_object_ops, thread);
     if (!thread->obj) {
-        kfree(thread);
+        kmem_cache_free(thread_cache, thread);
         return NULL;
     }
     
@@ -147,7 +163,7 @@ thread_t *thread_create_user(process_t *proc, void *entry, void *user_stack) {
     thread->kernel_stack = kmalloc(KERNEL_STACK_SIZE);
     if (!thread->kernel_stack) {
         object_deref(thread->obj);
-        kfree(thread);
+        kmem_cache_free(thread_cache, thread);
         return NULL;
     }
     thread->kernel_stack_size = KERNEL_STACK_SIZE;
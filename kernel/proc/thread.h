@@ -4,8 +4,10 @@
 #include <arch/types.h>
 #include <arch/context.h>
 #include <obj/object.h>
+#include <lib/spinlock.h>
 
 struct process;
+struct run_queue;
 
 //thread states
 #define THREAD_STATE_READY   0
@@ -36,13 +38,34 @@ typedef struct thread {
     //linked list within process
     struct thread *next;
     
-    //scheduler queue link
+    //scheduler queue links and the run queue we sit on (NULL when not queued)
     struct thread *sched_next;
+    struct thread *sched_prev;
+    struct run_queue *rq;
+    
+    //CPU the thread last ran on
+    uint32 cpu;
+    
+    //scheduling parameters (see sched.h), priority is the effective one
+    //derived from the class, nice and the dynamic wakeup bonus
+    uint8 sched_class;
+    int8 nice;
+    int8 bonus;
+    uint8 priority;
     
     //wait queue link (for blocking)
     struct thread *wait_next;
+    
+    //set while a CPU is running the thread or still switching away from it,
+    //a blocked thread woken in that window is queued by sched_switch_finish()
+    //instead of the waker (sched_lock orders the two)
+    bool on_cpu;
+    spinlock_t sched_lock;
 } thread_t;
 
+//set up the thread cache (called by proc_init)
+void thread_init(void);
+
 //create a thread in a process
 thread_t *thread_create(struct process *proc, void (*entry)(void *), void *arg);
 
@@ -7,18 +7,14 @@
 void wait_queue_init(wait_queue_t *wq) {
     wq->head = NULL;
     wq->tail = NULL;
+    spinlock_init(&wq->lock);
 }
 
-void thread_sleep(wait_queue_t *wq) {
-    thread_t *current = thread_current();
-    if (!current) return;
-    
-    irq_state_t flags = arch_irq_save();
-    
-    //mark as blocked
+//queue the current thread on wq, the caller holds wq->lock
+static void enqueue_current(wait_queue_t *wq, thread_t *current) {
+    //a waker can only find us once wq->lock is dropped so the state is
+    //settled by the time sched_wakeup() looks at it
     current->state = THREAD_STATE_BLOCKED;
-    
-    //add to wait queue
     current->wait_next = NULL;
     if (wq->tail) {
         wq->tail->wait_next = current;
@@ -26,24 +22,44 @@ void thread_sleep(wait_queue_t *wq) {
         wq->head = current;
     }
     wq->tail = current;
+}
+
+void thread_sleep(wait_queue_t *wq) {
+    thread_t *current = thread_current();
+    if (!current) return;
     
+    irq_state_t flags = spinlock_acquire_irqsave(&wq->lock);
+    enqueue_current(wq, current);
+    spinlock_release(&wq->lock);
+    
+    //switch away until woken, interrupts stay off so a wakeup from an IRQ
+    //on this CPU can't get in before we're off it
+    sched_block();
     arch_irq_restore(flags);
+}
+
+void thread_sleep_locked(wait_queue_t *wq, spinlock_t *lock) {
+    thread_t *current = thread_current();
+    if (!current) return;
     
-    //wait until woken
-    while (current->state == THREAD_STATE_BLOCKED) {
-        arch_interrupts_enable();  //enable before halt
-        arch_halt();               //wait for interrupt
-    }
+    //we're on the queue before lock is dropped so a waker that changes the
+    //condition under it is bound to see us
+    spinlock_acquire(&wq->lock);
+    enqueue_current(wq, current);
+    spinlock_release(&wq->lock);
+    spinlock_release(lock);
     
-    //we were woken - thread_wake_one added us to run queue with READY state
-    //but we're continuing directly (not via scheduler) so clean up
-    //remove from run queue and mark as RUNNING
-    sched_remove(current);
-    current->state = THREAD_STATE_RUNNING;
+    sched_block();
+    spinlock_acquire(lock);
+}
+
+static void wake_thread(thread_t *thread) {
+    sched_boost(thread);
+    sched_wakeup(thread);
 }
 
 void thread_wake_one(wait_queue_t *wq) {
-    irq_state_t flags = arch_irq_save();
+    irq_state_t flags = spinlock_acquire_irqsave(&wq->lock);
     
     thread_t *thread = wq->head;
     if (thread) {
@@ -54,25 +70,22 @@ void thread_wake_one(wait_queue_t *wq) {
         }
         thread->wait_next = NULL;
         
-        //mark as ready and add back to run queue
-        thread->state = THREAD_STATE_READY;
-        sched_add(thread);
+        wake_thread(thread);
     }
     
-    arch_irq_restore(flags);
+    spinlock_release_irqrestore(&wq->lock, flags);
 }
 
 void thread_wake_all(wait_queue_t *wq) {
-    irq_state_t flags = arch_irq_save();
+    irq_state_t flags = spinlock_acquire_irqsave(&wq->lock);
     
     while (wq->head) {
         thread_t *thread = wq->head;
         wq->head = thread->wait_next;
         thread->wait_next = NULL;
-        thread->state = THREAD_STATE_READY;
-        sched_add(thread);
+        wake_thread(thread);
     }
     wq->tail = NULL;
     
-    arch_irq_restore(flags);
+    spinlock_release_irqrestore(&wq->lock, flags);
 }
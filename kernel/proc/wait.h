@@ -2,6 +2,7 @@
 #define PROC_WAIT_H
 
 #include <arch/types.h>
+#include <lib/spinlock.h>
 
 struct thread;
 
@@ -9,15 +10,22 @@ struct thread;
 typedef struct wait_queue {
     struct thread *head;
     struct thread *tail;
+    spinlock_t lock;
 } wait_queue_t;
 
 //initialize a wait queue
 void wait_queue_init(wait_queue_t *wq);
 
 //put current thread to sleep on wait queue
-//removes from run queue, adds to wait queueand reschedules
+//adds to wait queue and switches to the next runnable thread until woken
+//callers re-check what they waited for since the wakeup may be for someone else
 void thread_sleep(wait_queue_t *wq);
 
+//same but for a condition protected by lock, which the caller holds with
+//interrupts off - it is dropped only once we're on the queue (so a wakeup
+//can't be lost in between) and held again when we return
+void thread_sleep_locked(wait_queue_t *wq, spinlock_t *lock);
+
 //wake one thread from wait queue
 //removes from wait queue, adds to run queue
 void thread_wake_one(wait_queue_t *wq);
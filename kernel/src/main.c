@@ -25,7 +25,6 @@
 #include <kernel/elf64.h>
 
 extern void arch_enter_usermode(arch_context_t *ctx);
-extern void percpu_set_kernel_stack(void *stack_top);
 
 
 //load and execute init from initrd
@@ -71,6 +70,12 @@ static void spawn_init(void) {
         return;
     }
     printf("[init] entry: 0x%lX\n", info.entry);
+
+    //the process owns the segments from here on and frees them on exit
+    for (uint32 i = 0; i < info.segment_count; i++) {
+        process_vma_add(proc, info.segments[i].virt_addr, info.segments[i].pages * PAGE_SIZE,
+                        MMU_FLAG_USER | PROC_VMA_OWNED, NULL, 0);
+    }
     
     //allocate user stack
     uintptr user_stack_base = 0x7FFFFFFFE000ULL;
@@ -83,6 +88,8 @@ static void spawn_init(void) {
     }
     mmu_map_range(proc->pagemap, user_stack_base - stack_size, stack_phys, 
                   stack_size / 4096, MMU_FLAG_WRITE | MMU_FLAG_USER);
+    process_vma_add(proc, user_stack_base - stack_size, stack_size,
+                    MMU_FLAG_WRITE | MMU_FLAG_USER | PROC_VMA_OWNED, NULL, 0);
     
     //set up argc/argv
     char *init_argv[] = { "/initrd/init", NULL };
@@ -99,9 +106,6 @@ static void spawn_init(void) {
     }
     printf("[init] created thread TID %lu\n", thread->tid);
     
-    //set up per-CPU kernel stack for syscalls
-    percpu_set_kernel_stack((char*)thread->kernel_stack + thread->kernel_stack_size);
-    
     //add init thread to scheduler
     sched_add(thread);
 }
@@ -127,6 +131,9 @@ void kernel_main(void) {
     sched_init();
     syscall_init();
     
+    //bring up the other CPUs, they idle until there is work
+    arch_smp_init();
+    
     //spawn init process
     spawn_init();
     
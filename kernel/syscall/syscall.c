@@ -7,8 +7,10 @@
 #include <obj/handle.h>
 #include <ipc/channel.h>
 #include <arch/cpu.h>
+#include <arch/timer.h>
 #include <mm/pmm.h>
 #include <mm/kheap.h>
+#include <mm/vmo.h>
 #include <lib/io.h>
 #include <lib/string.h>
 
@@ -31,6 +33,14 @@ static int64 sys_yield(void) {
     return 0;
 }
 
+static int64 sys_sched_set(uint32 sched_class, int32 nice) {
+    return sched_set_params(thread_current(), sched_class, nice);
+}
+
+static int64 sys_clock_get(void) {
+    return (int64)arch_timer_ns();
+}
+
 static int64 sys_debug_write(const char *buf, size count) {
     if (!buf) return -1;
     for (size i = 0; i < count; i++) {
@@ -68,24 +78,46 @@ static int64 sys_spawn(const char *path, int argc, char **argv) {
         return -5;
     }
 
+    //the process owns the segments from here on and frees them on exit
+    for (uint32 i = 0; i < info.segment_count; i++) {
+        if (process_vma_add(proc, info.segments[i].virt_addr, info.segments[i].pages * PAGE_SIZE,
+                            MMU_FLAG_USER | PROC_VMA_OWNED, NULL, 0) < 0) {
+            //take back the ones already added so the frames are freed once
+            for (uint32 j = 0; j < i; j++) process_vma_remove(proc, info.segments[j].virt_addr);
+            elf_unload_user(proc->pagemap, &info);
+            process_destroy(proc);
+            return -5;
+        }
+    }
+
     //allocate user stack
     uintptr user_stack_base = 0x7FFFFFFFE000ULL;
     size stack_size = 0x2000;
 
     uintptr stack_phys = (uintptr)pmm_alloc(stack_size / 4096);
-    if (!stack_phys) return -6;
+    if (!stack_phys) {
+        process_destroy(proc);
+        return -6;
+    }
     mmu_map_range(proc->pagemap, user_stack_base - stack_size, stack_phys,
                     stack_size / 4096, MMU_FLAG_WRITE | MMU_FLAG_USER);
+    if (process_vma_add(proc, user_stack_base - stack_size, stack_size,
+                        MMU_FLAG_WRITE | MMU_FLAG_USER | PROC_VMA_OWNED, NULL, 0) < 0) {
+        mmu_unmap_range(proc->pagemap, user_stack_base - stack_size, stack_size / 4096);
+        pmm_free((void *)stack_phys, stack_size / 4096);
+        process_destroy(proc);
+        return -6;
+    }
     
     //setup argc/argv
     uintptr user_stack_top = process_setup_user_stack(stack_phys, user_stack_base,
                                                     stack_size, argc, argv);
     //create user thread
     thread_t *thread = thread_create_user(proc, (void*)info.entry, (void*)user_stack_top);
-    if (!thread) return -7;
-
-    //setup kernel stack for syscalls
-    percpu_set_kernel_stack((char*)thread->kernel_stack + thread->kernel_stack_size);
+    if (!thread) {
+        process_destroy(proc);
+        return -7;
+    }
 
     //add thread to scheduler
     sched_add(thread);
@@ -108,32 +140,32 @@ static int64 sys_get_obj(handle_t parent, const char *path, handle_rights_t righ
     }
     
     //otherwise, parent should be a directory - lookup within it
-    object_t *parent_obj = handle_get(parent);
-    if (!parent_obj) return -2;
+    //one copy of the entry gives both the object and its rights
+    process_t *proc = process_current();
+    proc_handle_t entry;
+    if (!proc || process_get_handle_entry(proc, parent, &entry) < 0) return -2;
+    object_t *parent_obj = entry.obj;
     
     //check parent has read rights (needed to traverse)
-    if (!handle_has_rights(parent, HANDLE_RIGHT_READ)) {
+    if (!rights_has(entry.rights, HANDLE_RIGHT_READ)) {
+        object_deref(parent_obj);
         return -3;
     }
     
     //check parent supports lookup
     if (!parent_obj->ops || !parent_obj->ops->lookup) {
+        object_deref(parent_obj);
         return -4;  //not a directory or doesn't support lookup
     }
     
     //do the lookup
     object_t *child = parent_obj->ops->lookup(parent_obj, path);
+    object_deref(parent_obj);
     if (!child) {
         return -5;  //not found
     }
     
     //grant handle with requested rights
-    process_t *proc = process_current();
-    if (!proc) {
-        object_deref(child);
-        return -6;
-    }
-    
     int h = process_grant_handle(proc, child, rights);
     object_deref(child);  //grant_handle adds its own ref
     return h;
@@ -281,6 +313,108 @@ static int64 sys_channel_recv_msg(handle_t ep, void *data_buf, size data_len,
     return 0;
 }
 
+//VMO data moves through a kernel buffer in chunks so the copy to or from
+//userspace never happens under the VMO lock (the user buffer may itself be
+//a demand paged mapping of the same VMO)
+#define VMO_COPY_CHUNK (16 * PAGE_SIZE)
+
+//create a VMO, returns its handle
+static int64 sys_vmo_create(size len, uint32 flags, handle_rights_t rights) {
+    process_t *proc = process_current();
+    if (!proc) return -1;
+    if (rights == HANDLE_RIGHT_NONE) rights = HANDLE_RIGHTS_DEFAULT | HANDLE_RIGHT_MAP;
+    return vmo_create(proc, len, flags, rights);
+}
+
+//read from a VMO at offset, returns bytes read
+static int64 sys_vmo_read(handle_t h, void *buf, size len, size offset) {
+    if (!buf || len == 0) return -1;
+    
+    process_t *proc = process_current();
+    if (!proc) return -1;
+    
+    size chunk = len < VMO_COPY_CHUNK ? len : VMO_COPY_CHUNK;
+    void *kbuf = kmalloc(chunk);
+    if (!kbuf) return -3;
+    
+    size done = 0;
+    int64 result = 0;
+    while (done < len) {
+        size n = len - done < chunk ? len - done : chunk;
+        result = vmo_read(proc, h, kbuf, n, offset + done);
+        if (result <= 0) break;
+        memcpy((char *)buf + done, kbuf, result);
+        done += result;
+        if ((size)result < n) break; //hit the end of the VMO
+    }
+    
+    kfree(kbuf);
+    return done ? (int64)done : result;
+}
+
+//write to a VMO at offset, returns bytes written
+static int64 sys_vmo_write(handle_t h, const void *buf, size len, size offset) {
+    if (!buf || len == 0) return -1;
+    
+    process_t *proc = process_current();
+    if (!proc) return -1;
+    
+    size chunk = len < VMO_COPY_CHUNK ? len : VMO_COPY_CHUNK;
+    void *kbuf = kmalloc(chunk);
+    if (!kbuf) return -3;
+    
+    size done = 0;
+    int64 result = 0;
+    while (done < len) {
+        size n = len - done < chunk ? len - done : chunk;
+        memcpy(kbuf, (const char *)buf + done, n);
+        result = vmo_write(proc, h, kbuf, n, offset + done);
+        if (result <= 0) break;
+        done += result;
+        if ((size)result < n) break;
+    }
+    
+    kfree(kbuf);
+    return done ? (int64)done : result;
+}
+
+//map a VMO, returns the address or 0 on failure
+static int64 sys_vmo_map(handle_t h, void *vaddr_hint, size offset, size len, handle_rights_t rights) {
+    process_t *proc = process_current();
+    if (!proc || !proc->pagemap) return 0;
+    return (int64)(uintptr)vmo_map(proc, h, vaddr_hint, offset, len, rights);
+}
+
+static int64 sys_vmo_unmap(void *vaddr, size len) {
+    process_t *proc = process_current();
+    if (!proc || !proc->pagemap) return -1;
+    return vmo_unmap(proc, vaddr, len);
+}
+
+static int64 sys_vmo_get_size(handle_t h) {
+    process_t *proc = process_current();
+    if (!proc) return -1;
+    
+    //a VMO is never empty so 0 means the handle isn't one
+    size bytes = vmo_get_size(proc, h);
+    return bytes ? (int64)bytes : -1;
+}
+
+static int64 sys_vmo_set_size(handle_t h, size len) {
+    process_t *proc = process_current();
+    if (!proc) return -1;
+    return vmo_set_size(proc, h, len);
+}
+
+//clone a VMO, returns the new handle
+static int64 sys_vmo_create_child(handle_t h, uint32 options, size offset, size len,
+                                  handle_rights_t rights) {
+    process_t *proc = process_current();
+    if (!proc) return -1;
+    if (rights == HANDLE_RIGHT_NONE) rights = HANDLE_RIGHTS_DEFAULT | HANDLE_RIGHT_MAP;
+    return vmo_create_child(proc, h, options, offset, len, rights);
+}
+
 int64 syscall_dispatch(uint64 num, uint64 arg1, uint64 arg2, uint64 arg3,
                        uint64 arg4, uint64 arg5, uint64 arg6) {
     switch (num) {
@@ -292,6 +426,8 @@ int64 syscall_dispatch(uint64 num, uint64 arg1, uint64 arg2, uint64 arg3,
         case SYS_GET_OBJ: return sys_get_obj((handle_t)arg1, (const char *)arg2, (handle_rights_t)arg3);
         case SYS_HANDLE_READ: return sys_handle_read((handle_t)arg1, (void *)arg2, (size)arg3);
         case SYS_HANDLE_WRITE: return sys_handle_write((handle_t)arg1, (const void *)arg2, (size)arg3);
+        case SYS_SCHED_SET: return sys_sched_set((uint32)arg1, (int32)arg2);
+        case SYS_CLOCK_GET: return sys_clock_get();
         case SYS_HANDLE_CLOSE: return sys_handle_close((handle_t)arg1);
         case SYS_CHANNEL_CREATE: return sys_channel_create((int32 *)arg1, (int32 *)arg2);
         case SYS_CHANNEL_SEND: return sys_channel_send((handle_t)arg1, (const void *)arg2, (size)arg3);
@@ -299,6 +435,16 @@ int64 syscall_dispatch(uint64 num, uint64 arg1, uint64 arg2, uint64 arg3,
         case SYS_CHANNEL_RECV_MSG: return sys_channel_recv_msg((handle_t)arg1, (void *)arg2, (size)arg3,
                                                                (int32 *)arg4, (uint32)arg5,
                                                                (channel_recv_result_t *)arg6);
+        case SYS_VMO_CREATE: return sys_vmo_create((size)arg1, (uint32)arg2, (handle_rights_t)arg3);
+        case SYS_VMO_READ: return sys_vmo_read((handle_t)arg1, (void *)arg2, (size)arg3, (size)arg4);
+        case SYS_VMO_WRITE: return sys_vmo_write((handle_t)arg1, (const void *)arg2, (size)arg3, (size)arg4);
+        case SYS_VMO_MAP: return sys_vmo_map((handle_t)arg1, (void *)arg2, (size)arg3, (size)arg4,
+                                             (handle_rights_t)arg5);
+        case SYS_VMO_UNMAP: return sys_vmo_unmap((void *)arg1, (size)arg2);
+        case SYS_VMO_GET_SIZE: return sys_vmo_get_size((handle_t)arg1);
+        case SYS_VMO_SET_SIZE: return sys_vmo_set_size((handle_t)arg1, (size)arg2);
+        case SYS_VMO_CREATE_CHILD: return sys_vmo_create_child((handle_t)arg1, (uint32)arg2, (size)arg3,
+                                                               (size)arg4, (handle_rights_t)arg5);
         default: return -1;
     }
 }
@@ -12,6 +12,8 @@
 #define SYS_GET_OBJ         5   //get object from namespace
 #define SYS_HANDLE_READ     6   //read from handle
 #define SYS_HANDLE_WRITE    7   //write to handle
+#define SYS_SCHED_SET       8   //set the calling thread's class and nice
+#define SYS_CLOCK_GET       9   //monotonic ns since boot (slow path of the clock page)
 
 //capability syscalls
 #define SYS_HANDLE_CLOSE    32
@@ -23,6 +25,11 @@
 #define SYS_VMO_READ        38
 #define SYS_VMO_WRITE       39
 #define SYS_CHANNEL_RECV_MSG 40  //receive with handles
+#define SYS_VMO_MAP         41
+#define SYS_VMO_UNMAP       42
+#define SYS_VMO_GET_SIZE    43
+#define SYS_VMO_SET_SIZE    44
+#define SYS_VMO_CREATE_CHILD 45 //copy-on-write clone
 
 #define SYS_MAX             64
 
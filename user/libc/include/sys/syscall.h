@@ -9,6 +9,8 @@
 #define SYS_GET_OBJ         5
 #define SYS_HANDLE_READ     6
 #define SYS_HANDLE_WRITE    7
+#define SYS_SCHED_SET       8
+#define SYS_CLOCK_GET       9
 
 #define SYS_HANDLE_CLOSE    32
 #define SYS_HANDLE_DUP      33
@@ -18,6 +20,12 @@
 #define SYS_VMO_CREATE      37
 #define SYS_VMO_READ        38
 #define SYS_VMO_WRITE       39
+#define SYS_CHANNEL_RECV_MSG 40
+#define SYS_VMO_MAP         41
+#define SYS_VMO_UNMAP       42
+#define SYS_VMO_GET_SIZE    43
+#define SYS_VMO_SET_SIZE    44
+#define SYS_VMO_CREATE_CHILD 45
 
 /* 
  *System V AMD64 syscall ABI:
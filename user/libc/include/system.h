@@ -11,6 +11,7 @@
 #define RIGHT_READ          (1 << 2)
 #define RIGHT_WRITE         (1 << 3)
 #define RIGHT_EXECUTE       (1 << 4)
+#define RIGHT_MAP           (1 << 5)
 
 //invalid handle sentinel
 #define INVALID_HANDLE      (-1)
@@ -21,6 +22,20 @@ int64 getpid(void);
 void yield(void);
 int spawn(char *path, int argc, char **argv);
 
+//scheduling - interactive threads always run before batch ones, nice
+//(SCHED_NICE_MIN to SCHED_NICE_MAX, lower is better) orders threads within
+//a class, threads that wait for input or messages get a temporary boost
+#define SCHED_CLASS_INTERACTIVE 0
+#define SCHED_CLASS_BATCH       1
+#define SCHED_NICE_MIN          -8
+#define SCHED_NICE_MAX          7
+
+int sched_set(uint32 sched_class, int32 nice);
+
+//time - nanoseconds since boot, never goes backwards, read straight from the
+//kernel's clock page without a syscall when the TSC is the clock source
+uint64 clock_get(void);
+
 //capability-based object access
 int32 get_obj(int32 parent, const char *path, uint32 rights);
 int handle_read(int32 h, void *buf, int len);
@@ -32,4 +47,21 @@ int channel_create(int32 *ep0, int32 *ep1);
 int channel_send(int32 ep, const void *data, int len);
 int channel_recv(int32 ep, void *buf, int buflen);
 
+//virtual memory objects
+#define VMO_RESIZABLE       (1 << 0)    //vmo_create flag, allows vmo_set_size
+#define VMO_CHILD_COW       (1 << 0)    //vmo_create_child option
+
+//rights of 0 give the default rights plus RIGHT_MAP
+int32 vmo_create(size len, uint32 flags, uint32 rights);
+int64 vmo_read(int32 h, void *buf, size len, size offset);
+int64 vmo_write(int32 h, const void *buf, size len, size offset);
+int64 vmo_get_size(int32 h);
+int vmo_set_size(int32 h, size len);
+int32 vmo_create_child(int32 h, uint32 options, size offset, size len, uint32 rights);
+
+//map len bytes from offset (page aligned), addr may be NULL to let the kernel
+//choose, returns NULL on failure
+void *vmo_map(int32 h, void *addr, size offset, size len, uint32 rights);
+int vmo_unmap(void *addr, size len);
+
 #endif
\ No newline at end of file
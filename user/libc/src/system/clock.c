@@ -0,0 +1,43 @@
+#include <types.h>
+#include <sys/syscall.h>
+
+//must match clock_page_t in the kernel (arch/amd64/timer.h)
+typedef struct {
+    uint32 seq;         //odd while the kernel is updating the page
+    uint32 flags;
+    uint64 tsc_base;
+    uint64 ns_base;
+    uint64 ns_mult;
+    uint64 tsc_hz;
+} clock_page_t;
+
+#define CLOCK_PAGE          0x00007FFFFFFFF000ULL
+#define CLOCK_PAGE_TSC      (1 << 0)
+
+static inline uint64 rdtsc(void) {
+    uint32 lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64)hi << 32) | lo;
+}
+
+uint64 clock_get(void) {
+    const volatile clock_page_t *cp = (const volatile clock_page_t *)CLOCK_PAGE;
+
+    for (;;) {
+        uint32 seq = __atomic_load_n(&cp->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;
+        if (!(cp->flags & CLOCK_PAGE_TSC)) break;
+
+        uint64 tsc_base = cp->tsc_base;
+        uint64 ns_base = cp->ns_base;
+        uint64 ns_mult = cp->ns_mult;
+        uint64 tsc = rdtsc();
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&cp->seq, __ATOMIC_RELAXED) != seq) continue;
+        return ns_base + (uint64)(((unsigned __int128)(tsc - tsc_base) * ns_mult) >> 32);
+    }
+
+    //no TSC yet, ask the kernel
+    return (uint64)__syscall0(SYS_CLOCK_GET);
+}
@@ -0,0 +1,6 @@
+#include <types.h>
+#include <sys/syscall.h>
+
+int sched_set(uint32 sched_class, int32 nice) {
+    return __syscall2(SYS_SCHED_SET, sched_class, nice);
+}
@@ -0,0 +1,34 @@
+#include <system.h>
+#include <sys/syscall.h>
+
+int32 vmo_create(size len, uint32 flags, uint32 rights) {
+    return __syscall3(SYS_VMO_CREATE, (long)len, (long)flags, (long)rights);
+}
+
+int64 vmo_read(int32 h, void *buf, size len, size offset) {
+    return __syscall4(SYS_VMO_READ, h, (long)buf, (long)len, (long)offset);
+}
+
+int64 vmo_write(int32 h, const void *buf, size len, size offset) {
+    return __syscall4(SYS_VMO_WRITE, h, (long)buf, (long)len, (long)offset);
+}
+
+int64 vmo_get_size(int32 h) {
+    return __syscall1(SYS_VMO_GET_SIZE, h);
+}
+
+int vmo_set_size(int32 h, size len) {
+    return __syscall2(SYS_VMO_SET_SIZE, h, (long)len);
+}
+
+int32 vmo_create_child(int32 h, uint32 options, size offset, size len, uint32 rights) {
+    return __syscall5(SYS_VMO_CREATE_CHILD, h, (long)options, (long)offset, (long)len, (long)rights);
+}
+
+void *vmo_map(int32 h, void *addr, size offset, size len, uint32 rights) {
+    return (void *)__syscall5(SYS_VMO_MAP, h, (long)addr, (long)offset, (long)len, (long)rights);
+}
+
+int vmo_unmap(void *addr, size len) {
+    return __syscall2(SYS_VMO_UNMAP, (long)addr, (long)len);
+}